@@ -0,0 +1,286 @@
+#!mruby
+#
+# Benchmark of mruby-brotli.
+#
+#   rake bench [BENCH_ARGS="options... [files...]"]
+#
+# or by a mruby built with bench_config.rb:
+#
+#   bin/mruby bench/bench-brotli.rb [options...] [files...]
+#
+# options:
+#
+#   --quick             quality 1,5,9,11 / lgwin 22 / chunk 65536 / repeat 1
+#   --quality=0,1,...   qualities to sweep (default: 0 to 11)
+#   --lgwin=10,16,...   window bits to sweep (default: 10,16,22,24)
+#   --chunk=4096,...    chunk sizes of the streaming methods (default: 4096,65536,1048576)
+#   --size=N            size of the synthetic corpora (default: 1048576)
+#   --repeat=N          takes the fastest of N runs (default: 3)
+#   --output=PATH       writes JSON into PATH instead of stdout
+#
+# The given files are used as the bundled corpus.
+# Without files, the sources of this repository are used.
+#
+# Measured operations:
+#
+#   Brotli::Encoder.encode          one-shot compression
+#   Brotli::Encoder#encode/finish   streaming compression, by chunks
+#   Brotli::Decoder.decode          one-shot decompression
+#   Brotli::Decoder#decode(size)    streaming decompression, by chunks
+#
+# Each result has ``mb_per_sec'' of the uncompressed data, ``ratio'' as
+# compressed / uncompressed, ``allocations'' as calls of mrb_malloc() and
+# friends (nil on mruby-3.2 or later), and ``peak_rss'' of the process in
+# bytes at the end of the case.
+#
+
+module BrotliBenchmark
+  DEFAULT_QUALITIES = (0 .. 11).to_a
+  DEFAULT_LGWINS = [10, 16, 22, 24]
+  DEFAULT_CHUNKS = [4 << 10, 64 << 10, 1 << 20]
+  DEFAULT_SIZE = 1 << 20
+  DEFAULT_REPEAT = 3
+
+  WORDS = %w(
+    the of and to in is that for it as was with be by on not he this are or
+    his from at which but have an they you were her she there been one all
+    brotli stream window quality encoder decoder buffer compress mruby ruby
+  )
+
+  class Options
+    attr_accessor :qualities, :lgwins, :chunks, :size, :repeat, :output, :files
+
+    def initialize(argv)
+      @qualities = DEFAULT_QUALITIES
+      @lgwins = DEFAULT_LGWINS
+      @chunks = DEFAULT_CHUNKS
+      @size = DEFAULT_SIZE
+      @repeat = DEFAULT_REPEAT
+      @output = nil
+      @files = []
+
+      # NOTE: mruby has no Regexp without any additional gems
+      argv.each do |arg|
+        unless arg[0] == "-"
+          @files << arg
+          next
+        end
+
+        name, value = arg.split("=", 2)
+        case name
+        when "--quick"
+          @qualities = [1, 5, 9, 11]
+          @lgwins = [22]
+          @chunks = [64 << 10]
+          @repeat = 1
+        when "--quality"
+          @qualities = integers(value)
+        when "--lgwin"
+          @lgwins = integers(value)
+        when "--chunk"
+          @chunks = integers(value)
+        when "--size"
+          @size = value.to_i
+        when "--repeat"
+          @repeat = [value.to_i, 1].max
+        when "--output"
+          @output = value
+        else
+          raise ArgumentError, "unknown option - #{arg}"
+        end
+      end
+    end
+
+    private
+
+    def integers(str)
+      str.to_s.split(",").map { |e| e.to_i }
+    end
+  end
+
+  class Random
+    def initialize(seed)
+      @x = seed & 0x7fffffff
+    end
+
+    def next
+      @x = (@x * 1103515245 + 12345) & 0x7fffffff
+    end
+  end
+
+  def self.synthetic_corpora(size)
+    text = ""
+    r = Random.new(1)
+    while text.bytesize < size
+      text << WORDS[r.next % WORDS.size]
+      text << ((r.next % 13) == 0 ? ".\n" : " ")
+    end
+
+    binary = ""
+    r = Random.new(2)
+    size.times { binary << ((r.next >> 16) & 0xff).chr }
+
+    repeat = "0123456789abcdefghijklmnopqrstuvwxyz\n"
+    repeat *= size / repeat.bytesize + 1
+
+    [
+      ["synthetic-text", text.byteslice(0, size)],
+      ["synthetic-random", binary],
+      ["synthetic-repeat", repeat.byteslice(0, size)],
+    ]
+  end
+
+  def self.bundled_corpus(files)
+    if files.empty?
+      top = File.join(File.dirname(__FILE__), "..")
+      files = %w(README.md LICENSE src/mruby-brotli.c test/test-brotli.rb).map { |f| File.join(top, f) }
+      name = "bundled"
+    else
+      name = files.size == 1 ? File.basename(files[0]) : "files"
+    end
+
+    data = ""
+    files.each { |f| File.open(f, "rb") { |io| data << io.read.to_s } }
+
+    [[name, data]]
+  end
+
+  def self.chunks_of(str, size)
+    chunks = []
+    off = 0
+    while off < str.bytesize
+      chunks << str.byteslice(off, size)
+      off += size
+    end
+    chunks
+  end
+
+  #
+  # Runs the block ``repeat'' times and returns [seconds, allocations, result]
+  # of the fastest run.
+  #
+  def self.measure(repeat)
+    best = nil
+
+    repeat.times do
+      GC.start
+      a = BrotliBench.allocations
+      t = BrotliBench.clock
+      result = yield
+      t = BrotliBench.clock - t
+      a = BrotliBench.allocations - a if a
+
+      best = [t, a, result] if best.nil? || t < best[0]
+    end
+
+    best
+  end
+
+  def self.record(results, op, corpus, src, quality, lgwin, chunk, compressed, measured)
+    seconds = measured[0]
+    allocations = measured[1]
+
+    results << {
+      "op" => op,
+      "corpus" => corpus,
+      "quality" => quality,
+      "lgwin" => lgwin,
+      "chunk" => chunk,
+      "input_bytes" => src.bytesize,
+      "compressed_bytes" => compressed.bytesize,
+      "ratio" => src.bytesize > 0 ? compressed.bytesize.to_f / src.bytesize : 0.0,
+      "seconds" => seconds,
+      "mb_per_sec" => seconds > 0 ? src.bytesize / seconds / (1 << 20) : 0.0,
+      "allocations" => allocations && allocations.to_i,
+      "peak_rss" => BrotliBench.peak_rss.to_i,
+    }
+
+    $stderr.puts format("%-22s %-18s q=%-2d w=%-2d chunk=%-8s %9.2f MB/s  ratio=%.4f  allocs=%s",
+                        op, corpus, quality, lgwin, chunk.to_s, results[-1]["mb_per_sec"],
+                        results[-1]["ratio"], (allocations ? allocations.to_i : "-").to_s)
+  end
+
+  def self.run(opts)
+    results = []
+    corpora = synthetic_corpora(opts.size) + bundled_corpus(opts.files)
+
+    corpora.each do |corpus, src|
+      opts.qualities.each do |q|
+        opts.lgwins.each do |w|
+          m = measure(opts.repeat) { Brotli::Encoder.encode(src, quality: q, lgwin: w) }
+          compressed = m[2]
+          record(results, "Encoder.encode", corpus, src, q, w, nil, compressed, m)
+
+          m = measure(opts.repeat) { Brotli::Decoder.decode(compressed) }
+          raise "mismatch decoded data (#{corpus})" unless m[2] == src
+          record(results, "Decoder.decode", corpus, src, q, w, nil, compressed, m)
+
+          opts.chunks.each do |chunk|
+            pieces = chunks_of(src, chunk)
+            m = measure(opts.repeat) {
+              out = ""
+              enc = Brotli::Encoder.new(out, quality: q, lgwin: w)
+              pieces.each { |e| enc.encode(e) }
+              enc.finish
+              out
+            }
+            record(results, "Encoder#encode", corpus, src, q, w, chunk, m[2], m)
+
+            m = measure(opts.repeat) {
+              dec = Brotli::Decoder.new(compressed)
+              buf = ""
+              size = 0
+              size += buf.bytesize while dec.decode(chunk, buf)
+              size
+            }
+            raise "mismatch decoded size (#{corpus})" unless m[2] == src.bytesize
+            record(results, "Decoder#decode", corpus, src, q, w, chunk, compressed, m)
+          end
+        end
+      end
+    end
+
+    results
+  end
+
+  def self.to_json(obj)
+    case obj
+    when Hash
+      "{" + obj.map { |k, v| "#{to_json(k.to_s)}: #{to_json(v)}" }.join(", ") + "}"
+    when Array
+      "[\n  " + obj.map { |e| to_json(e) }.join(",\n  ") + "\n]"
+    when String
+      str = '"'
+      obj.each_char do |ch|
+        case
+        when ch == '"' || ch == "\\"
+          str << "\\" << ch
+        when ch.ord < 0x20
+          str << format("\\u%04x", ch.ord)
+        else
+          str << ch
+        end
+      end
+      str << '"'
+    when Float
+      format("%.6g", obj)
+    when nil
+      "null"
+    else
+      obj.to_s
+    end
+  end
+
+  def self.main(argv)
+    opts = Options.new(argv)
+    json = to_json(run(opts)) + "\n"
+
+    if opts.output
+      File.open(opts.output, "wb") { |io| io.write json }
+    else
+      print json
+    end
+  end
+end
+
+BrotliBenchmark.main(ARGV)
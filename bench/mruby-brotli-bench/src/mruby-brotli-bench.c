@@ -0,0 +1,178 @@
+/*
+ * Counters for bench/bench-brotli.rb.
+ *
+ * The allocator of the VM is replaced at gem initialization to count the
+ * calls of mrb_malloc() and friends, which include the buffers of
+ * mruby-brotli and the memory of libbrotli through the buffer pool.
+ * mruby-3.2 and later have no per VM allocator, then the counters are nil.
+ */
+
+#include <mruby.h>
+#include <mruby/version.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#   include <windows.h>
+#   include <psapi.h>
+#else
+#   include <sys/resource.h>
+#endif
+
+#define MRB mrb_state *mrb
+#define VALUE mrb_value
+
+#if MRUBY_RELEASE_NO < 30200
+#   define HAVE_ALLOCF 1
+#endif
+
+#ifdef HAVE_ALLOCF
+
+struct counter
+{
+    mrb_allocf allocf;
+    void *ud;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+static void *
+counter_allocf(MRB, void *ptr, size_t size, void *ud)
+{
+    struct counter *c = (struct counter *)ud;
+
+    if (size == 0) {
+        if (ptr) { c->frees ++; }
+    } else if (ptr == NULL) {
+        c->allocs ++;
+    }
+
+    return c->allocf(mrb, ptr, size, c->ud);
+}
+
+static struct counter *
+getcounter(MRB)
+{
+    if (mrb->allocf != counter_allocf) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "allocation counter is not installed");
+    }
+
+    return (struct counter *)mrb->allocf_ud;
+}
+#endif /* HAVE_ALLOCF */
+
+/*
+ * call-seq:
+ *  allocations -> number
+ */
+static VALUE
+bench_s_allocations(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+#ifdef HAVE_ALLOCF
+    return mrb_float_value(mrb, (mrb_float)getcounter(mrb)->allocs);
+#else
+    return mrb_nil_value();
+#endif
+}
+
+/*
+ * call-seq:
+ *  frees -> number
+ */
+static VALUE
+bench_s_frees(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+#ifdef HAVE_ALLOCF
+    return mrb_float_value(mrb, (mrb_float)getcounter(mrb)->frees);
+#else
+    return mrb_nil_value();
+#endif
+}
+
+/*
+ * call-seq:
+ *  clock -> float (seconds)
+ *
+ * Returns the monotonic clock.
+ */
+static VALUE
+bench_s_clock(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return mrb_float_value(mrb, (mrb_float)now.QuadPart / (mrb_float)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return mrb_float_value(mrb, (mrb_float)ts.tv_sec + (mrb_float)ts.tv_nsec / 1e9);
+#endif
+}
+
+/*
+ * call-seq:
+ *  peak_rss -> number (bytes)
+ *
+ * Returns the peak resident set size of the process so far.
+ */
+static VALUE
+bench_s_peak_rss(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return mrb_float_value(mrb, (mrb_float)pmc.PeakWorkingSetSize);
+#else
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#   ifdef __APPLE__
+    return mrb_float_value(mrb, (mrb_float)ru.ru_maxrss);
+#   else
+    return mrb_float_value(mrb, (mrb_float)ru.ru_maxrss * 1024);
+#   endif
+#endif
+}
+
+void
+mrb_mruby_brotli_bench_gem_init(MRB)
+{
+#ifdef HAVE_ALLOCF
+    struct counter *c = (struct counter *)malloc(sizeof(struct counter));
+    if (c) {
+        c->allocf = mrb->allocf;
+        c->ud = mrb->allocf_ud;
+        c->allocs = c->frees = 0;
+        mrb->allocf = counter_allocf;
+        mrb->allocf_ud = c;
+    }
+#endif
+
+    struct RClass *mBench = mrb_define_module(mrb, "BrotliBench");
+    mrb_define_class_method(mrb, mBench, "allocations", bench_s_allocations, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, mBench, "frees", bench_s_frees, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, mBench, "clock", bench_s_clock, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, mBench, "peak_rss", bench_s_peak_rss, MRB_ARGS_NONE());
+}
+
+void
+mrb_mruby_brotli_bench_gem_final(MRB)
+{
+#ifdef HAVE_ALLOCF
+    if (mrb->allocf == counter_allocf) {
+        struct counter *c = (struct counter *)mrb->allocf_ud;
+        mrb->allocf = c->allocf;
+        mrb->allocf_ud = c->ud;
+        free(c);
+    }
+#endif
+}
@@ -0,0 +1,26 @@
+#!ruby
+#
+# Build configuration for bench/bench-brotli.rb (see ``rake bench'').
+#
+# The streaming buffers of mruby-brotli can be given by environment
+# variables to tune them, e.g.:
+#
+#   BENCH_DEFINES="EXT_PARTIAL_READ_SIZE=65536 EXT_DEFAULT_OUTBUF_SIZE=65536" rake bench
+#
+
+MRuby::Build.new("bench") do |conf|
+  toolchain :gcc
+
+  conf.build_dir = conf.name
+
+  cc.defines << %w(MRB_INT64)
+  cc.defines << ENV["BENCH_DEFINES"].split(/[\s,]+/) if ENV["BENCH_DEFINES"]
+  cc.flags << "-O2"
+
+  gem core: "mruby-print"
+  gem core: "mruby-sprintf"
+  gem core: "mruby-io"
+  gem core: "mruby-bin-mruby"
+  gem File.join(File.dirname(__FILE__), "bench/mruby-brotli-bench")
+  gem File.dirname(__FILE__)
+end
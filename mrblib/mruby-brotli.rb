@@ -20,10 +20,11 @@ module Brotli
   #   quality:: (default: Brotli::BROTLI_DEFAULT_QUALITY)
   #   lgwin:: (default: Brotli::BROTLI_DEFAULT_WINDOW)
   #   mode:: (default: Brotli::BROTLI_DEFAULT_MODE)
+  #   cache:: (Brotli::Cache or nil) for input strings only
   # [YIELD (brotli_encoder)]
   #
   def Brotli.encode(arg1, *args, &block)
-    return Encoder.encode(arg1, *args) if arg1.kind_of?(String)
+    return Encoder.encode(arg1, *args) if arg1.kind_of?(String) || arg1.kind_of?(MappedFile)
 
     Encoder.wrap(arg1, *args, &block)
   end
@@ -38,13 +39,13 @@ module Brotli
   # [RETURN output]
   # [RETURN brotli decoder]
   # [RETURN yield return value]
-  # [input (string)]
+  # [input (string or Brotli::MappedFile)]
   # [output = nil (string or nil)]
   # [output_size = nil (integer or nil)]
   # [output_io (not a string)]
   #
   def Brotli.decode(arg1, *args, &block)
-    return Decoder.decode(arg1, *args) if arg1.kind_of?(String)
+    return Decoder.decode(arg1, *args) if arg1.kind_of?(String) || arg1.kind_of?(MappedFile)
 
     Decoder.wrap(arg1, *args, &block)
   end
@@ -56,10 +57,15 @@ module Brotli
       return e unless block_given?
 
       begin
-        yield e
-      ensure
-        e.finish
+        ret = yield e
+      rescue Exception => ex
+        # finish may also raise if the stream is broken by the exception
+        e.finish rescue nil
+        raise ex
       end
+
+      e.finish
+      ret
     end
   end
 
@@ -73,6 +79,364 @@ module Brotli
     alias uncompress decode
   end
 
+  class MappedFile
+    #
+    # call-seq:
+    #   open(path) -> mapped file
+    #   open(path) { |mapped_file| ... } -> yield return value
+    #
+    def MappedFile.open(path)
+      m = new(path)
+
+      return m unless block_given?
+
+      begin
+        yield m
+      ensure
+        m.close
+      end
+    end
+  end
+
+  #
+  # Framed container of independently compressed brotli streams.
+  #
+  #   frame 0 (brotli stream)
+  #   ...
+  #   frame N-1 (brotli stream)
+  #   index: N entries of [compressed size, uncompressed size]
+  #   footer: N, frame size and Seekable::MAGIC
+  #
+  # All integers are 64-bit little endian.
+  # The whole container is not a brotli stream.
+  #
+  module Seekable
+    MAGIC = "BRSEEK\x00\x01"
+    FOOTER_SIZE = 24
+    ENTRY_SIZE = 16
+    DEFAULT_FRAME_SIZE = 1 << 20
+
+    # NOTE: mruby has no String#pack without any additional gems
+    def Seekable.pack64(n)
+      s = ""
+      8.times { s << (n & 0xff).chr; n >>= 8 }
+      s
+    end
+
+    def Seekable.unpack64(str, off)
+      n = 0
+      7.downto(0) { |i| n = (n << 8) | str.getbyte(off + i) }
+      n
+    end
+  end
+
+  class SeekableWriter
+    extend StreamWrapper
+
+    attr_reader :total_in, :total_out, :frame_size
+
+    #
+    # call-seq:
+    #   new(output, frame_size: 1 MiB, threads: nil, **opts) -> seekable writer
+    #
+    # [output]
+    #   Any object that has the +<<+ method.
+    # [frame_size]
+    #   The uncompressed size of each frame.
+    # [threads]
+    #   Compresses this many frames at once by Brotli::Encoder.encode_batch.
+    # [opts]
+    #   The same as Brotli::Encoder.encode.
+    #
+    def initialize(output, opts = {})
+      opts = opts.dup
+      @frame_size = (opts.delete(:frame_size) || Seekable::DEFAULT_FRAME_SIZE).to_i
+      raise ArgumentError, "frame_size must be positive - #{@frame_size}" unless @frame_size > 0
+      @batch = [opts[:threads].to_i, 1].max
+      @opts = opts
+      @output = output
+      @pending = ""
+      @frames = []
+      @index = []
+      @total_in = 0
+      @total_out = 0
+      @finished = false
+    end
+
+    def write(data)
+      raise "already finished - #{inspect}" if @finished
+
+      data = data.to_s
+      off = 0
+      while off < data.bytesize
+        n = @frame_size - @pending.bytesize
+        @pending << data.byteslice(off, n)
+        off += n
+        cut if @pending.bytesize >= @frame_size
+      end
+      @total_in += data.bytesize
+
+      self
+    end
+
+    alias << write
+    alias encode write
+
+    #
+    # Ends the current frame even if it is smaller than the frame size,
+    # so that the next data starts a new frame.
+    #
+    def flush
+      raise "already finished - #{inspect}" if @finished
+
+      cut unless @pending.empty?
+      put_frames
+
+      self
+    end
+
+    def finish
+      return nil if @finished
+
+      cut unless @pending.empty?
+      put_frames
+
+      index = ""
+      @index.each do |csize, usize|
+        index << Seekable.pack64(csize) << Seekable.pack64(usize)
+      end
+      index << Seekable.pack64(@index.size) << Seekable.pack64(@frame_size) << Seekable::MAGIC
+      @output << index
+      @total_out += index.bytesize
+      @finished = true
+
+      nil
+    end
+
+    alias close finish
+
+    def finished?
+      @finished
+    end
+
+    private
+
+    def cut
+      @frames << @pending
+      @pending = ""
+      put_frames if @frames.size >= @batch
+    end
+
+    def put_frames
+      return if @frames.empty?
+
+      Encoder.encode_batch(@frames, @opts).each_with_index do |c, i|
+        @output << c
+        @index << [c.bytesize, @frames[i].bytesize]
+        @total_out += c.bytesize
+      end
+      @frames = []
+    end
+  end
+
+  class SeekableReader
+    attr_reader :bytesize, :frame_count, :frame_size
+
+    alias size bytesize
+
+    #
+    # call-seq:
+    #   open(path, **opts) -> seekable reader
+    #   open(path, **opts) { |seekable_reader| ... } -> yield return value
+    #
+    def SeekableReader.open(path, opts = {})
+      r = new(MappedFile.new(path), opts)
+
+      return r unless block_given?
+
+      begin
+        yield r
+      ensure
+        r.close
+      end
+    end
+
+    #
+    # call-seq:
+    #   new(input, threads: nil, **opts) -> seekable reader
+    #
+    # [input]
+    #   A string, a Brotli::MappedFile or an object that has the +seek+ and
+    #   +read+ methods.
+    # [threads]
+    #   Decompresses the frames of a read at once by
+    #   Brotli::Decoder.decode_batch.
+    # [opts]
+    #   The same as Brotli::Decoder.decode.
+    #
+    def initialize(input, opts = {})
+      @input = input
+      @opts = opts.dup
+      @threads = @opts.delete(:threads)
+      @cache = nil
+
+      insize = input.respond_to?(:bytesize) ? input.bytesize : input.size
+      raise "not a seekable brotli container (too short)" if insize < Seekable::FOOTER_SIZE
+
+      footer = fetch(insize - Seekable::FOOTER_SIZE, Seekable::FOOTER_SIZE)
+      raise "not a seekable brotli container (wrong magic)" unless footer.byteslice(16, 8) == Seekable::MAGIC
+      @frame_count = Seekable.unpack64(footer, 0)
+      @frame_size = Seekable.unpack64(footer, 8)
+
+      indexsize = @frame_count * Seekable::ENTRY_SIZE
+      indexoff = insize - Seekable::FOOTER_SIZE - indexsize
+      raise "broken seekable brotli container (wrong frame count)" if indexoff < 0
+      index = fetch(indexoff, indexsize)
+
+      @coffsets = [0]
+      @uoffsets = [0]
+      @frame_count.times do |i|
+        @coffsets << @coffsets[-1] + Seekable.unpack64(index, i * Seekable::ENTRY_SIZE)
+        @uoffsets << @uoffsets[-1] + Seekable.unpack64(index, i * Seekable::ENTRY_SIZE + 8)
+      end
+      raise "broken seekable brotli container (wrong index)" unless @coffsets[-1] == indexoff
+      @bytesize = @uoffsets[-1]
+    end
+
+    #
+    # call-seq:
+    #   read_at(offset, length) -> string or nil
+    #
+    # Decompresses only the frames over the range.
+    # Returns nil if offset is beyond the end, like String#byteslice.
+    #
+    def read_at(offset, length)
+      raise ArgumentError, "negative length - #{length}" if length < 0
+      offset += @bytesize if offset < 0
+      return nil if offset < 0 || offset > @bytesize
+
+      last = [offset + length, @bytesize].min
+      return "" if offset >= last
+
+      first = frame_at(offset)
+      stop = frame_at(last - 1)
+      frames = decode_frames(first, stop)
+
+      out = ""
+      frames.each_with_index do |data, i|
+        base = @uoffsets[first + i]
+        head = offset > base ? offset - base : 0
+        tail = [last - base, data.bytesize].min
+        out << data.byteslice(head, tail - head)
+      end
+
+      out
+    end
+
+    alias pread read_at
+
+    def read
+      read_at(0, @bytesize)
+    end
+
+    #
+    # Closes the input if it has the +close+ method.
+    #
+    def close
+      @cache = nil
+      @input.close if @input.respond_to?(:close)
+      nil
+    end
+
+    private
+
+    def fetch(off, len)
+      if @input.respond_to?(:byteslice)
+        s = @input.byteslice(off, len)
+      else
+        @input.seek(off)
+        s = @input.read(len)
+      end
+
+      raise "broken seekable brotli container (truncated)" unless s && s.bytesize == len
+
+      s
+    end
+
+    # binary search of the frame that has the uncompressed offset
+    def frame_at(pos)
+      lo = 0
+      hi = @frame_count - 1
+      while lo < hi
+        mid = (lo + hi + 1) / 2
+        if @uoffsets[mid] <= pos
+          lo = mid
+        else
+          hi = mid - 1
+        end
+      end
+      lo
+    end
+
+    def decode_frames(first, stop)
+      # a frame read last time is reused for sequential small reads
+      return [@cache[1]] if @cache && first == stop && @cache[0] == first
+
+      inputs = (first .. stop).map { |i| fetch(@coffsets[i], @coffsets[i + 1] - @coffsets[i]) }
+
+      if inputs.size > 1 && @threads
+        opts = @opts.dup
+        opts[:threads] = @threads
+        frames = Decoder.decode_batch(inputs, opts)
+      else
+        frames = []
+        inputs.each_with_index do |c, i|
+          frames << Decoder.decode(c, @uoffsets[first + i + 1] - @uoffsets[first + i], @opts)
+        end
+      end
+
+      frames.each_with_index do |data, i|
+        unless data.bytesize == @uoffsets[first + i + 1] - @uoffsets[first + i]
+          raise "broken seekable brotli container (wrong frame size at #{first + i})"
+        end
+      end
+
+      @cache = [stop, frames[-1]]
+
+      frames
+    end
+  end
+
+  #
+  # The frozen string given by Encoder (zerocopy: true) and
+  # Decoder#each_chunk. It refers to the internal buffer, and it becomes
+  # empty after the call; it and the strings made from it must not escape
+  # the call. For convenience, the methods below copy the bytes.
+  #
+  class BufferView
+    def dup
+      "" + self
+    end
+
+    def clone
+      dup.freeze
+    end
+
+    def to_s
+      dup
+    end
+
+    def byteslice(*args)
+      dup.byteslice(*args)
+    end
+
+    def [](*args)
+      dup[*args]
+    end
+
+    alias slice []
+  end
+
   class Encoder
     extend StreamWrapper
 
@@ -3,6 +3,8 @@
 #include <mruby.h>
 #include <mruby/data.h>
 #include <mruby/string.h>
+#include <mruby/array.h>
+#include <mruby/hash.h>
 #include <mruby/variable.h>
 #include <mruby/class.h>
 #include <mruby/error.h>
@@ -11,9 +13,77 @@
 #include <mruby-aux/string.h>
 #include <mruby-aux/scanhash.h>
 #include <mruby-aux/fakedin.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <limits.h>
+#include <stddef.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef _WIN32
+#   include <io.h>
+#   include <windows.h>
+#else
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <dirent.h>
+#   include <utime.h>
+#   define HAVE_MMAP 1
+#   define HAVE_DIRENT 1
+#endif
+
+#if defined(SHARED_BROTLI_MAX_COMPOUND_DICTS)
+#   define HAVE_BROTLI_SHARED_DICTIONARY 1
+#endif
+
+#ifndef MRUBY_BROTLI_WITHOUT_THREAD
+#   include <pthread.h>
+#   define HAVE_THREAD 1
+#endif
+
+/*
+ * BROTLI_PARAM_STREAM_OFFSET is not declared by brotli-1.0.7 or before.
+ * BrotliEncoderSetParameter() fails with it if it is not supported.
+ */
+#define AUX_BROTLI_PARAM_STREAM_OFFSET  ((BrotliEncoderParameter)9)
+#define AUX_BROTLI_MAX_STREAM_OFFSET    ((size_t)1 << 30)
+
+/* BROTLI_MAX_NPOSTFIX and BROTLI_MAX_NDIRECT are in the private header */
+#define AUX_BROTLI_MAX_NPOSTFIX         3
+#define AUX_BROTLI_MAX_NDIRECT          (15 << AUX_BROTLI_MAX_NPOSTFIX)
+
+/*
+ * ``skip_incompressible: true'' lowers the quality when the order-0 entropy
+ * of a sample of the input is at least this many bits per byte.
+ * Random and already-compressed data are near 8, texts are around 4 to 5.
+ */
+#define AUX_INCOMPRESSIBLE_ENTROPY      7.8
+#define AUX_INCOMPRESSIBLE_MIN_INPUT    1024
+#define AUX_INCOMPRESSIBLE_SAMPLES      16
+#define AUX_INCOMPRESSIBLE_SAMPLE_SIZE  4096
+
+/*
+ * The adaptive quality of Brotli::Encoder by ``target_mbps'' and
+ * ``max_latency_ms''. The throughput is judged after at least
+ * AUX_ADAPT_MIN_BYTES are compressed, and the quality is raised again only
+ * when the measurement is better than the budget by AUX_ADAPT_HEADROOM times.
+ */
+#define AUX_ADAPT_MIN_BYTES             ((uint64_t)64 << 10)
+#define AUX_ADAPT_HEADROOM              2.0
+
+/*
+ * The size found by aux_brotli_prescan() comes from the untrusted headers, so
+ * Brotli::Decoder.decode allocates it at once only up to this many times the
+ * input; beyond that the output grows as it is produced.
+ */
+#define AUX_PRESCAN_MAX_RATIO           1024
+
+/* ``readahead: true'' of Brotli::Decoder, in EXT_PARTIAL_READ_SIZE chunks */
+#define AUX_READAHEAD_DEFAULT_CHUNKS    4
 
 #ifndef SSIZE_MAX
 # define SSIZE_MAX ((ssize_t)(SIZE_MAX >> 1))
@@ -21,16 +91,49 @@
 
 #define MIN(A, B)                   ((A) < (B) ? (A) : (B))
 
+#ifndef O_BINARY
+#   define O_BINARY 0
+#endif
+
 #ifdef MRB_INT16
-#   define EXT_INBUF_SIZE              (1 << 10)
+#   define EXT_INBUF_SIZE              (1 << 9)
 #   define EXT_DEFAULT_OUTPUT_SIZE     (1 << 10)
-#   define EXT_DEFAULT_OUTBUF_SIZE     (1 << 10)
-#   define EXT_PARTIAL_READ_SIZE       (1 << 10)
+#   define EXT_POOL_LIMIT              (64 << 10)
+#   define EXT_POOL_MIN_BLOCK          (1 << 10)
+#   define EXT_PARALLEL_MIN_CHUNK      (4 << 10)
+#   define EXT_FILE_BUFFER_SIZE        (1 << 10)
+#   define EXT_CACHE_DEFAULT_BYTES     (64 << 10)
+#   define EXT_FEED_INITIAL_SIZE       (1 << 8)
 #else
-#   define EXT_INBUF_SIZE              (1 << 24)
+#   define EXT_INBUF_SIZE              (64 << 10)
 #   define EXT_DEFAULT_OUTPUT_SIZE     (256 << 10)
-#   define EXT_DEFAULT_OUTBUF_SIZE     (256 << 10)
-#   define EXT_PARTIAL_READ_SIZE       (1 << 20)
+#   define EXT_POOL_LIMIT              (64 << 20)
+#   define EXT_POOL_MIN_BLOCK          (32 << 10)
+#   define EXT_PARALLEL_MIN_CHUNK      (4 << 20)
+#   define EXT_FILE_BUFFER_SIZE        (1 << 20)
+#   define EXT_CACHE_DEFAULT_BYTES     (32 << 20)
+#   define EXT_FEED_INITIAL_SIZE       (4 << 10)
+#endif
+
+/*
+ * These can be given by the build configuration to tune the streaming
+ * buffers (e.g. ``cc.defines << "EXT_PARTIAL_READ_SIZE=65536"'').
+ * See also bench_config.rb.
+ */
+#ifndef EXT_DEFAULT_OUTBUF_SIZE
+#   ifdef MRB_INT16
+#       define EXT_DEFAULT_OUTBUF_SIZE (1 << 10)
+#   else
+#       define EXT_DEFAULT_OUTBUF_SIZE (256 << 10)
+#   endif
+#endif
+
+#ifndef EXT_PARTIAL_READ_SIZE
+#   ifdef MRB_INT16
+#       define EXT_PARTIAL_READ_SIZE   (1 << 10)
+#   else
+#       define EXT_PARTIAL_READ_SIZE   (1 << 20)
+#   endif
 #endif
 
 #define id_initialize   mrb_intern_cstr(mrb, "initialize")
@@ -88,7 +191,7 @@ convert_to_quality(MRB, VALUE quality)
 }
 
 static int
-convert_to_lgwin(MRB, VALUE lgwin)
+convert_to_lgwin(MRB, VALUE lgwin, mrb_bool large_window)
 {
     if (NIL_P(lgwin)) {
         return BROTLI_DEFAULT_WINDOW;
@@ -96,7 +199,7 @@ convert_to_lgwin(MRB, VALUE lgwin)
         const char *str = mrbx_get_const_cstr(mrb, lgwin);
 
         if (strcasecmp(str, "max") == 0) {
-            return BROTLI_MAX_WINDOW_BITS;
+            return (large_window ? BROTLI_LARGE_MAX_WINDOW_BITS : BROTLI_MAX_WINDOW_BITS);
         } else if (strcasecmp(str, "min") == 0) {
             return BROTLI_MIN_WINDOW_BITS;
         } else if (strcasecmp(str, "default") == 0) {
@@ -137,6 +240,199 @@ convert_to_mode(MRB, VALUE mode)
     }
 }
 
+/*
+ * Returns a frozen string object that refers to the memory of libbrotli
+ * without copying. It must be unbound by aux_str_unbind_view() before the
+ * memory is reused, since the object may still be referenced from ruby space.
+ *
+ * mruby shares the memory of such a string with the strings made from it
+ * (String.new, replace, split, ...), so neither the object nor such strings
+ * must escape the call. For convenience, it is a Brotli::BufferView whose
+ * dup and byteslice of mrblib copy the bytes.
+ */
+static struct RString *
+aux_str_new_view(MRB, const void *ptr, size_t len)
+{
+    struct RClass *mBrotli = mrb_module_get(mrb, "Brotli");
+    struct RClass *cView = mrb_class_get_under(mrb, mBrotli, "BufferView");
+    struct RString *str = RSTRING(mrb_str_new_static(mrb, (const char *)ptr, len));
+    str->c = cView;
+
+#ifdef MRB_SET_FROZEN_FLAG
+    MRB_SET_FROZEN_FLAG(str);
+#endif
+
+    return str;
+}
+
+static void
+aux_str_unbind_view(MRB, struct RString *str)
+{
+    str->as.heap.ptr = (char *)"";
+    RSTR_SET_LEN(str, 0);
+}
+
+static int
+convert_to_lgblock(MRB, VALUE lgblock)
+{
+    if (NIL_P(lgblock)) {
+        return 0;
+    } else if (mrb_string_p(lgblock) || mrb_symbol_p(lgblock)) {
+        const char *str = mrbx_get_const_cstr(mrb, lgblock);
+
+        if (strcasecmp(str, "max") == 0) {
+            return BROTLI_MAX_INPUT_BLOCK_BITS;
+        } else if (strcasecmp(str, "min") == 0) {
+            return BROTLI_MIN_INPUT_BLOCK_BITS;
+        } else if (strcasecmp(str, "default") == 0) {
+            return 0;
+        } else {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong lgblock value - %S (expect \"min\", \"max\", \"default\", integer or nil)",
+                       lgblock);
+        }
+    } else {
+        mrb_int n = mrb_int(mrb, lgblock);
+
+        if (n != 0 && (n < BROTLI_MIN_INPUT_BLOCK_BITS || n > BROTLI_MAX_INPUT_BLOCK_BITS)) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong lgblock value - %S (expect 0 or %S to %S)",
+                       lgblock,
+                       VALUE((mrb_int)BROTLI_MIN_INPUT_BLOCK_BITS),
+                       VALUE((mrb_int)BROTLI_MAX_INPUT_BLOCK_BITS));
+        }
+
+        return (int)n;
+    }
+}
+
+static int
+convert_to_npostfix(MRB, VALUE npostfix)
+{
+    if (NIL_P(npostfix)) { return 0; }
+
+    mrb_int n = mrb_int(mrb, npostfix);
+
+    if (n < 0 || n > AUX_BROTLI_MAX_NPOSTFIX) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong npostfix value - %S (expect 0 to %S or nil)",
+                   npostfix, VALUE((mrb_int)AUX_BROTLI_MAX_NPOSTFIX));
+    }
+
+    return (int)n;
+}
+
+static int
+convert_to_ndirect(MRB, VALUE ndirect, int npostfix)
+{
+    if (NIL_P(ndirect)) { return 0; }
+
+    mrb_int n = mrb_int(mrb, ndirect);
+
+    if (n < 0 || n > (15 << npostfix) || (n & ((1 << npostfix) - 1)) != 0) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong ndirect value - %S (expect 0 to %S in steps of %S for npostfix %S)",
+                   ndirect,
+                   VALUE((mrb_int)(15 << npostfix)),
+                   VALUE((mrb_int)(1 << npostfix)),
+                   VALUE((mrb_int)npostfix));
+    }
+
+    return (int)n;
+}
+
+static size_t
+convert_to_stream_offset(MRB, VALUE offset)
+{
+    if (NIL_P(offset)) { return 0; }
+
+    mrb_int n = mrb_int(mrb, offset);
+
+    if (n < 0 || (uint64_t)n > AUX_BROTLI_MAX_STREAM_OFFSET) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong stream_offset value - %S (expect 0 to %S or nil)",
+                   offset, VALUE((mrb_int)AUX_BROTLI_MAX_STREAM_OFFSET));
+    }
+
+    return (size_t)n;
+}
+
+static double
+convert_to_skip_incompressible(MRB, VALUE skip)
+{
+    if (NIL_P(skip) || mrb_type(skip) == MRB_TT_FALSE) {
+        return 0;
+    } else if (mrb_type(skip) == MRB_TT_TRUE) {
+        return AUX_INCOMPRESSIBLE_ENTROPY;
+    } else {
+        double n = mrb_to_flo(mrb, skip);
+
+        if (!(n > 0 && n <= 8)) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong skip_incompressible value - %S (expect true, false or bits per byte in 0 < n <= 8)",
+                       skip);
+        }
+
+        return n;
+    }
+}
+
+static double
+convert_to_budget(MRB, VALUE budget, const char *name)
+{
+    if (NIL_P(budget) || mrb_type(budget) == MRB_TT_FALSE) {
+        return 0;
+    } else {
+        double n = mrb_to_flo(mrb, budget);
+
+        if (!(n > 0)) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong %S value - %S (expect positive number or nil)",
+                       mrb_str_new_cstr(mrb, name), budget);
+        }
+
+        return n;
+    }
+}
+
+static size_t
+convert_to_readahead(MRB, VALUE readahead)
+{
+    if (NIL_P(readahead) || mrb_type(readahead) == MRB_TT_FALSE) {
+        return 0;
+    } else if (mrb_type(readahead) == MRB_TT_TRUE) {
+        return AUX_READAHEAD_DEFAULT_CHUNKS;
+    } else {
+        mrb_int n = mrb_int(mrb, readahead);
+
+        if (n < 0 || (uint64_t)n > SIZE_MAX / EXT_PARTIAL_READ_SIZE) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong readahead value - %S (expect true, false or number of chunks)",
+                       readahead);
+        }
+
+        return (size_t)n;
+    }
+}
+
+static int
+convert_to_threads(MRB, VALUE threads)
+{
+    if (NIL_P(threads)) {
+        return 1;
+    } else {
+        mrb_int n = mrb_int(mrb, threads);
+
+        if (n < 1 || n > 256) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong threads value - %S (expect 1 to 256 or nil)",
+                       threads);
+        }
+
+        return (int)n;
+    }
+}
+
 static VALUE
 aux_brotli_decoder_result_string(MRB, BrotliDecoderResult ok)
 {
@@ -164,489 +460,741 @@ aux_brotli_decoder_result_string(MRB, BrotliDecoderResult ok)
 }
 
 static void
-aux_brotli_decoder_error(MRB, BrotliDecoderResult ok)
+aux_brotli_decoder_error(MRB, BrotliDecoderResult ok, BrotliDecoderErrorCode err, mrb_bool large_window)
 {
-    mrb_raisef(mrb, E_RUNTIME_ERROR,
-               "failed BrotliDecoderDecompressStream() - %S (0x%S)",
-               aux_brotli_decoder_result_string(mrb, ok),
-               VALUE(mrbx_str_new_as_hexdigest(mrb, ok, 4)));
+    if (ok != BROTLI_DECODER_RESULT_ERROR) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "failed BrotliDecoderDecompressStream() - %S (0x%S)",
+                   aux_brotli_decoder_result_string(mrb, ok),
+                   VALUE(mrbx_str_new_as_hexdigest(mrb, ok, 4)));
+    } else if (err == BROTLI_DECODER_ERROR_FORMAT_WINDOW_BITS && !large_window) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "failed BrotliDecoderDecompressStream() - %S (%S) - large window stream needs ``large_window: true''",
+                   VALUE((mrb_int)err),
+                   VALUE(BrotliDecoderErrorString(err)));
+    } else {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "failed BrotliDecoderDecompressStream() - %S (%S)",
+                   VALUE((mrb_int)err),
+                   VALUE(BrotliDecoderErrorString(err)));
+    }
 }
 
-/* module Brotli::Constants */
+/* memory pool for libbrotli */
 
-static void
-init_constants(MRB, struct RClass *mBrotli)
+/*
+ * libbrotli has no way to reset an encoder or decoder state, so a state can
+ * not be reused. Instead, the large blocks (hasher tables, ring buffers and
+ * so on) released by a destroyed state are kept per mrb_state, and they are
+ * given to the next state that asks for the same size.
+ */
+
+/*
+ * Instrumentation counters for Encoder#stats, Decoder#stats and Brotli.stats.
+ * Each instance has its own counters in ``struct memcap``, and the same
+ * amounts are added to the per mrb_state aggregate in ``struct bufpool``.
+ * The native workers of the one-shot and batch functions are not counted.
+ */
+struct aux_stats
 {
-    struct RClass *mConstants = mrb_define_module_under(mrb, mBrotli, "Constants");
-    mrb_include_module(mrb, mBrotli, mConstants);
-    mrb_define_const(mrb, mConstants, "BROTLI_MIN_WINDOW_BITS", VALUE((mrb_int)BROTLI_MIN_WINDOW_BITS));
-    mrb_define_const(mrb, mConstants, "BROTLI_MAX_WINDOW_BITS", VALUE((mrb_int)BROTLI_MAX_WINDOW_BITS));
-    mrb_define_const(mrb, mConstants, "BROTLI_MIN_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MIN_INPUT_BLOCK_BITS));
-    mrb_define_const(mrb, mConstants, "BROTLI_MAX_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MAX_INPUT_BLOCK_BITS));
-    mrb_define_const(mrb, mConstants, "BROTLI_MIN_QUALITY", VALUE((mrb_int)BROTLI_MIN_QUALITY));
-    mrb_define_const(mrb, mConstants, "BROTLI_MAX_QUALITY", VALUE((mrb_int)BROTLI_MAX_QUALITY));
-    mrb_define_const(mrb, mConstants, "BROTLI_MODE_GENERIC", VALUE((mrb_int)BROTLI_MODE_GENERIC));
-    mrb_define_const(mrb, mConstants, "BROTLI_MODE_TEXT", VALUE((mrb_int)BROTLI_MODE_TEXT));
-    mrb_define_const(mrb, mConstants, "BROTLI_MODE_FONT", VALUE((mrb_int)BROTLI_MODE_FONT));
-    mrb_define_const(mrb, mConstants, "BROTLI_DEFAULT_QUALITY", VALUE((mrb_int)BROTLI_DEFAULT_QUALITY));
-    mrb_define_const(mrb, mConstants, "BROTLI_DEFAULT_WINDOW", VALUE((mrb_int)BROTLI_DEFAULT_WINDOW));
-    mrb_define_const(mrb, mConstants, "BROTLI_DEFAULT_MODE", VALUE((mrb_int)BROTLI_DEFAULT_MODE));
+    uint64_t stream_calls;      /* BrotliEncoderCompressStream() / BrotliDecoderDecompressStream() */
+    uint64_t stream_nsec;       /* time spent in them */
+    uint64_t port_calls;        /* outport << / inport.read / yield to the block */
+    uint64_t port_bytes;
+    uint64_t buffer_allocs;     /* (re)allocations of the string buffers */
+    uint64_t native_allocs;     /* through the allocator given to libbrotli */
+    uint64_t native_frees;
+    uint64_t native_bytes;
+    uint64_t incompressible;    /* inputs compressed at the lowest quality by skip_incompressible */
+};
 
-    mrb_define_const(mrb, mBrotli, "MIN_WINDOW_BITS", VALUE((mrb_int)BROTLI_MIN_WINDOW_BITS));
-    mrb_define_const(mrb, mBrotli, "MAX_WINDOW_BITS", VALUE((mrb_int)BROTLI_MAX_WINDOW_BITS));
-    mrb_define_const(mrb, mBrotli, "MIN_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MIN_INPUT_BLOCK_BITS));
-    mrb_define_const(mrb, mBrotli, "MAX_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MAX_INPUT_BLOCK_BITS));
-    mrb_define_const(mrb, mBrotli, "MIN_QUALITY", VALUE((mrb_int)BROTLI_MIN_QUALITY));
-    mrb_define_const(mrb, mBrotli, "MAX_QUALITY", VALUE((mrb_int)BROTLI_MAX_QUALITY));
-    mrb_define_const(mrb, mBrotli, "MODE_GENERIC", VALUE((mrb_int)BROTLI_MODE_GENERIC));
-    mrb_define_const(mrb, mBrotli, "MODE_TEXT", VALUE((mrb_int)BROTLI_MODE_TEXT));
-    mrb_define_const(mrb, mBrotli, "MODE_FONT", VALUE((mrb_int)BROTLI_MODE_FONT));
-    mrb_define_const(mrb, mBrotli, "DEFAULT_QUALITY", VALUE((mrb_int)BROTLI_DEFAULT_QUALITY));
-    mrb_define_const(mrb, mBrotli, "DEFAULT_WINDOW", VALUE((mrb_int)BROTLI_DEFAULT_WINDOW));
-    mrb_define_const(mrb, mBrotli, "DEFAULT_MODE", VALUE((mrb_int)BROTLI_DEFAULT_MODE));
+static uint64_t
+aux_clock_nsec(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static VALUE
+aux_uint64_value(MRB, uint64_t n)
+{
+    if (n > (uint64_t)MRB_INT_MAX) {
+        return mrb_float_value(mrb, (mrb_float)n);
+    } else {
+        return mrb_fixnum_value((mrb_int)n);
+    }
 }
 
+static VALUE
+aux_stats_to_hash(MRB, const struct aux_stats *st)
+{
+    VALUE hash = mrb_hash_new(mrb);
+
+#define AUX_STATS_SET(FIELD) \
+    mrb_hash_set(mrb, hash, mrb_symbol_value(SYMBOL(#FIELD)), aux_uint64_value(mrb, st->FIELD))
 
-/* class Brotli::Encoder */
+    AUX_STATS_SET(stream_calls);
+    AUX_STATS_SET(stream_nsec);
+    AUX_STATS_SET(port_calls);
+    AUX_STATS_SET(port_bytes);
+    AUX_STATS_SET(buffer_allocs);
+    AUX_STATS_SET(native_allocs);
+    AUX_STATS_SET(native_frees);
+    AUX_STATS_SET(native_bytes);
+    AUX_STATS_SET(incompressible);
 
-struct encoder
+#undef AUX_STATS_SET
+
+    return hash;
+}
+
+/*
+ * The backends of the memory given to libbrotli. The allocator is chosen
+ * per instance (``allocator:'' option) or per mrb_state (Brotli.allocator=),
+ * and each block remembers its own, so it can be changed at any time.
+ */
+enum aux_allocator
+{
+    AUX_ALLOCATOR_POOL,     /* mrb_malloc_simple(), and the large blocks are kept for reuse */
+    AUX_ALLOCATOR_MRUBY,    /* mrb_malloc_simple() / mrb_free() */
+    AUX_ALLOCATOR_SYSTEM,   /* malloc() / free(), bypassing the mruby allocator */
+};
+
+union bufpool_block
 {
-    BrotliEncoderState *brotli;
-    VALUE outport;
-    struct RString *outbuf;
     struct {
-        char *ptr;
-        char *cur;
         size_t size;
-    } inbuf;
-    uint64_t total_in;
-    uint64_t total_out;
+        union bufpool_block *next;
+        enum aux_allocator allocator;
+    } h;
+    max_align_t align;
 };
 
-static void
-encoder_free(MRB, struct encoder *p)
+struct bufpool
 {
-    if (p->brotli) {
-        BrotliEncoderDestroyInstance(p->brotli);
-        p->brotli = NULL;
-    }
+    mrb_state *mrb;
+    int refcount;
+    size_t cached;
+    size_t limit;
+    union bufpool_block *blocks;
+    enum aux_allocator allocator;
+    struct aux_stats stats;
+};
 
-    if (p->inbuf.ptr) {
-        mrb_free(mrb, p->inbuf.ptr);
-        memset(&p->inbuf, 0, sizeof(p->inbuf));
+static void
+bufpool_purge(struct bufpool *pool)
+{
+    while (pool->blocks) {
+        union bufpool_block *b = pool->blocks;
+        pool->blocks = b->h.next;
+        mrb_free(pool->mrb, b);
     }
 
-    if (p) {
-        mrb_free(mrb, p);
-    }
+    pool->cached = 0;
 }
 
-static const mrb_data_type encoder_type = {
-    .struct_name = "encoder@mruby-brotli",
-    .dfree = (void (*)(mrb_state *, void *))encoder_free,
-};
+static struct bufpool *
+bufpool_ref(struct bufpool *pool)
+{
+    pool->refcount ++;
 
-static struct encoder *
-getencoder(MRB, VALUE self)
+    return pool;
+}
+
+static void
+bufpool_unref(struct bufpool *pool)
 {
-    return (struct encoder *)mrbx_getref(mrb, self, &encoder_type);
+    pool->refcount --;
+
+    if (pool->refcount <= 0) {
+        bufpool_purge(pool);
+        mrb_free(pool->mrb, pool);
+    }
 }
 
-static VALUE
-encoder_set_outport(MRB, VALUE self, struct encoder *p, VALUE port)
+static void *
+bufpool_alloc_by(struct bufpool *pool, enum aux_allocator allocator, size_t size)
 {
-    mrb_iv_set(mrb, self, SYMBOL("outport@mruby-brotli"), port);
-    p->outport = port;
+    pool->stats.native_allocs ++;
+    pool->stats.native_bytes += size;
+
+    if (allocator == AUX_ALLOCATOR_POOL && size >= EXT_POOL_MIN_BLOCK) {
+        union bufpool_block **bp = &pool->blocks;
+        for (; *bp; bp = &(*bp)->h.next) {
+            if ((*bp)->h.size == size) {
+                union bufpool_block *b = *bp;
+                *bp = b->h.next;
+                pool->cached -= size;
+                return b + 1;
+            }
+        }
+    }
 
-    return port;
+    if (size > SIZE_MAX - sizeof(union bufpool_block)) { return NULL; }
+
+    union bufpool_block *b;
+    if (allocator == AUX_ALLOCATOR_SYSTEM) {
+        b = (union bufpool_block *)malloc(sizeof(union bufpool_block) + size);
+    } else {
+        b = (union bufpool_block *)mrb_malloc_simple(pool->mrb, sizeof(union bufpool_block) + size);
+    }
+    if (!b) { return NULL; }
+    b->h.size = size;
+    b->h.allocator = allocator;
+
+    return b + 1;
 }
 
-static struct RString *
-encoder_set_outbuf(MRB, VALUE obj, struct encoder *p, struct RString *buf)
+static void *
+bufpool_alloc(void *opaque, size_t size)
 {
-    mrb_iv_set(mrb, obj, SYMBOL("outbuf@mruby-brotli"), (buf ? VALUE(buf) : Qnil));
-    p->outbuf = buf;
+    struct bufpool *pool = (struct bufpool *)opaque;
 
-    return buf;
+    return bufpool_alloc_by(pool, pool->allocator, size);
 }
 
-/*
- * call-seq:
- *  new(outbuf) -> encoder object
- *  new(outbuf, quality: nil, lgwin: nil, mode: nil, sizehint: nil) -> encoder object
- */
-static VALUE
-enc_s_new(MRB, VALUE self)
+static void
+bufpool_free(void *opaque, void *ptr)
 {
-    struct RData *rd;
-    struct encoder *p;
-    Data_Make_Struct(mrb, mrb_class_ptr(self), struct encoder, &encoder_type, p, rd);
+    struct bufpool *pool = (struct bufpool *)opaque;
 
-    p->brotli = BrotliEncoderCreateInstance((brotli_alloc_func)mrb_malloc_simple, (brotli_free_func)mrb_free, mrb);
+    if (!ptr) { return; }
 
-    if (!p->brotli) {
-        mrb_free(mrb, rd->data);
-        rd->data = NULL;
-        mrb_raise(mrb, E_RUNTIME_ERROR,
-                  "failed allocation in BrotliEncoderCreateInstance()");
-    }
-
-    p->outport = Qnil;
-    p->outbuf = NULL;
-    p->total_in = 0;
-    p->total_out = 0;
-    p->inbuf.ptr = mrb_malloc(mrb, EXT_INBUF_SIZE);
-    p->inbuf.cur = p->inbuf.ptr;
-    p->inbuf.size = EXT_INBUF_SIZE;
-
-    VALUE obj = VALUE(rd);
+    pool->stats.native_frees ++;
 
-    mrbx_funcall_passthrough(mrb, obj, id_initialize);
+    union bufpool_block *b = (union bufpool_block *)ptr - 1;
 
-    return obj;
+    if (b->h.allocator == AUX_ALLOCATOR_SYSTEM) {
+        free(b);
+    } else if (b->h.allocator == AUX_ALLOCATOR_POOL && b->h.size >= EXT_POOL_MIN_BLOCK &&
+            b->h.size <= pool->limit && pool->cached <= pool->limit - b->h.size) {
+        b->h.next = pool->blocks;
+        pool->blocks = b;
+        pool->cached += b->h.size;
+    } else {
+        mrb_free(pool->mrb, b);
+    }
 }
 
-static void
-enc_initialize_args(MRB, VALUE self, struct encoder **p, VALUE *outport)
+static struct bufpool *
+bufpool_get(MRB)
 {
-    VALUE opts = Qnil;
-    mrb_get_args(mrb, "o|H", outport, &opts);
-
-    *p = getencoder(mrb, self);
-
-    if (!NIL_P(opts)) {
-        VALUE quality, lgwin, mode, size_hint;
-        MRBX_SCANHASH(mrb, opts, Qnil,
-                MRBX_SCANHASH_ARGS("quality", &quality, Qnil),
-                MRBX_SCANHASH_ARGS("lgwin", &lgwin, Qnil),
-                MRBX_SCANHASH_ARGS("mode", &mode, Qnil),
-                MRBX_SCANHASH_ARGS("size_hint", &size_hint, Qnil));
-
-        if (!NIL_P(quality)) {
-            BrotliEncoderSetParameter((*p)->brotli, BROTLI_PARAM_QUALITY, convert_to_quality(mrb, quality));
-        }
+    VALUE mBrotli = VALUE(mrb_module_get(mrb, "Brotli"));
 
-        if (!NIL_P(lgwin)) {
-            BrotliEncoderSetParameter((*p)->brotli, BROTLI_PARAM_LGWIN, convert_to_lgwin(mrb, lgwin));
-        }
+    return (struct bufpool *)mrb_cptr(mrb_iv_get(mrb, mBrotli, SYMBOL("bufpool@mruby-brotli")));
+}
 
-        if (!NIL_P(mode)) {
-            BrotliEncoderSetParameter((*p)->brotli, BROTLI_PARAM_MODE, convert_to_mode(mrb, mode));
+static enum aux_allocator
+convert_to_allocator(MRB, VALUE allocator)
+{
+    if (NIL_P(allocator)) {
+        return bufpool_get(mrb)->allocator;
+    } else if (mrb_string_p(allocator) || mrb_symbol_p(allocator)) {
+        const char *str = mrbx_get_const_cstr(mrb, allocator);
+
+        if (strcasecmp(str, "pool") == 0) {
+            return AUX_ALLOCATOR_POOL;
+        } else if (strcasecmp(str, "mruby") == 0) {
+            return AUX_ALLOCATOR_MRUBY;
+        } else if (strcasecmp(str, "system") == 0) {
+            return AUX_ALLOCATOR_SYSTEM;
         }
+    }
 
-        if (!NIL_P(size_hint)) {
-            BrotliEncoderSetParameter((*p)->brotli, BROTLI_PARAM_SIZE_HINT, mrb_int(mrb, size_hint));
-        }
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong allocator (expect :pool, :mruby, :system or nil) - %S",
+               allocator);
+}
 
-        //BrotliEncoderSetParameter((*p)->brotli, BROTLI_PARAM_LGBLOCK, ?);
-        //BrotliEncoderSetParameter((*p)->brotli, BROTLI_PARAM_DISABLE_LITERAL_CONTEXT_MODELING, TRUE);
+static VALUE
+aux_allocator_value(MRB, enum aux_allocator allocator)
+{
+    switch (allocator) {
+    case AUX_ALLOCATOR_MRUBY:
+        return mrb_symbol_value(SYMBOL("mruby"));
+    case AUX_ALLOCATOR_SYSTEM:
+        return mrb_symbol_value(SYMBOL("system"));
+    default:
+        return mrb_symbol_value(SYMBOL("pool"));
     }
 }
 
+/*
+ * call-seq:
+ *  allocator -> :pool, :mruby or :system
+ *
+ * Returns the default allocator for the memory of libbrotli.
+ */
 static VALUE
-enc_initialize(MRB, VALUE self)
+bufpool_s_get_allocator(MRB, VALUE self)
 {
-    struct encoder *p;
-    VALUE outport;
-    enc_initialize_args(mrb, self, &p, &outport);
-
-    encoder_set_outport(mrb, self, p, outport);
-    encoder_set_outbuf(mrb, self, p, NULL);
+    mrb_get_args(mrb, "");
 
-    return self;
+    return aux_allocator_value(mrb, bufpool_get(mrb)->allocator);
 }
 
-static void
-enc_update(MRB, VALUE self, struct encoder *p,
-           const char *next_in, size_t avail_in,
-           BrotliEncoderOperation op)
+/*
+ * call-seq:
+ *  allocator = allocator
+ *
+ * [:pool]
+ *  (default) the large blocks (hasher tables, ring buffers and so on) freed
+ *  by a state are kept up to Brotli.pool_limit bytes, and given to the next
+ *  state that asks for the same size.
+ * [:mruby]
+ *  uses the allocator of the mruby VM without keeping blocks.
+ * [:system]
+ *  uses malloc() / free() of the C library, bypassing the mruby VM.
+ */
+static VALUE
+bufpool_s_set_allocator(MRB, VALUE self)
 {
-    size_t insize = avail_in;
+    VALUE allocator;
+    mrb_get_args(mrb, "o", &allocator);
 
-    for (;;) {
-        encoder_set_outbuf(mrb, self, p, mrbx_str_recycle(mrb, p->outbuf, EXT_DEFAULT_OUTBUF_SIZE));
-        mrbx_str_set_len(mrb, p->outbuf, 0);
+    struct bufpool *pool = bufpool_get(mrb);
+    pool->allocator = (NIL_P(allocator) ? AUX_ALLOCATOR_POOL : convert_to_allocator(mrb, allocator));
 
-        char *next_out = RSTR_PTR(p->outbuf);
-        size_t avail_out = RSTR_CAPA(p->outbuf);
+    return allocator;
+}
 
-        BROTLI_BOOL ok = BrotliEncoderCompressStream(p->brotli, op,
-                                                     &avail_in, (const uint8_t **)&next_in,
-                                                     &avail_out, (uint8_t **)&next_out, &p->total_out);
+/*
+ * call-seq:
+ *  pool_limit -> integer
+ */
+static VALUE
+bufpool_s_get_limit(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
 
-        if (!ok) {
-            mrb_raisef(mrb, E_RUNTIME_ERROR,
-                       "failed BrotliEncoderCompressStream - %S", self);
-        }
+    return aux_uint64_value(mrb, bufpool_get(mrb)->limit);
+}
 
-        size_t size = next_out - RSTR_PTR(p->outbuf);
+/*
+ * call-seq:
+ *  pool_limit = bytes
+ *
+ * Sets the maximum bytes of the blocks kept by the pool. The blocks over
+ * the new limit are released immediately.
+ */
+static VALUE
+bufpool_s_set_limit(MRB, VALUE self)
+{
+    mrb_int limit;
+    mrb_get_args(mrb, "i", &limit);
 
-        mrbx_str_set_len(mrb, p->outbuf, size);
+    if (limit < 0) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "negative pool_limit - %S", VALUE(limit));
+    }
 
-        if (size > 0) {
-            FUNCALL(mrb, p->outport, id_op_lsh, VALUE(p->outbuf));
-        }
+    struct bufpool *pool = bufpool_get(mrb);
+    pool->limit = (size_t)limit;
 
-        if (avail_in > 0 || BrotliEncoderHasMoreOutput(p->brotli)) {
-            continue;
-        } else {
-            break;
-        }
+    if (pool->cached > pool->limit) {
+        bufpool_purge(pool);
     }
 
-    p->total_in += insize;
+    return VALUE(limit);
 }
 
 /*
  * call-seq:
- *  encode(src) -> self
+ *  stats -> hash
+ *
+ * Returns the sum of the instrumentation counters of all encoders and
+ * decoders in this mrb_state. ``native_*'' also include the one-shot
+ * functions running on the mruby thread.
  */
 static VALUE
-enc_encode(MRB, VALUE self)
+bufpool_s_stats(MRB, VALUE self)
 {
-    VALUE src;
-    mrb_get_args(mrb, "S", &src);
+    mrb_get_args(mrb, "");
 
-    enc_update(mrb, self, getencoder(mrb, self),
-               RSTRING_PTR(src), RSTRING_LEN(src),
-               BROTLI_OPERATION_PROCESS);
+    struct bufpool *pool = bufpool_get(mrb);
+    VALUE hash = aux_stats_to_hash(mrb, &pool->stats);
+    mrb_hash_set(mrb, hash, mrb_symbol_value(SYMBOL("native_cached")), aux_uint64_value(mrb, pool->cached));
 
-    return self;
+    return hash;
 }
 
-static VALUE
-enc_flush(MRB, VALUE self)
+static void
+init_bufpool(MRB, struct RClass *mBrotli)
 {
-    mrb_get_args(mrb, "");
+    struct bufpool *pool = (struct bufpool *)mrb_calloc(mrb, 1, sizeof(struct bufpool));
+    pool->mrb = mrb;
+    pool->refcount = 1;
+    pool->limit = EXT_POOL_LIMIT;
+
+    mrb_iv_set(mrb, VALUE(mBrotli), SYMBOL("bufpool@mruby-brotli"), mrb_cptr_value(mrb, pool));
+
+    mrb_define_class_method(mrb, mBrotli, "stats", bufpool_s_stats, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, mBrotli, "allocator", bufpool_s_get_allocator, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, mBrotli, "allocator=", bufpool_s_set_allocator, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, mBrotli, "pool_limit", bufpool_s_get_limit, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, mBrotli, "pool_limit=", bufpool_s_set_limit, MRB_ARGS_REQ(1));
+}
 
-    struct encoder *p = getencoder(mrb, self);
+static void
+final_bufpool(MRB)
+{
+    struct bufpool *pool = bufpool_get(mrb);
 
-    enc_update(mrb, self, p, NULL, 0, BROTLI_OPERATION_FLUSH);
+    /* states that are still alive are destroyed after this */
+    pool->limit = 0;
+    bufpool_unref(pool);
+}
 
-    return self;
+static BrotliEncoderState *
+aux_encoder_create_instance(MRB, struct bufpool *pool)
+{
+    return BrotliEncoderCreateInstance(bufpool_alloc, bufpool_free, pool);
 }
 
-static VALUE
-enc_finish(MRB, VALUE self)
+/*
+ * Counts the memory drawn from the pool by a state, and refuses the
+ * allocation over the limit. It also keeps the statistics of the instance.
+ */
+struct memcap
 {
-    mrb_get_args(mrb, "");
+    struct bufpool *pool;
+    size_t limit;
+    size_t used;
+    mrb_bool exceeded;
+    enum aux_allocator allocator;
+    struct aux_stats stats;
+};
 
-    enc_update(mrb, self, getencoder(mrb, self), NULL, 0, BROTLI_OPERATION_FINISH);
+#define MEMCAP_STATS_ADD(CAP, FIELD, N)                                 \
+    do {                                                                \
+        uint64_t aux_stats_n_ = (N);                                    \
+        (CAP)->stats.FIELD += aux_stats_n_;                             \
+        (CAP)->pool->stats.FIELD += aux_stats_n_;                       \
+    } while (0)
 
-    return self;
+static void
+memcap_init(struct memcap *cap, struct bufpool *pool, size_t limit)
+{
+    cap->pool = pool;
+    cap->limit = (limit > 0 ? limit : SIZE_MAX);
+    cap->used = 0;
+    cap->exceeded = FALSE;
+    cap->allocator = pool->allocator;
+    memset(&cap->stats, 0, sizeof(cap->stats));
 }
 
-static VALUE
-enc_is_finished(MRB, VALUE self)
+static void *
+memcap_alloc(void *opaque, size_t size)
 {
-    mrb_get_args(mrb, "");
+    struct memcap *cap = (struct memcap *)opaque;
 
-    struct encoder *p = getencoder(mrb, self);
+    if (size > cap->limit - cap->used) {
+        cap->exceeded = TRUE;
+        return NULL;
+    }
 
-    return (BrotliEncoderIsFinished(p->brotli) == BROTLI_FALSE ? Qfalse : Qtrue);
+    void *ptr = bufpool_alloc_by(cap->pool, cap->allocator, size);
+    if (ptr) {
+        cap->used += size;
+        cap->stats.native_allocs ++;
+        cap->stats.native_bytes += size;
+    }
+
+    return ptr;
 }
 
-static VALUE
-enc_total_in(MRB, VALUE self)
+static void
+memcap_free(void *opaque, void *ptr)
 {
-    mrb_get_args(mrb, "");
+    struct memcap *cap = (struct memcap *)opaque;
 
-    struct encoder *p = getencoder(mrb, self);
+    if (!ptr) { return; }
 
-    if (p->total_in > MRB_INT_MAX) {
-        return mrb_float_value(mrb, p->total_in);
-    } else {
-        return mrb_fixnum_value(p->total_in);
+    cap->used -= ((union bufpool_block *)ptr - 1)->h.size;
+    cap->stats.native_frees ++;
+    bufpool_free(cap->pool, ptr);
+}
+
+static void
+memcap_check(MRB, struct memcap *cap)
+{
+    if (cap->exceeded) {
+        struct RClass *mBrotli = mrb_module_get(mrb, "Brotli");
+        mrb_raisef(mrb, mrb_class_get_under(mrb, mBrotli, "MemoryLimitError"),
+                   "decoder memory exceeds the limit (max_memory: %S bytes)",
+                   VALUE((mrb_int)cap->limit));
     }
 }
 
-static VALUE
-enc_total_out(MRB, VALUE self)
+static BrotliDecoderState *
+aux_decoder_create_instance(MRB, struct memcap *cap)
 {
-    mrb_get_args(mrb, "");
+    return BrotliDecoderCreateInstance(memcap_alloc, memcap_free, cap);
+}
 
-    struct encoder *p = getencoder(mrb, self);
+static BrotliEncoderState *
+aux_encoder_create_counted(MRB, struct memcap *cap)
+{
+    return BrotliEncoderCreateInstance(memcap_alloc, memcap_free, cap);
+}
 
-    if (p->total_out > MRB_INT_MAX) {
-        return mrb_float_value(mrb, p->total_out);
-    } else {
-        return mrb_fixnum_value(p->total_out);
-    }
+static BROTLI_BOOL
+memcap_compress_stream(struct memcap *cap, BrotliEncoderState *brotli, BrotliEncoderOperation op,
+                       size_t *avail_in, const uint8_t **next_in,
+                       size_t *avail_out, uint8_t **next_out, size_t *total_out)
+{
+    uint64_t t = aux_clock_nsec();
+    BROTLI_BOOL ok = BrotliEncoderCompressStream(brotli, op, avail_in, next_in, avail_out, next_out, total_out);
+    MEMCAP_STATS_ADD(cap, stream_nsec, aux_clock_nsec() - t);
+    MEMCAP_STATS_ADD(cap, stream_calls, 1);
+
+    return ok;
 }
 
-static void
-enc_s_encode_args(MRB, VALUE self, struct RString **input, size_t *insize, struct RString **output, size_t *outsize, int *quality, int *lgwin, int *mode)
+static BrotliDecoderResult
+memcap_decompress_stream(struct memcap *cap, BrotliDecoderState *brotli,
+                         size_t *avail_in, const uint8_t **next_in,
+                         size_t *avail_out, uint8_t **next_out, size_t *total_out)
 {
-    VALUE *argv = NULL;
-    mrb_int argc = 0;
-    mrb_get_args(mrb, "*", &argv, &argc);
+    uint64_t t = aux_clock_nsec();
+    BrotliDecoderResult ok = BrotliDecoderDecompressStream(brotli, avail_in, next_in, avail_out, next_out, total_out);
+    MEMCAP_STATS_ADD(cap, stream_nsec, aux_clock_nsec() - t);
+    MEMCAP_STATS_ADD(cap, stream_calls, 1);
 
-    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-        VALUE quality_v, lgwin_v, mode_v;
+    return ok;
+}
 
-        MRBX_SCANHASH(mrb, argv[argc - 1], Qnil,
-                MRBX_SCANHASH_ARGS("quality", &quality_v, Qnil),
-                MRBX_SCANHASH_ARGS("lgwin", &lgwin_v, Qnil),
-                MRBX_SCANHASH_ARGS("mode", &mode_v, Qnil));
+static VALUE
+memcap_stats(MRB, const struct memcap *cap)
+{
+    VALUE hash = aux_stats_to_hash(mrb, &cap->stats);
+    mrb_hash_set(mrb, hash, mrb_symbol_value(SYMBOL("native_in_use")), aux_uint64_value(mrb, cap->used));
 
-        *quality = convert_to_quality(mrb, quality_v);
-        *lgwin = convert_to_lgwin(mrb, lgwin_v);
-        *mode = convert_to_mode(mrb, mode_v);
+    return hash;
+}
 
-        argc --;
-    } else {
-        *quality = BROTLI_DEFAULT_QUALITY;
-        *lgwin = BROTLI_DEFAULT_WINDOW;
-        *mode = BROTLI_DEFAULT_MODE;
-    }
+/* native workers for the batch functions */
 
-    switch (argc) {
-    case 1:
-        *outsize = -1;
-        *output = NULL;
-        break;
-    case 2:
-        if (mrb_string_p(argv[1])) {
-            *outsize = -1;
-            *output = RString(argv[1]);
-        } else {
-            *outsize = convert_to_size_t(mrb, argv[1]);
-            *output = NULL;
-        }
-        break;
-    case 3:
-        *outsize = convert_to_size_t(mrb, argv[1]);
-        *output = RString(argv[2]);
-        break;
-    default:
-        mrb_raisef(mrb, E_ARGUMENT_ERROR,
-                   "wrong number arguments (given %S, expect 1 .. 2 + keywords)",
-                   VALUE(argc));
-    }
+#ifdef HAVE_THREAD
+#define AUX_BATCH_MAX_THREADS 256
 
-    mrb_check_type(mrb, argv[0], MRB_TT_STRING);
-    *input = RSTRING(argv[0]);
-    *insize = RSTR_LEN(*input);
+struct aux_batch
+{
+    void *(*func)(void *item);
+    char *items;
+    size_t itemsize;
+    size_t nitems;
+    size_t next;
+    pthread_mutex_t mutex;
+};
 
-    if ((ssize_t)*outsize < 0) {
-        *outsize = BrotliEncoderMaxCompressedSize(*insize);
-    }
+static void *
+aux_batch_worker(void *user)
+{
+    struct aux_batch *b = (struct aux_batch *)user;
 
-    *output = mrbx_str_force_recycle(mrb, *output, *outsize);
-    mrbx_str_set_len(mrb, *output, 0);
+    for (;;) {
+        pthread_mutex_lock(&b->mutex);
+        size_t i = b->next ++;
+        pthread_mutex_unlock(&b->mutex);
+
+        if (i >= b->nitems) { return NULL; }
+
+        b->func(b->items + i * b->itemsize);
+    }
 }
 
 /*
- * call-seq:
- *  encode(input, outsize = nil, output = nil, **opts) -> output
- *  encode(input, output, **opts) -> output
- *
- * [input]
- * [output = nil]
- * [outsize = nil]
- * [opts]
- *  quality = nil::
- *  lgwin = nil::
- *  mode = nil::
+ * Calls ``func`` for each item on up to ``threads`` native threads,
+ * including the calling thread. ``func`` must not touch the mruby VM.
  */
-static VALUE
-enc_s_encode(MRB, VALUE self)
+static void
+aux_batch_run(void *(*func)(void *), void *items, size_t itemsize, size_t nitems, int threads)
 {
-    struct RString *input, *output;
-    size_t insize, outsize;
-    int quality, lgwin, mode;
-    enc_s_encode_args(mrb, self, &input, &insize, &output, &outsize, &quality, &lgwin, &mode);
+    struct aux_batch b = { func, (char *)items, itemsize, nitems, 0 };
+    pthread_t th[AUX_BATCH_MAX_THREADS];
+    size_t nthreads = MIN(MIN((size_t)threads, nitems), (size_t)AUX_BATCH_MAX_THREADS);
+    size_t i, running = 0;
 
-    BROTLI_BOOL ok = BrotliEncoderCompress(
-            quality, lgwin, mode,
-            insize, (const uint8_t *)RSTR_PTR(input),
-            &outsize, (uint8_t *)RSTR_PTR(output));
+    pthread_mutex_init(&b.mutex, NULL);
 
-    if (!ok) {
-        mrb_raise(mrb, E_RUNTIME_ERROR, "failed BrotliEncoderCompress");
+    for (i = 1; i < nthreads; i ++, running ++) {
+        if (pthread_create(&th[running], NULL, aux_batch_worker, &b) != 0) { break; }
     }
 
-    mrbx_str_set_len(mrb, output, outsize);
+    aux_batch_worker(&b);
 
-    return VALUE(output);
-}
+    for (i = 0; i < running; i ++) {
+        pthread_join(th[i], NULL);
+    }
 
-static void
-init_encoder(MRB, struct RClass *mBrotli)
-{
-    struct RClass *cEncoder = mrb_define_class_under(mrb, mBrotli, "Encoder", mrb_cObject);
-    mrb_define_class_method(mrb, cEncoder, "encode", enc_s_encode, MRB_ARGS_ANY());
-    mrb_define_class_method(mrb, cEncoder, "new", enc_s_new, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cEncoder, "initialize", enc_initialize, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cEncoder, "encode", enc_encode, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cEncoder, "flush", enc_flush, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cEncoder, "finish", enc_finish, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cEncoder, "finished?", enc_is_finished, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cEncoder, "total_in", enc_total_in, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cEncoder, "total_out", enc_total_out, MRB_ARGS_NONE());
-    //mrb_define_method(mrb, cEncoder, "outport", enc_get_outport, MRB_ARGS_NONE());
-    //mrb_define_method(mrb, cEncoder, "outport=", enc_set_outport, MRB_ARGS_ARG(1));
+    pthread_mutex_destroy(&b.mutex);
 }
+#endif
 
-/* class Brotli::Decoder */
-
-struct decoder
-{
-    BrotliDecoderState *brotli;
-    VALUE inport;
-    const char *nextin;
-    size_t availin;
-    size_t total_out;
-    BrotliDecoderResult status;
-};
+/* module Brotli::Constants */
 
 static void
-decoder_free(MRB, struct decoder *p)
+init_constants(MRB, struct RClass *mBrotli)
 {
-    if (p->brotli) {
-        BrotliDecoderDestroyInstance(p->brotli);
-        p->brotli = NULL;
+    struct RClass *mConstants = mrb_define_module_under(mrb, mBrotli, "Constants");
+    mrb_include_module(mrb, mBrotli, mConstants);
+    mrb_define_const(mrb, mConstants, "BROTLI_MIN_WINDOW_BITS", VALUE((mrb_int)BROTLI_MIN_WINDOW_BITS));
+    mrb_define_const(mrb, mConstants, "BROTLI_MAX_WINDOW_BITS", VALUE((mrb_int)BROTLI_MAX_WINDOW_BITS));
+    mrb_define_const(mrb, mConstants, "BROTLI_LARGE_MAX_WINDOW_BITS", VALUE((mrb_int)BROTLI_LARGE_MAX_WINDOW_BITS));
+    mrb_define_const(mrb, mConstants, "BROTLI_MIN_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MIN_INPUT_BLOCK_BITS));
+    mrb_define_const(mrb, mConstants, "BROTLI_MAX_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MAX_INPUT_BLOCK_BITS));
+    mrb_define_const(mrb, mConstants, "BROTLI_MAX_NPOSTFIX", VALUE((mrb_int)AUX_BROTLI_MAX_NPOSTFIX));
+    mrb_define_const(mrb, mConstants, "BROTLI_MAX_NDIRECT", VALUE((mrb_int)AUX_BROTLI_MAX_NDIRECT));
+    mrb_define_const(mrb, mConstants, "BROTLI_MAX_STREAM_OFFSET", VALUE((mrb_int)AUX_BROTLI_MAX_STREAM_OFFSET));
+    mrb_define_const(mrb, mConstants, "BROTLI_MIN_QUALITY", VALUE((mrb_int)BROTLI_MIN_QUALITY));
+    mrb_define_const(mrb, mConstants, "BROTLI_MAX_QUALITY", VALUE((mrb_int)BROTLI_MAX_QUALITY));
+    mrb_define_const(mrb, mConstants, "BROTLI_MODE_GENERIC", VALUE((mrb_int)BROTLI_MODE_GENERIC));
+    mrb_define_const(mrb, mConstants, "BROTLI_MODE_TEXT", VALUE((mrb_int)BROTLI_MODE_TEXT));
+    mrb_define_const(mrb, mConstants, "BROTLI_MODE_FONT", VALUE((mrb_int)BROTLI_MODE_FONT));
+    mrb_define_const(mrb, mConstants, "BROTLI_DEFAULT_QUALITY", VALUE((mrb_int)BROTLI_DEFAULT_QUALITY));
+    mrb_define_const(mrb, mConstants, "BROTLI_DEFAULT_WINDOW", VALUE((mrb_int)BROTLI_DEFAULT_WINDOW));
+    mrb_define_const(mrb, mConstants, "BROTLI_DEFAULT_MODE", VALUE((mrb_int)BROTLI_DEFAULT_MODE));
+
+    mrb_define_const(mrb, mBrotli, "MIN_WINDOW_BITS", VALUE((mrb_int)BROTLI_MIN_WINDOW_BITS));
+    mrb_define_const(mrb, mBrotli, "MAX_WINDOW_BITS", VALUE((mrb_int)BROTLI_MAX_WINDOW_BITS));
+    mrb_define_const(mrb, mBrotli, "LARGE_MAX_WINDOW_BITS", VALUE((mrb_int)BROTLI_LARGE_MAX_WINDOW_BITS));
+    mrb_define_const(mrb, mBrotli, "MIN_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MIN_INPUT_BLOCK_BITS));
+    mrb_define_const(mrb, mBrotli, "MAX_INPUT_BLOCK_BITS", VALUE((mrb_int)BROTLI_MAX_INPUT_BLOCK_BITS));
+    mrb_define_const(mrb, mBrotli, "MAX_NPOSTFIX", VALUE((mrb_int)AUX_BROTLI_MAX_NPOSTFIX));
+    mrb_define_const(mrb, mBrotli, "MAX_NDIRECT", VALUE((mrb_int)AUX_BROTLI_MAX_NDIRECT));
+    mrb_define_const(mrb, mBrotli, "MAX_STREAM_OFFSET", VALUE((mrb_int)AUX_BROTLI_MAX_STREAM_OFFSET));
+    mrb_define_const(mrb, mBrotli, "MIN_QUALITY", VALUE((mrb_int)BROTLI_MIN_QUALITY));
+    mrb_define_const(mrb, mBrotli, "MAX_QUALITY", VALUE((mrb_int)BROTLI_MAX_QUALITY));
+    mrb_define_const(mrb, mBrotli, "MODE_GENERIC", VALUE((mrb_int)BROTLI_MODE_GENERIC));
+    mrb_define_const(mrb, mBrotli, "MODE_TEXT", VALUE((mrb_int)BROTLI_MODE_TEXT));
+    mrb_define_const(mrb, mBrotli, "MODE_FONT", VALUE((mrb_int)BROTLI_MODE_FONT));
+    mrb_define_const(mrb, mBrotli, "DEFAULT_QUALITY", VALUE((mrb_int)BROTLI_DEFAULT_QUALITY));
+    mrb_define_const(mrb, mBrotli, "DEFAULT_WINDOW", VALUE((mrb_int)BROTLI_DEFAULT_WINDOW));
+    mrb_define_const(mrb, mBrotli, "DEFAULT_MODE", VALUE((mrb_int)BROTLI_DEFAULT_MODE));
+}
+
+
+/* class Brotli::Dictionary */
+
+struct dictionary
+{
+    char *data;
+    size_t size;
+#ifdef HAVE_BROTLI_SHARED_DICTIONARY
+    BrotliEncoderPreparedDictionary *prepared;
+#endif
+};
+
+static void
+dictionary_cleanup(MRB, struct dictionary *p)
+{
+#ifdef HAVE_BROTLI_SHARED_DICTIONARY
+    if (p->prepared) {
+        BrotliEncoderDestroyPreparedDictionary(p->prepared);
+        p->prepared = NULL;
     }
+#endif
+
+    if (p->data) {
+        mrb_free(mrb, p->data);
+        p->data = NULL;
+        p->size = 0;
+    }
+}
 
+static void
+dictionary_free(MRB, struct dictionary *p)
+{
     if (p) {
+        dictionary_cleanup(mrb, p);
         mrb_free(mrb, p);
     }
 }
 
-static const mrb_data_type decoder_type = {
-    .struct_name = "decoder@mruby-brotli",
-    .dfree = (void (*)(mrb_state *, void *))decoder_free,
+static const mrb_data_type dictionary_type = {
+    .struct_name = "dictionary@mruby-brotli",
+    .dfree = (void (*)(mrb_state *, void *))dictionary_free,
 };
 
-static struct decoder *
-getdecoder(MRB, VALUE self)
+static struct dictionary *
+getdictionary(MRB, VALUE self)
 {
-    return (struct decoder *)mrbx_getref(mrb, self, &decoder_type);
+    return (struct dictionary *)mrbx_getref(mrb, self, &dictionary_type);
 }
 
 /*
- * call-seq:
- *  new(inport) -> decoder object
+ * Returns NULL if ``dict`` is nil.
  */
-static VALUE
-dec_s_new(MRB, VALUE self)
+static struct dictionary *
+getdictionary_or_nil(MRB, VALUE dict)
 {
-    struct RData *rd = mrb_data_object_alloc(mrb, RClass(self), NULL, &decoder_type);
-    rd->data = mrb_calloc(mrb, sizeof(struct decoder), 1);
-    struct decoder *p = (struct decoder *)rd->data;
-    p->brotli = BrotliDecoderCreateInstance((brotli_alloc_func)mrb_malloc_simple, (brotli_free_func)mrb_free, mrb);
-    if (!p->brotli) {
-        mrb_free(mrb, rd->data);
-        rd->data = NULL;
+    if (NIL_P(dict)) {
+        return NULL;
+    } else {
+        return getdictionary(mrb, dict);
+    }
+}
+
+static void
+encoder_attach_dictionary(MRB, BrotliEncoderState *brotli, struct dictionary *dict)
+{
+    if (!dict) { return; }
+
+#ifdef HAVE_BROTLI_SHARED_DICTIONARY
+    if (!dict->prepared ||
+            !BrotliEncoderAttachPreparedDictionary(brotli, dict->prepared)) {
         mrb_raise(mrb, E_RUNTIME_ERROR,
-                  "allocation error in BrotliDecoderCreateInstance()");
+                  "failed BrotliEncoderAttachPreparedDictionary()");
     }
+#else
+    mrb_raise(mrb, E_NOTIMP_ERROR, "dictionary needs brotli-1.1.0 or later");
+#endif
+}
 
-    //BrotliDecoderSetParameter(p->brotli, BROTLI_DECODER_PARAM_DISABLE_RING_BUFFER_REALLOCATION, BROTLI_TRUE);
+static BROTLI_BOOL
+aux_decoder_attach_dictionary(BrotliDecoderState *brotli, struct dictionary *dict)
+{
+    if (!dict) { return BROTLI_TRUE; }
 
-    p->inport = Qnil;
-    p->total_out = 0;
-    p->status = BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT;
+#ifdef HAVE_BROTLI_SHARED_DICTIONARY
+    return dict->data &&
+           BrotliDecoderAttachDictionary(brotli, BROTLI_SHARED_DICTIONARY_RAW,
+                                         dict->size, (const uint8_t *)dict->data);
+#else
+    return BROTLI_FALSE;
+#endif
+}
+
+static void
+decoder_attach_dictionary(MRB, BrotliDecoderState *brotli, struct dictionary *dict)
+{
+#ifndef HAVE_BROTLI_SHARED_DICTIONARY
+    if (dict) {
+        mrb_raise(mrb, E_NOTIMP_ERROR, "dictionary needs brotli-1.1.0 or later");
+    }
+#endif
+
+    if (!aux_decoder_attach_dictionary(brotli, dict)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed BrotliDecoderAttachDictionary()");
+    }
+}
+
+static VALUE
+dict_s_new(MRB, VALUE self)
+{
+    struct RData *rd;
+    struct dictionary *p;
+    Data_Make_Struct(mrb, mrb_class_ptr(self), struct dictionary, &dictionary_type, p, rd);
 
     VALUE obj = VALUE(rd);
 
@@ -655,381 +1203,5358 @@ dec_s_new(MRB, VALUE self)
     return obj;
 }
 
+/*
+ * call-seq:
+ *  new(raw_dictionary, quality: nil) -> dictionary object
+ *
+ * [raw_dictionary (String)]
+ *  The content is copied.
+ * [quality = nil]
+ *  Maximum quality that the prepared dictionary is used with.
+ */
 static VALUE
-dec_initialize(MRB, VALUE self)
+dict_initialize(MRB, VALUE self)
 {
-    struct decoder *p = getdecoder(mrb, self);
+    struct dictionary *p = getdictionary(mrb, self);
 
-    VALUE inport;
-    mrb_get_args(mrb, "o", &inport);
+    VALUE raw, opts = Qnil;
+    mrb_get_args(mrb, "S|H", &raw, &opts);
 
-    p->inport = mrbx_fakedin_new(mrb, inport);
-    p->status = BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT;
+    VALUE quality = Qnil;
+    if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("quality", &quality, Qnil));
+    }
+
+#ifdef HAVE_BROTLI_SHARED_DICTIONARY
+    /* the encoders and the decoders may refer to the prepared dictionary */
+    if (p->prepared) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "already initialized - %S", self);
+    }
+
+    p->size = RSTRING_LEN(raw);
+    p->data = (char *)mrb_malloc(mrb, p->size > 0 ? p->size : 1);
+    memcpy(p->data, RSTRING_PTR(raw), p->size);
+
+    p->prepared = BrotliEncoderPrepareDictionary(
+            BROTLI_SHARED_DICTIONARY_RAW, p->size, (const uint8_t *)p->data,
+            (NIL_P(quality) ? BROTLI_MAX_QUALITY : convert_to_quality(mrb, quality)),
+            (brotli_alloc_func)mrb_malloc_simple, (brotli_free_func)mrb_free, mrb);
+
+    if (!p->prepared) {
+        dictionary_cleanup(mrb, p);
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed BrotliEncoderPrepareDictionary()");
+    }
 
     return self;
+#else
+    (void)p;
+    mrb_raise(mrb, E_NOTIMP_ERROR, "dictionary needs brotli-1.1.0 or later");
+#endif
+}
+
+static VALUE
+dict_bytesize(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return mrb_fixnum_value(getdictionary(mrb, self)->size);
 }
 
 static void
-dec_decode_args(MRB, VALUE self, ssize_t *size, struct RString **dest)
+init_dictionary(MRB, struct RClass *mBrotli)
 {
-    VALUE argv[] = { Qnil, Qnil };
-    mrb_int argc = mrb_get_args(mrb, "|oS!", &argv[0], &argv[1]);
+    struct RClass *cDictionary = mrb_define_class_under(mrb, mBrotli, "Dictionary", mrb_cObject);
+    mrb_define_class_method(mrb, cDictionary, "new", dict_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDictionary, "initialize", dict_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDictionary, "bytesize", dict_bytesize, MRB_ARGS_NONE());
+}
 
-    (void)argc;
+/* class Brotli::MappedFile */
 
-    if (NIL_P(argv[0])) {
-        *size = -1;
-    } else {
-        mrb_int n = mrb_int(mrb, argv[0]);
-        if (n < 0 || n > SSIZE_MAX) {
-            mrb_raisef(mrb, E_ARGUMENT_ERROR,
-                       "``size'' is too big or too small - %S",
-                       argv[0]);
-        }
-        *size = n;
+struct mapped_file
+{
+    char *data;
+    size_t size;
+    mrb_bool mapped;
+};
+
+static void
+mapped_file_unmap(MRB, struct mapped_file *p)
+{
+#ifdef HAVE_MMAP
+    if (p->data && p->size > 0) {
+        munmap(p->data, p->size);
     }
+#endif
 
-    *dest = mrbx_str_force_recycle(mrb, argv[1], (*size < 0 ? EXT_PARTIAL_READ_SIZE : *size));
-    mrbx_str_set_len(mrb, *dest, 0);
+    p->data = NULL;
+    p->size = 0;
+    p->mapped = FALSE;
 }
 
-static ssize_t
-dec_decode_partial(MRB, VALUE self, struct decoder *p, char *dest, ssize_t size)
+static void
+mapped_file_free(MRB, struct mapped_file *p)
 {
-    intptr_t dest0 = (intptr_t)dest;
-    intptr_t destend = (intptr_t)dest + size;
+    if (p) {
+        mapped_file_unmap(mrb, p);
+        mrb_free(mrb, p);
+    }
+}
 
-    if (p->status <= BROTLI_DECODER_RESULT_SUCCESS) { return 0; }
+static const mrb_data_type mapped_file_type = {
+    .struct_name = "mapped_file@mruby-brotli",
+    .dfree = (void (*)(mrb_state *, void *))mapped_file_free,
+};
 
-    while ((intptr_t)dest < destend) {
-        if (p->status == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
-            p->availin = (size_t)mrbx_fakedin_read(mrb, p->inport, &p->nextin, EXT_PARTIAL_READ_SIZE);
-        }
+static struct mapped_file *
+getmappedfile(MRB, VALUE self)
+{
+    return (struct mapped_file *)mrbx_getref(mrb, self, &mapped_file_type);
+}
 
-        if ((ssize_t)p->availin < 0) {
-            mrb_raise(mrb, E_RUNTIME_ERROR, "unexpected end of stream");
+static VALUE
+mapped_s_new(MRB, VALUE self)
+{
+    struct RData *rd;
+    struct mapped_file *p;
+    Data_Make_Struct(mrb, mrb_class_ptr(self), struct mapped_file, &mapped_file_type, p, rd);
+
+    VALUE obj = VALUE(rd);
+
+    mrbx_funcall_passthrough(mrb, obj, id_initialize);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  new(path) -> mapped file object
+ *
+ * Maps the whole file read-only. The pages are read by the kernel on demand.
+ */
+static VALUE
+mapped_initialize(MRB, VALUE self)
+{
+    struct mapped_file *p = getmappedfile(mrb, self);
+
+    const char *path;
+    mrb_get_args(mrb, "z", &path);
+
+#ifdef HAVE_MMAP
+    mapped_file_unmap(mrb, p);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { mrb_sys_fail(mrb, path); }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        mrb_sys_fail(mrb, path);
+    }
+
+    if (st.st_size < 0 || (uint64_t)st.st_size > (uint64_t)MRBX_STR_MAX ||
+            (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        close(fd);
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "file is too big to map - %S", mrb_str_new_cstr(mrb, path));
+    }
+
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            mrb_sys_fail(mrb, path);
         }
 
-        p->status = BrotliDecoderDecompressStream(p->brotli, &p->availin, (const uint8_t **)&p->nextin, (size_t *)&size, (uint8_t **)&dest, &p->total_out);
+#ifdef MADV_SEQUENTIAL
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
 
-        if (p->status == BROTLI_DECODER_RESULT_SUCCESS) {
-            break;
-        } else if (p->status < BROTLI_DECODER_RESULT_SUCCESS) {
-            int err = BrotliDecoderGetErrorCode(p->brotli);
-            mrb_raisef(mrb, E_RUNTIME_ERROR,
-                       "failed BrotliDecoderDecompressStream() - %S (%S)",
-                       VALUE((mrb_int)err),
-                       VALUE(BrotliDecoderErrorString(err)));
+        p->data = (char *)data;
+        p->size = (size_t)st.st_size;
+    }
+
+    close(fd);
+    p->mapped = TRUE;
+
+    return self;
+#else
+    (void)p;
+    (void)path;
+    mrb_raise(mrb, E_NOTIMP_ERROR, "Brotli::MappedFile is not available on this platform");
+#endif
+}
+
+static VALUE
+mapped_bytesize(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return VALUE((mrb_int)getmappedfile(mrb, self)->size);
+}
+
+/*
+ * call-seq:
+ *  byteslice(offset, length) -> string or nil
+ *
+ * Copies a part of the file into a new string, like String#byteslice.
+ * Only the pages of the part are read.
+ */
+static VALUE
+mapped_byteslice(MRB, VALUE self)
+{
+    mrb_int offset, len;
+    mrb_get_args(mrb, "ii", &offset, &len);
+
+    struct mapped_file *p = getmappedfile(mrb, self);
+
+    if (!p->mapped) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "closed mapped file");
+    }
+
+    if (offset < 0) {
+        offset += (mrb_int)p->size;
+    }
+
+    if (offset < 0 || (uint64_t)offset > p->size || len < 0) {
+        return Qnil;
+    }
+
+    if ((uint64_t)len > p->size - (size_t)offset) {
+        len = (mrb_int)(p->size - (size_t)offset);
+    }
+
+    return mrb_str_new(mrb, (p->data ? p->data + offset : ""), len);
+}
+
+static VALUE
+mapped_close(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    mapped_file_unmap(mrb, getmappedfile(mrb, self));
+
+    return Qnil;
+}
+
+static VALUE
+mapped_is_closed(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return (getmappedfile(mrb, self)->mapped ? Qfalse : Qtrue);
+}
+
+static void
+init_mapped_file(MRB, struct RClass *mBrotli)
+{
+    struct RClass *cMappedFile = mrb_define_class_under(mrb, mBrotli, "MappedFile", mrb_cObject);
+    mrb_define_class_method(mrb, cMappedFile, "new", mapped_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cMappedFile, "initialize", mapped_initialize, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cMappedFile, "bytesize", mapped_bytesize, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cMappedFile, "byteslice", mapped_byteslice, MRB_ARGS_REQ(2));
+    mrb_define_method(mrb, cMappedFile, "close", mapped_close, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cMappedFile, "closed?", mapped_is_closed, MRB_ARGS_NONE());
+}
+
+/*
+ * Takes the input of one-shot functions from a string or a Brotli::MappedFile.
+ * The returned pointer is valid while ``input`` is alive and not modified.
+ */
+static void
+aux_get_input(MRB, VALUE input, const char **ptr, size_t *size)
+{
+    if (mrb_string_p(input)) {
+        *ptr = RSTRING_PTR(input);
+        *size = RSTRING_LEN(input);
+    } else if (mrb_type(input) == MRB_TT_DATA && DATA_TYPE(input) == &mapped_file_type) {
+        struct mapped_file *p = getmappedfile(mrb, input);
+        if (!p->mapped) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "closed mapped file");
         }
+        *ptr = (p->data ? p->data : "");
+        *size = p->size;
+    } else {
+        mrb_raisef(mrb, E_TYPE_ERROR,
+                   "wrong input type - %S (expect String or Brotli::MappedFile)",
+                   input);
     }
+}
 
-    return (intptr_t)dest - dest0;
+/* class Brotli::Cache */
+
+/*
+ * The options that change the compressed bytes. It is zero cleared before
+ * filled, to be compared by memcmp() with the padding.
+ */
+struct cache_key
+{
+    int quality;
+    int lgwin;
+    int mode;
+    int lgblock;
+    int npostfix;
+    int ndirect;
+    int threads;
+    mrb_bool large_window;
+    mrb_bool disable_literal_context_modeling;
+    size_t stream_offset;
+    double skip_incompressible;
+};
+
+struct cache_entry
+{
+    struct cache_entry *chain;  /* next in the bucket */
+    struct cache_entry *prev;   /* more recently used */
+    struct cache_entry *next;   /* less recently used */
+    uint64_t hash;
+    struct cache_key key;
+    size_t insize;
+    size_t outsize;
+    char data[];                /* input, then output */
+};
+
+struct cache
+{
+    struct cache_entry **buckets;
+    size_t nbuckets;            /* power of 2, or 0 before the first insertion */
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    struct cache_entry *head;   /* most recently used */
+    struct cache_entry *tail;   /* least recently used */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+#define CACHE_ENTRY_BYTES(E)    (sizeof(struct cache_entry) + (E)->insize + (E)->outsize)
+
+static uint64_t
+aux_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+
+    return h;
+}
+
+/*
+ * Not cryptographic; the entries are always compared with the whole input.
+ */
+static uint64_t
+aux_hash_bytes(const void *ptr, size_t size, uint64_t seed)
+{
+    const char *p = (const char *)ptr;
+    uint64_t h = seed ^ ((uint64_t)size * UINT64_C(0x9e3779b97f4a7c15));
+    uint64_t w;
+
+    for (; size >= 8; p += 8, size -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ aux_hash_mix(w)) * UINT64_C(0x9e3779b97f4a7c15);
+        h = (h << 27) | (h >> 37);
+    }
+
+    if (size > 0) {
+        w = 0;
+        memcpy(&w, p, size);
+        h = (h ^ aux_hash_mix(w)) * UINT64_C(0x9e3779b97f4a7c15);
+    }
+
+    return aux_hash_mix(h);
+}
+
+static void
+cache_unlink(struct cache *p, struct cache_entry *e)
+{
+    if (e->prev) { e->prev->next = e->next; } else { p->head = e->next; }
+    if (e->next) { e->next->prev = e->prev; } else { p->tail = e->prev; }
+    e->prev = e->next = NULL;
+}
+
+static void
+cache_push_head(struct cache *p, struct cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = p->head;
+    if (p->head) { p->head->prev = e; } else { p->tail = e; }
+    p->head = e;
+}
+
+static void
+cache_remove(MRB, struct cache *p, struct cache_entry *e)
+{
+    struct cache_entry **slot = &p->buckets[e->hash & (p->nbuckets - 1)];
+
+    while (*slot != e) { slot = &(*slot)->chain; }
+    *slot = e->chain;
+
+    cache_unlink(p, e);
+    p->entries --;
+    p->bytes -= CACHE_ENTRY_BYTES(e);
+    mrb_free(mrb, e);
+}
+
+static void
+cache_clear(MRB, struct cache *p)
+{
+    while (p->tail) {
+        cache_remove(mrb, p, p->tail);
+    }
+}
+
+static void
+cache_free(MRB, struct cache *p)
+{
+    if (p) {
+        cache_clear(mrb, p);
+        mrb_free(mrb, p->buckets);
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type cache_type = {
+    .struct_name = "cache@mruby-brotli",
+    .dfree = (void (*)(mrb_state *, void *))cache_free,
+};
+
+static struct cache *
+getcache(MRB, VALUE self)
+{
+    return (struct cache *)mrbx_getref(mrb, self, &cache_type);
+}
+
+/*
+ * Returns NULL if ``cache`` is nil.
+ */
+static struct cache *
+getcache_or_nil(MRB, VALUE cache)
+{
+    if (NIL_P(cache)) {
+        return NULL;
+    } else {
+        return getcache(mrb, cache);
+    }
+}
+
+static uint64_t
+cache_hash(const struct cache_key *key, const char *input, size_t insize)
+{
+    return aux_hash_bytes(input, insize, aux_hash_bytes(key, sizeof(*key), 0));
+}
+
+/*
+ * Returns the entry as the most recently used, or NULL.
+ * The hit and miss counters are updated.
+ */
+static const struct cache_entry *
+cache_lookup(struct cache *p, uint64_t hash, const struct cache_key *key, const char *input, size_t insize)
+{
+    struct cache_entry *e = (p->nbuckets > 0 ? p->buckets[hash & (p->nbuckets - 1)] : NULL);
+
+    for (; e; e = e->chain) {
+        if (e->hash == hash && e->insize == insize &&
+                memcmp(&e->key, key, sizeof(*key)) == 0 &&
+                memcmp(e->data, input, insize) == 0) {
+            cache_unlink(p, e);
+            cache_push_head(p, e);
+            p->hits ++;
+            return e;
+        }
+    }
+
+    p->misses ++;
+
+    return NULL;
+}
+
+static void
+cache_rehash(MRB, struct cache *p, size_t nbuckets)
+{
+    struct cache_entry **buckets = (struct cache_entry **)mrb_calloc(mrb, nbuckets, sizeof(struct cache_entry *));
+    struct cache_entry *e;
+
+    for (e = p->head; e; e = e->next) {
+        struct cache_entry **slot = &buckets[e->hash & (nbuckets - 1)];
+        e->chain = *slot;
+        *slot = e;
+    }
+
+    mrb_free(mrb, p->buckets);
+    p->buckets = buckets;
+    p->nbuckets = nbuckets;
+}
+
+/*
+ * Stores the pair, evicting the least recently used entries to fit in
+ * ``max_bytes``. The pair larger than ``max_bytes`` is not stored.
+ */
+static void
+cache_insert(MRB, struct cache *p, uint64_t hash, const struct cache_key *key, const char *input, size_t insize, const char *output, size_t outsize)
+{
+    size_t bytes = sizeof(struct cache_entry) + insize + outsize;
+
+    if (insize > p->max_bytes || outsize > p->max_bytes || bytes > p->max_bytes) { return; }
+
+    if (p->entries >= p->nbuckets) {
+        cache_rehash(mrb, p, (p->nbuckets > 0 ? p->nbuckets * 2 : 64));
+    }
+
+    struct cache_entry *e = (struct cache_entry *)mrb_malloc(mrb, bytes);
+
+    while (p->tail && p->bytes + bytes > p->max_bytes) {
+        cache_remove(mrb, p, p->tail);
+        p->evictions ++;
+    }
+
+    e->hash = hash;
+    e->key = *key;
+    e->insize = insize;
+    e->outsize = outsize;
+    memcpy(e->data, input, insize);
+    memcpy(e->data + insize, output, outsize);
+
+    struct cache_entry **slot = &p->buckets[hash & (p->nbuckets - 1)];
+    e->chain = *slot;
+    *slot = e;
+    cache_push_head(p, e);
+    p->entries ++;
+    p->bytes += bytes;
+}
+
+static VALUE
+cache_s_new(MRB, VALUE self)
+{
+    struct RData *rd;
+    struct cache *p;
+    Data_Make_Struct(mrb, mrb_class_ptr(self), struct cache, &cache_type, p, rd);
+
+    VALUE obj = VALUE(rd);
+
+    mrbx_funcall_passthrough(mrb, obj, id_initialize);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  new(max_bytes: nil) -> cache
+ *
+ * [max_bytes = nil]
+ *  The budget of the inputs, outputs and bookkeeping of the entries.
+ *  32 MiB if nil.
+ */
+static VALUE
+cache_initialize(MRB, VALUE self)
+{
+    struct cache *p = getcache(mrb, self);
+
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "|H", &opts);
+
+    VALUE max_bytes = Qnil;
+    if (!NIL_P(opts)) {
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("max_bytes", &max_bytes, Qnil));
+    }
+
+    cache_clear(mrb, p);
+    p->max_bytes = (NIL_P(max_bytes) ? EXT_CACHE_DEFAULT_BYTES : convert_to_size_t(mrb, max_bytes));
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  clear -> self
+ *
+ * Drops all entries. The counters are kept.
+ */
+static VALUE
+cache_clear_m(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    cache_clear(mrb, getcache(mrb, self));
+
+    return self;
+}
+
+static VALUE
+cache_size(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return aux_uint64_value(mrb, getcache(mrb, self)->entries);
+}
+
+static VALUE
+cache_bytesize(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return aux_uint64_value(mrb, getcache(mrb, self)->bytes);
+}
+
+static VALUE
+cache_max_bytes(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return aux_uint64_value(mrb, getcache(mrb, self)->max_bytes);
+}
+
+static VALUE
+cache_hits(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return aux_uint64_value(mrb, getcache(mrb, self)->hits);
+}
+
+static VALUE
+cache_misses(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return aux_uint64_value(mrb, getcache(mrb, self)->misses);
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * Returns ``hits``, ``misses``, ``evictions``, ``entries``, ``bytes`` and
+ * ``max_bytes``.
+ */
+static VALUE
+cache_stats(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct cache *p = getcache(mrb, self);
+    VALUE hash = mrb_hash_new(mrb);
+
+#define STATS_SET(NAME, N)                                                      \
+    mrb_hash_set(mrb, hash, mrb_symbol_value(SYMBOL(NAME)), aux_uint64_value(mrb, (N)))
+
+    STATS_SET("hits", p->hits);
+    STATS_SET("misses", p->misses);
+    STATS_SET("evictions", p->evictions);
+    STATS_SET("entries", p->entries);
+    STATS_SET("bytes", p->bytes);
+    STATS_SET("max_bytes", p->max_bytes);
+
+#undef STATS_SET
+
+    return hash;
+}
+
+static void
+init_cache(MRB, struct RClass *mBrotli)
+{
+    struct RClass *cCache = mrb_define_class_under(mrb, mBrotli, "Cache", mrb_cObject);
+    mrb_define_class_method(mrb, cCache, "new", cache_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cCache, "initialize", cache_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cCache, "clear", cache_clear_m, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cCache, "size", cache_size, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cCache, "bytesize", cache_bytesize, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cCache, "max_bytes", cache_max_bytes, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cCache, "hits", cache_hits, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cCache, "misses", cache_misses, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cCache, "stats", cache_stats, MRB_ARGS_NONE());
+}
+
+/* class Brotli::Encoder */
+
+struct encoder_params
+{
+    int quality;
+    int lgwin;
+    int mode;
+    mrb_int size_hint;
+    mrb_bool large_window;
+    int lgblock;
+    int npostfix;
+    int ndirect;
+    mrb_bool disable_literal_context_modeling;
+    size_t stream_offset;
+    double skip_incompressible;     /* entropy threshold, or 0 if disabled */
+    struct dictionary *dict;
+};
+
+static void
+encoder_params_init(struct encoder_params *params)
+{
+    params->quality = BROTLI_DEFAULT_QUALITY;
+    params->lgwin = BROTLI_DEFAULT_WINDOW;
+    params->mode = BROTLI_DEFAULT_MODE;
+    params->size_hint = 0;
+    params->large_window = FALSE;
+    params->lgblock = 0;
+    params->npostfix = 0;
+    params->ndirect = 0;
+    params->disable_literal_context_modeling = FALSE;
+    params->stream_offset = 0;
+    params->skip_incompressible = 0;
+    params->dict = NULL;
+}
+
+/*
+ * Scans the tuning options shared by Brotli::Encoder.new and Brotli.encode.
+ */
+static void
+encoder_params_scan(MRB, struct encoder_params *params,
+                    VALUE quality, VALUE lgwin, VALUE mode, VALUE large_window,
+                    VALUE lgblock, VALUE npostfix, VALUE ndirect,
+                    VALUE disable_literal_context_modeling, VALUE stream_offset)
+{
+    params->large_window = RTEST(large_window);
+    params->quality = convert_to_quality(mrb, quality);
+    params->lgwin = convert_to_lgwin(mrb, lgwin, params->large_window);
+    params->mode = convert_to_mode(mrb, mode);
+    params->lgblock = convert_to_lgblock(mrb, lgblock);
+    params->npostfix = convert_to_npostfix(mrb, npostfix);
+    params->ndirect = convert_to_ndirect(mrb, ndirect, params->npostfix);
+    params->disable_literal_context_modeling = RTEST(disable_literal_context_modeling);
+    params->stream_offset = convert_to_stream_offset(mrb, stream_offset);
+}
+
+/*
+ * Sets the parameters except the dictionary. It can be called without mruby VM.
+ * Returns BROTLI_FALSE if libbrotli does not support the stream offset.
+ */
+static BROTLI_BOOL
+aux_encoder_set_params(BrotliEncoderState *brotli, const struct encoder_params *params)
+{
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_QUALITY, params->quality);
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_LGWIN, params->lgwin);
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_MODE, params->mode);
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_LARGE_WINDOW, (params->large_window ? BROTLI_TRUE : BROTLI_FALSE));
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_LGBLOCK, params->lgblock);
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_NPOSTFIX, params->npostfix);
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_NDIRECT, params->ndirect);
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_DISABLE_LITERAL_CONTEXT_MODELING,
+                              (params->disable_literal_context_modeling ? BROTLI_TRUE : BROTLI_FALSE));
+
+    if (params->size_hint > 0) {
+        BrotliEncoderSetParameter(brotli, BROTLI_PARAM_SIZE_HINT, (uint32_t)MIN(params->size_hint, (mrb_int)UINT32_MAX));
+    }
+
+    if (params->stream_offset > 0) {
+        return BrotliEncoderSetParameter(brotli, AUX_BROTLI_PARAM_STREAM_OFFSET, (uint32_t)params->stream_offset);
+    }
+
+    return BROTLI_TRUE;
+}
+
+/*
+ * Estimates the order-0 entropy (bits per byte) from evenly spaced blocks
+ * of the input. It can be called without mruby VM.
+ */
+static double
+aux_sample_entropy(const char *input, size_t insize)
+{
+    const size_t blocks = AUX_INCOMPRESSIBLE_SAMPLES;
+    const size_t blocksize = AUX_INCOMPRESSIBLE_SAMPLE_SIZE;
+    uint32_t hist[256] = { 0 };
+    size_t i, j, total = 0;
+
+    if (insize <= blocks * blocksize) {
+        for (i = 0; i < insize; i ++) { hist[(uint8_t)input[i]] ++; }
+        total = insize;
+    } else {
+        size_t stride = (insize - blocksize) / (blocks - 1);
+        for (i = 0; i < blocks; i ++) {
+            const uint8_t *p = (const uint8_t *)input + i * stride;
+            for (j = 0; j < blocksize; j ++) { hist[p[j]] ++; }
+        }
+        total = blocks * blocksize;
+    }
+
+    if (total == 0) { return 0; }
+
+    double sum = 0;
+    for (i = 0; i < 256; i ++) {
+        if (hist[i] > 0) { sum += hist[i] * log2((double)hist[i]); }
+    }
+
+    return log2((double)total) - sum / total;
+}
+
+static mrb_bool
+aux_is_incompressible(const struct encoder_params *params, const char *input, size_t insize)
+{
+    if (params->skip_incompressible <= 0 ||
+            params->quality <= BROTLI_MIN_QUALITY + 1 ||
+            insize < AUX_INCOMPRESSIBLE_MIN_INPUT) {
+        return FALSE;
+    }
+
+    return aux_sample_entropy(input, insize) >= params->skip_incompressible;
+}
+
+/*
+ * Lowers the quality of the state to BROTLI_MIN_QUALITY, which stores
+ * incompressible data as uncompressed meta-blocks almost at memcpy speed,
+ * if the input looks incompressible. It must be called before the first
+ * compression. It can be called without mruby VM.
+ */
+static mrb_bool
+aux_encoder_check_incompressible(BrotliEncoderState *brotli, const struct encoder_params *params,
+                                 const char *input, size_t insize)
+{
+    if (!aux_is_incompressible(params, input, insize)) {
+        return FALSE;
+    }
+
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_QUALITY, BROTLI_MIN_QUALITY);
+
+    return TRUE;
+}
+
+static void
+encoder_params_apply(MRB, BrotliEncoderState *brotli, const struct encoder_params *params)
+{
+    if (!aux_encoder_set_params(brotli, params)) {
+        mrb_raise(mrb, E_NOTIMP_ERROR, "stream_offset needs brotli-1.0.8 or later");
+    }
+
+    encoder_attach_dictionary(mrb, brotli, params->dict);
+}
+
+/*
+ * The controller of the adaptive quality. libbrotli fixes the quality when
+ * the stream begins, so a new quality takes effect at the next stream
+ * started by Brotli::Encoder#reset.
+ */
+struct aux_adapt
+{
+    double target_mbps;     /* 0 if disabled */
+    double max_latency_ms;  /* 0 if disabled */
+    int quality;            /* of the current stream */
+    uint64_t bytes;         /* compressed bytes since the last decision */
+    uint64_t nsec;          /* and the time spent for them */
+    uint64_t worst_nsec;    /* the slowest block since the last decision */
+};
+
+static int
+aux_clamp_quality(int quality)
+{
+    if (quality < BROTLI_MIN_QUALITY) {
+        return BROTLI_MIN_QUALITY;
+    } else if (quality > BROTLI_MAX_QUALITY) {
+        return BROTLI_MAX_QUALITY;
+    } else {
+        return quality;
+    }
+}
+
+static void
+aux_adapt_init(struct aux_adapt *a, double target_mbps, double max_latency_ms, int quality)
+{
+    a->target_mbps = target_mbps;
+    a->max_latency_ms = max_latency_ms;
+    a->quality = aux_clamp_quality(quality);
+    a->bytes = 0;
+    a->nsec = 0;
+    a->worst_nsec = 0;
+}
+
+static mrb_bool
+aux_adapt_enabled(const struct aux_adapt *a)
+{
+    return (a->target_mbps > 0 || a->max_latency_ms > 0);
+}
+
+static void
+aux_adapt_measure(struct aux_adapt *a, uint64_t bytes, uint64_t nsec)
+{
+    a->bytes += bytes;
+    a->nsec += nsec;
+    if (nsec > a->worst_nsec) {
+        a->worst_nsec = nsec;
+    }
+}
+
+/*
+ * Lowers the quality if any budget is exceeded, and raises it toward
+ * ``max_quality`` if every enabled budget has enough headroom.
+ * A budget going far over lowers the quality by two steps.
+ */
+static void
+aux_adapt_decide(struct aux_adapt *a, int max_quality)
+{
+    int down = 0;
+    mrb_bool up = TRUE;
+
+    if (a->max_latency_ms > 0) {
+        double ms = a->worst_nsec / 1e6;
+
+        if (a->worst_nsec == 0) {
+            up = FALSE;
+        } else if (ms > a->max_latency_ms) {
+            down = (ms > a->max_latency_ms * AUX_ADAPT_HEADROOM ? 2 : 1);
+        } else if (ms * AUX_ADAPT_HEADROOM > a->max_latency_ms) {
+            up = FALSE;
+        }
+
+        a->worst_nsec = 0;
+    }
+
+    if (a->target_mbps > 0) {
+        if (a->bytes < AUX_ADAPT_MIN_BYTES) {
+            up = FALSE; /* keeps measuring */
+        } else {
+            double mbps = (a->nsec > 0 ? a->bytes / (a->nsec / 1e9) / (1 << 20) : HUGE_VAL);
+
+            if (mbps < a->target_mbps) {
+                int d = (mbps * AUX_ADAPT_HEADROOM < a->target_mbps ? 2 : 1);
+                down = (d > down ? d : down);
+            } else if (mbps < a->target_mbps * AUX_ADAPT_HEADROOM) {
+                up = FALSE;
+            }
+
+            a->bytes = 0;
+            a->nsec = 0;
+        }
+    }
+
+    max_quality = aux_clamp_quality(max_quality);
+
+    if (down > 0) {
+        a->quality = aux_clamp_quality(a->quality - down);
+    } else if (up && a->quality < max_quality) {
+        a->quality ++;
+    }
+
+    if (a->quality > max_quality) {
+        a->quality = max_quality;
+    }
+}
+
+struct enc_async;
+
+struct encoder
+{
+    BrotliEncoderState *brotli;
+    struct memcap memory;
+    struct encoder_params params;
+    VALUE outport;
+    struct RString *outbuf;
+    struct {
+        char *ptr;
+        size_t len;
+        size_t capa;
+    } inbuf;
+    uint64_t total_in;
+    uint64_t total_out;
+    mrb_bool zerocopy;
+    int incompressible;     /* -1 if not decided yet */
+    mrb_bool failed;        /* an exception escaped while the stream is updated */
+    struct aux_adapt adapt;
+    mrb_bool async;
+    struct enc_async *worker;   /* NULL if not async, or after finished */
+};
+
+static void enc_async_stop(MRB, struct encoder *p);
+
+static void
+encoder_free(MRB, struct encoder *p)
+{
+    if (p->worker) {
+        enc_async_stop(mrb, p);
+    }
+
+    if (p->brotli) {
+        BrotliEncoderDestroyInstance(p->brotli);
+        p->brotli = NULL;
+    }
+
+    if (p->memory.pool) {
+        bufpool_unref(p->memory.pool);
+        p->memory.pool = NULL;
+    }
+
+    if (p->inbuf.ptr) {
+        mrb_free(mrb, p->inbuf.ptr);
+        p->inbuf.ptr = NULL;
+        p->inbuf.len = 0;
+    }
+
+    if (p) {
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type encoder_type = {
+    .struct_name = "encoder@mruby-brotli",
+    .dfree = (void (*)(mrb_state *, void *))encoder_free,
+};
+
+static struct encoder *
+getencoder(MRB, VALUE self)
+{
+    return (struct encoder *)mrbx_getref(mrb, self, &encoder_type);
+}
+
+static VALUE
+encoder_set_outport(MRB, VALUE self, struct encoder *p, VALUE port)
+{
+    mrb_iv_set(mrb, self, SYMBOL("outport@mruby-brotli"), port);
+    p->outport = port;
+
+    return port;
+}
+
+static struct RString *
+encoder_set_outbuf(MRB, VALUE obj, struct encoder *p, struct RString *buf)
+{
+    mrb_iv_set(mrb, obj, SYMBOL("outbuf@mruby-brotli"), (buf ? VALUE(buf) : Qnil));
+    p->outbuf = buf;
+
+    return buf;
+}
+
+/*
+ * The input coalescing buffer is never larger than the sliding window, nor
+ * than the whole input if the caller told about it by ``size_hint``.
+ */
+static size_t
+encoder_inbuf_size(int lgwin, mrb_int size_hint)
+{
+    size_t size = EXT_INBUF_SIZE;
+
+    if (lgwin < BROTLI_MIN_WINDOW_BITS) {
+        lgwin = BROTLI_MIN_WINDOW_BITS;
+    } else if (lgwin > BROTLI_LARGE_MAX_WINDOW_BITS) {
+        lgwin = BROTLI_LARGE_MAX_WINDOW_BITS;
+    }
+
+    size = MIN(size, (size_t)1 << lgwin);
+
+    if (size_hint > 0 && (uint64_t)size_hint < size) {
+        size = (size_t)size_hint;
+    }
+
+    return size;
+}
+
+/*
+ * The background thread of ``async: true``. While the worker compresses a
+ * block, the mruby thread fills the next block in ``inbuf``; the two
+ * buffers are swapped at the handoff. The output is accumulated by the
+ * worker, and written to the outport by the mruby thread on the next
+ * call of encode, flush or finish.
+ */
+#ifdef HAVE_THREAD
+struct aux_buffer
+{
+    char *ptr;
+    size_t len;
+    size_t capa;
+};
+
+struct enc_async
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    BrotliEncoderState *brotli;
+    char *work;                 /* the block given to the worker */
+    size_t worklen;
+    BrotliEncoderOperation op;
+    mrb_bool busy;              /* the worker has a block */
+    mrb_bool quit;
+    mrb_bool failed;
+    struct aux_buffer out;      /* appended by the worker */
+    struct aux_buffer spare;    /* swapped with ``out`` by the mruby thread */
+    uint64_t bytes;             /* the measurement since the last delivery */
+    uint64_t nsec;
+    uint64_t calls;
+};
+
+static mrb_bool
+aux_buffer_append(struct aux_buffer *buf, const void *ptr, size_t size)
+{
+    if (buf->len + size > buf->capa) {
+        size_t newcapa = (buf->capa > 0 ? buf->capa * 2 : (size_t)EXT_DEFAULT_OUTBUF_SIZE);
+        if (newcapa < buf->len + size) { newcapa = buf->len + size; }
+        char *p = (char *)realloc(buf->ptr, newcapa);
+        if (!p) { return FALSE; }
+        buf->ptr = p;
+        buf->capa = newcapa;
+    }
+
+    memcpy(buf->ptr + buf->len, ptr, size);
+    buf->len += size;
+
+    return TRUE;
+}
+
+/*
+ * Runs on a native thread without mruby VM.
+ */
+static void *
+enc_async_worker(void *user)
+{
+    struct enc_async *w = (struct enc_async *)user;
+
+    pthread_mutex_lock(&w->mutex);
+
+    for (;;) {
+        while (!w->busy && !w->quit) {
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+
+        if (!w->busy) { break; }
+
+        const uint8_t *next_in = (const uint8_t *)w->work;
+        size_t avail_in = w->worklen;
+        BrotliEncoderOperation op = w->op;
+        mrb_bool ok = !w->failed;
+        uint64_t calls = 0;
+
+        pthread_mutex_unlock(&w->mutex);
+
+        uint64_t t = aux_clock_nsec();
+
+        while (ok) {
+            size_t avail_out = 0;
+            calls ++;
+            if (!BrotliEncoderCompressStream(w->brotli, op, &avail_in, &next_in, &avail_out, NULL, NULL)) {
+                ok = FALSE;
+                break;
+            }
+
+            size_t size = 0;
+            const uint8_t *out = BrotliEncoderTakeOutput(w->brotli, &size);
+
+            if (size > 0) {
+                pthread_mutex_lock(&w->mutex);
+                ok = aux_buffer_append(&w->out, out, size);
+                pthread_mutex_unlock(&w->mutex);
+            }
+
+            if (avail_in == 0 && !BrotliEncoderHasMoreOutput(w->brotli)) {
+                break;
+            }
+        }
+
+        t = aux_clock_nsec() - t;
+
+        pthread_mutex_lock(&w->mutex);
+        w->bytes += w->worklen;
+        w->nsec += t;
+        w->calls += calls;
+        w->worklen = 0;
+        w->failed = !ok;
+        w->busy = FALSE;
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+
+    return NULL;
+}
+
+static void
+enc_async_start(MRB, struct encoder *p)
+{
+    struct enc_async *w = (struct enc_async *)mrb_calloc(mrb, 1, sizeof(struct enc_async));
+
+    w->brotli = p->brotli;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    if (pthread_create(&w->thread, NULL, enc_async_worker, w) != 0) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->mutex);
+        mrb_free(mrb, w);
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed pthread_create()");
+    }
+
+    p->worker = w;
+}
+
+/*
+ * Waits for the block in progress, and stops the worker.
+ */
+static void
+enc_async_stop(MRB, struct encoder *p)
+{
+    struct enc_async *w = p->worker;
+
+    pthread_mutex_lock(&w->mutex);
+    w->quit = TRUE;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    pthread_join(w->thread, NULL);
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+    free(w->out.ptr);
+    free(w->spare.ptr);
+    mrb_free(mrb, w->work);
+    mrb_free(mrb, w);
+    p->worker = NULL;
+}
+
+static void
+enc_async_wait(struct enc_async *w)
+{
+    pthread_mutex_lock(&w->mutex);
+    while (w->busy) {
+        pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+/*
+ * Writes the output accumulated by the worker to the outport without
+ * waiting for the worker.
+ */
+static void
+enc_async_deliver(MRB, VALUE self, struct encoder *p)
+{
+    struct enc_async *w = p->worker;
+
+    pthread_mutex_lock(&w->mutex);
+    struct aux_buffer out = w->out;
+    w->out = w->spare;
+    w->out.len = 0;
+    uint64_t bytes = w->bytes, nsec = w->nsec, calls = w->calls;
+    w->bytes = w->nsec = w->calls = 0;
+    mrb_bool failed = w->failed;
+    pthread_mutex_unlock(&w->mutex);
+
+    /* the worker does not touch ``spare`` */
+    w->spare = out;
+    w->spare.len = 0;
+
+    MEMCAP_STATS_ADD(&p->memory, stream_nsec, nsec);
+    MEMCAP_STATS_ADD(&p->memory, stream_calls, calls);
+    if (aux_adapt_enabled(&p->adapt) && p->incompressible != 1 && bytes > 0) {
+        aux_adapt_measure(&p->adapt, bytes, nsec);
+    }
+
+    if (out.len > 0) {
+        encoder_set_outbuf(mrb, self, p, mrbx_str_recycle(mrb, p->outbuf, out.len));
+        memcpy(RSTR_PTR(p->outbuf), out.ptr, out.len);
+        mrbx_str_set_len(mrb, p->outbuf, out.len);
+        p->total_out += out.len;
+        MEMCAP_STATS_ADD(&p->memory, port_calls, 1);
+        MEMCAP_STATS_ADD(&p->memory, port_bytes, out.len);
+        FUNCALL(mrb, p->outport, id_op_lsh, VALUE(p->outbuf));
+    }
+
+    if (failed) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "failed BrotliEncoderCompressStream - %S", self);
+    }
+}
+
+/*
+ * Hands ``inbuf`` to the worker after the previous block is done.
+ * Flushing and finishing wait for the block.
+ */
+static void
+enc_async_submit(MRB, VALUE self, struct encoder *p, BrotliEncoderOperation op)
+{
+    struct enc_async *w = p->worker;
+
+    enc_async_wait(w);
+    enc_async_deliver(mrb, self, p);
+
+    if (p->incompressible < 0 && p->inbuf.len > 0) {
+        /* the worker is idle and the stream is not started yet */
+        p->incompressible = aux_encoder_check_incompressible(p->brotli, &p->params, p->inbuf.ptr, p->inbuf.len);
+        if (p->incompressible) {
+            MEMCAP_STATS_ADD(&p->memory, incompressible, 1);
+        }
+    }
+
+    char *work = w->work;
+
+    pthread_mutex_lock(&w->mutex);
+    w->work = p->inbuf.ptr;
+    w->worklen = p->inbuf.len;
+    w->op = op;
+    w->busy = TRUE;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    p->inbuf.ptr = work;
+    p->inbuf.len = 0;
+
+    if (op != BROTLI_OPERATION_PROCESS) {
+        enc_async_wait(w);
+        enc_async_deliver(mrb, self, p);
+    }
+}
+
+static void
+enc_update_async(MRB, VALUE self, struct encoder *p,
+                 const char *next_in, size_t avail_in,
+                 BrotliEncoderOperation op)
+{
+    if (!p->worker) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "already finished - %S", self);
+    }
+
+    /* as enc_update(), a raised exception leaves the encoder failed */
+    p->failed = TRUE;
+
+    if (op == BROTLI_OPERATION_PROCESS) {
+        while (avail_in > 0) {
+            if (p->inbuf.ptr == NULL) {
+                p->inbuf.ptr = (char *)mrb_malloc(mrb, p->inbuf.capa);
+                MEMCAP_STATS_ADD(&p->memory, buffer_allocs, 1);
+            }
+
+            size_t n = MIN(avail_in, p->inbuf.capa - p->inbuf.len);
+            memcpy(p->inbuf.ptr + p->inbuf.len, next_in, n);
+            p->inbuf.len += n;
+            p->total_in += n;
+            next_in += n;
+            avail_in -= n;
+
+            if (p->inbuf.len >= p->inbuf.capa) {
+                enc_async_submit(mrb, self, p, BROTLI_OPERATION_PROCESS);
+            }
+        }
+
+        enc_async_deliver(mrb, self, p);
+    } else {
+        enc_async_submit(mrb, self, p, op);
+
+        if (op == BROTLI_OPERATION_FINISH) {
+            enc_async_stop(mrb, p);
+
+            if (p->inbuf.ptr) {
+                mrb_free(mrb, p->inbuf.ptr);
+                p->inbuf.ptr = NULL;
+            }
+        }
+    }
+
+    p->failed = FALSE;
+}
+#else
+static void
+enc_async_start(MRB, struct encoder *p)
+{
+}
+
+static void
+enc_async_stop(MRB, struct encoder *p)
+{
+}
+#endif
+
+/*
+ * The state of an async encoder is allocated by malloc(), since it is used
+ * on the worker thread.
+ */
+static BrotliEncoderState *
+encoder_create_state(MRB, struct encoder *p)
+{
+    if (p->async) {
+        return BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    } else {
+        return aux_encoder_create_counted(mrb, &p->memory);
+    }
+}
+
+/*
+ * call-seq:
+ *  new(outbuf) -> encoder object
+ *  new(outbuf, quality: nil, lgwin: nil, mode: nil, sizehint: nil, large_window: false,
+ *      lgblock: nil, npostfix: nil, ndirect: nil, disable_literal_context_modeling: false,
+ *      stream_offset: nil, skip_incompressible: false, zerocopy: false, allocator: nil,
+ *      target_mbps: nil, max_latency_ms: nil, async: false, dictionary: nil) -> encoder object
+ */
+static VALUE
+enc_s_new(MRB, VALUE self)
+{
+    struct RData *rd;
+    struct encoder *p;
+    Data_Make_Struct(mrb, mrb_class_ptr(self), struct encoder, &encoder_type, p, rd);
+
+    memcap_init(&p->memory, bufpool_ref(bufpool_get(mrb)), 0);
+    p->brotli = aux_encoder_create_counted(mrb, &p->memory);
+
+    if (!p->brotli) {
+        bufpool_unref(p->memory.pool);
+        mrb_free(mrb, rd->data);
+        rd->data = NULL;
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed allocation in BrotliEncoderCreateInstance()");
+    }
+
+    encoder_params_init(&p->params);
+    p->outport = Qnil;
+    p->outbuf = NULL;
+    p->total_in = 0;
+    p->total_out = 0;
+    p->zerocopy = FALSE;
+    p->incompressible = -1;
+    p->failed = FALSE;
+    aux_adapt_init(&p->adapt, 0, 0, BROTLI_DEFAULT_QUALITY);
+    p->async = FALSE;
+    p->worker = NULL;
+    p->inbuf.ptr = NULL;
+    p->inbuf.len = 0;
+    p->inbuf.capa = encoder_inbuf_size(BROTLI_DEFAULT_WINDOW, 0);
+
+    VALUE obj = VALUE(rd);
+
+    mrbx_funcall_passthrough(mrb, obj, id_initialize);
+
+    return obj;
+}
+
+static void
+enc_initialize_args(MRB, VALUE self, struct encoder **p, VALUE *outport)
+{
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "o|H", outport, &opts);
+
+    *p = getencoder(mrb, self);
+
+    if (!NIL_P(opts)) {
+        struct encoder_params *params = &(*p)->params;
+        VALUE quality, lgwin, mode, size_hint, large_window, lgblock, npostfix, ndirect, dlcm, stream_offset, skip, zerocopy, allocator, target_mbps, max_latency_ms, async, dictionary;
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("quality", &quality, Qnil),
+                MRBX_SCANHASH_ARGS("lgwin", &lgwin, Qnil),
+                MRBX_SCANHASH_ARGS("mode", &mode, Qnil),
+                MRBX_SCANHASH_ARGS("size_hint", &size_hint, Qnil),
+                MRBX_SCANHASH_ARGS("large_window", &large_window, Qfalse),
+                MRBX_SCANHASH_ARGS("lgblock", &lgblock, Qnil),
+                MRBX_SCANHASH_ARGS("npostfix", &npostfix, Qnil),
+                MRBX_SCANHASH_ARGS("ndirect", &ndirect, Qnil),
+                MRBX_SCANHASH_ARGS("disable_literal_context_modeling", &dlcm, Qfalse),
+                MRBX_SCANHASH_ARGS("stream_offset", &stream_offset, Qnil),
+                MRBX_SCANHASH_ARGS("skip_incompressible", &skip, Qfalse),
+                MRBX_SCANHASH_ARGS("zerocopy", &zerocopy, Qfalse),
+                MRBX_SCANHASH_ARGS("allocator", &allocator, Qnil),
+                MRBX_SCANHASH_ARGS("target_mbps", &target_mbps, Qnil),
+                MRBX_SCANHASH_ARGS("max_latency_ms", &max_latency_ms, Qnil),
+                MRBX_SCANHASH_ARGS("async", &async, Qfalse),
+                MRBX_SCANHASH_ARGS("dictionary", &dictionary, Qnil));
+
+        encoder_params_scan(mrb, params, quality, lgwin, mode, large_window,
+                            lgblock, npostfix, ndirect, dlcm, stream_offset);
+        params->size_hint = (NIL_P(size_hint) ? 0 : mrb_int(mrb, size_hint));
+        params->skip_incompressible = convert_to_skip_incompressible(mrb, skip);
+        params->dict = getdictionary_or_nil(mrb, dictionary);
+        mrb_iv_set(mrb, self, SYMBOL("dictionary@mruby-brotli"), dictionary);
+
+        (*p)->zerocopy = RTEST(zerocopy);
+        (*p)->memory.allocator = convert_to_allocator(mrb, allocator);
+        aux_adapt_init(&(*p)->adapt,
+                       convert_to_budget(mrb, target_mbps, "target_mbps"),
+                       convert_to_budget(mrb, max_latency_ms, "max_latency_ms"),
+                       params->quality);
+
+#ifdef HAVE_THREAD
+        if (RTEST(async) && (RTEST(zerocopy) || !NIL_P(allocator))) {
+            mrb_raise(mrb, E_ARGUMENT_ERROR,
+                      "async: true can not be used with zerocopy: or allocator:");
+        }
+
+        if (RTEST(async) && !(*p)->worker) {
+            BrotliEncoderState *brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+            if (!brotli) {
+                mrb_raise(mrb, E_RUNTIME_ERROR,
+                          "failed allocation in BrotliEncoderCreateInstance()");
+            }
+            BrotliEncoderDestroyInstance((*p)->brotli);
+            (*p)->brotli = brotli;
+            (*p)->async = TRUE;
+        }
+#else
+        (void)async;
+#endif
+    }
+
+    encoder_params_apply(mrb, (*p)->brotli, &(*p)->params);
+    (*p)->inbuf.capa = encoder_inbuf_size((*p)->params.lgwin, (*p)->params.size_hint);
+}
+
+static VALUE
+enc_initialize(MRB, VALUE self)
+{
+    struct encoder *p;
+    VALUE outport;
+    enc_initialize_args(mrb, self, &p, &outport);
+
+    encoder_set_outport(mrb, self, p, outport);
+    encoder_set_outbuf(mrb, self, p, NULL);
+
+    if (p->async && !p->worker) {
+        enc_async_start(mrb, p);
+    }
+
+    return self;
+}
+
+struct enc_zerocopy_port
+{
+    VALUE outport;
+    struct RString *view;
+};
+
+static VALUE
+enc_zerocopy_port_try(MRB, VALUE args)
+{
+    struct enc_zerocopy_port *argp = (struct enc_zerocopy_port *)mrb_cptr(args);
+
+    return FUNCALL(mrb, argp->outport, id_op_lsh, VALUE(argp->view));
+}
+
+static VALUE
+enc_zerocopy_port_cleanup(MRB, VALUE args)
+{
+    struct enc_zerocopy_port *argp = (struct enc_zerocopy_port *)mrb_cptr(args);
+
+    aux_str_unbind_view(mrb, argp->view);
+
+    return Qnil;
+}
+
+/*
+ * Hands the internal output storage of libbrotli to the outport as is.
+ * The string object given to ``outport << str`` is a frozen
+ * Brotli::BufferView, and it becomes empty after the method returns or raises;
+ * it must not escape the method.
+ */
+static void
+enc_update_stream_zerocopy(MRB, VALUE self, struct encoder *p,
+                           const char *next_in, size_t avail_in,
+                           BrotliEncoderOperation op)
+{
+    mrb_bool took;
+
+    do {
+        size_t avail_out = 0;
+        BROTLI_BOOL ok = memcap_compress_stream(&p->memory, p->brotli, op,
+                                                &avail_in, (const uint8_t **)&next_in,
+                                                &avail_out, NULL, &p->total_out);
+
+        if (!ok) {
+            mrb_raisef(mrb, E_RUNTIME_ERROR,
+                       "failed BrotliEncoderCompressStream - %S", self);
+        }
+
+        took = FALSE;
+        while (BrotliEncoderHasMoreOutput(p->brotli)) {
+            size_t size = 0;
+            const uint8_t *out = BrotliEncoderTakeOutput(p->brotli, &size);
+
+            if (size > 0) {
+                int ai = mrb_gc_arena_save(mrb);
+                struct enc_zerocopy_port args = { p->outport, aux_str_new_view(mrb, out, size) };
+                MEMCAP_STATS_ADD(&p->memory, port_calls, 1);
+                MEMCAP_STATS_ADD(&p->memory, port_bytes, size);
+                mrb_ensure(mrb,
+                           enc_zerocopy_port_try, mrb_cptr_value(mrb, &args),
+                           enc_zerocopy_port_cleanup, mrb_cptr_value(mrb, &args));
+                mrb_gc_arena_restore(mrb, ai);
+                took = TRUE;
+            }
+        }
+    } while (avail_in > 0 || took);
+}
+
+static void
+enc_update_stream_body(MRB, VALUE self, struct encoder *p,
+                       const char *next_in, size_t avail_in,
+                       BrotliEncoderOperation op)
+{
+    if (p->zerocopy) {
+        enc_update_stream_zerocopy(mrb, self, p, next_in, avail_in, op);
+        return;
+    }
+
+    for (;;) {
+        struct RString *outbuf0 = p->outbuf;
+        const char *outptr0 = (outbuf0 ? RSTR_PTR(outbuf0) : NULL);
+        encoder_set_outbuf(mrb, self, p, mrbx_str_recycle(mrb, p->outbuf, EXT_DEFAULT_OUTBUF_SIZE));
+        mrbx_str_set_len(mrb, p->outbuf, 0);
+
+        if (p->outbuf != outbuf0 || RSTR_PTR(p->outbuf) != outptr0) {
+            MEMCAP_STATS_ADD(&p->memory, buffer_allocs, 1);
+        }
+
+        char *next_out = RSTR_PTR(p->outbuf);
+        size_t avail_out = RSTR_CAPA(p->outbuf);
+
+        BROTLI_BOOL ok = memcap_compress_stream(&p->memory, p->brotli, op,
+                                                &avail_in, (const uint8_t **)&next_in,
+                                                &avail_out, (uint8_t **)&next_out, &p->total_out);
+
+        if (!ok) {
+            mrb_raisef(mrb, E_RUNTIME_ERROR,
+                       "failed BrotliEncoderCompressStream - %S", self);
+        }
+
+        size_t size = next_out - RSTR_PTR(p->outbuf);
+
+        mrbx_str_set_len(mrb, p->outbuf, size);
+
+        if (size > 0) {
+            MEMCAP_STATS_ADD(&p->memory, port_calls, 1);
+            MEMCAP_STATS_ADD(&p->memory, port_bytes, size);
+            FUNCALL(mrb, p->outport, id_op_lsh, VALUE(p->outbuf));
+        }
+
+        if (avail_in > 0 || BrotliEncoderHasMoreOutput(p->brotli)) {
+            continue;
+        } else {
+            break;
+        }
+    }
+}
+
+static void
+enc_update_stream(MRB, VALUE self, struct encoder *p,
+           const char *next_in, size_t avail_in,
+           BrotliEncoderOperation op)
+{
+    if (p->incompressible < 0) {
+        /* decided by the first block, since the quality is fixed after that */
+        p->incompressible = aux_encoder_check_incompressible(p->brotli, &p->params, next_in, avail_in);
+        if (p->incompressible) {
+            MEMCAP_STATS_ADD(&p->memory, incompressible, 1);
+        }
+    }
+
+    if (aux_adapt_enabled(&p->adapt) && p->incompressible != 1) {
+        /* the incompressible input at the lowest quality tells nothing */
+        uint64_t nsec0 = p->memory.stats.stream_nsec;
+        size_t insize = avail_in;
+        enc_update_stream_body(mrb, self, p, next_in, avail_in, op);
+        aux_adapt_measure(&p->adapt, insize, p->memory.stats.stream_nsec - nsec0);
+    } else {
+        enc_update_stream_body(mrb, self, p, next_in, avail_in, op);
+    }
+}
+
+/*
+ * Small inputs are coalesced into ``inbuf`` and given to
+ * BrotliEncoderCompressStream() together, and large inputs are given directly.
+ * The buffer is allocated on first use.
+ *
+ * If an exception escapes (e.g. from ``outport << buf``), it is unknown how
+ * much of the input was consumed, so the encoder refuses further updates
+ * until #reset.
+ */
+static void
+enc_update(MRB, VALUE self, struct encoder *p,
+           const char *next_in, size_t avail_in,
+           BrotliEncoderOperation op)
+{
+    if (p->failed) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "encoder is failed by a previous exception (need reset) - %S", self);
+    }
+
+#ifdef HAVE_THREAD
+    if (p->async) {
+        enc_update_async(mrb, self, p, next_in, avail_in, op);
+        return;
+    }
+#endif
+
+    if (op == BROTLI_OPERATION_PROCESS) {
+        if (avail_in == 0) {
+            return;
+        }
+
+        p->failed = TRUE;
+
+        if (avail_in >= p->inbuf.capa - p->inbuf.len && p->inbuf.len > 0) {
+            enc_update_stream(mrb, self, p, p->inbuf.ptr, p->inbuf.len, BROTLI_OPERATION_PROCESS);
+            p->inbuf.len = 0;
+        }
+
+        if (avail_in < p->inbuf.capa - p->inbuf.len) {
+            if (p->inbuf.ptr == NULL) {
+                p->inbuf.ptr = (char *)mrb_malloc(mrb, p->inbuf.capa);
+                MEMCAP_STATS_ADD(&p->memory, buffer_allocs, 1);
+            }
+
+            memcpy(p->inbuf.ptr + p->inbuf.len, next_in, avail_in);
+            p->inbuf.len += avail_in;
+        } else {
+            enc_update_stream(mrb, self, p, next_in, avail_in, BROTLI_OPERATION_PROCESS);
+        }
+
+        p->total_in += avail_in;
+        p->failed = FALSE;
+    } else {
+        p->failed = TRUE;
+        enc_update_stream(mrb, self, p, p->inbuf.ptr, p->inbuf.len, op);
+        p->inbuf.len = 0;
+        p->failed = FALSE;
+
+        if (op == BROTLI_OPERATION_FINISH && p->inbuf.ptr) {
+            mrb_free(mrb, p->inbuf.ptr);
+            p->inbuf.ptr = NULL;
+        }
+    }
+}
+
+/*
+ * call-seq:
+ *  encode(src) -> self
+ */
+static VALUE
+enc_encode(MRB, VALUE self)
+{
+    VALUE src;
+    mrb_get_args(mrb, "S", &src);
+
+    enc_update(mrb, self, getencoder(mrb, self),
+               RSTRING_PTR(src), RSTRING_LEN(src),
+               BROTLI_OPERATION_PROCESS);
+
+    return self;
+}
+
+static VALUE
+enc_flush(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct encoder *p = getencoder(mrb, self);
+
+    enc_update(mrb, self, p, NULL, 0, BROTLI_OPERATION_FLUSH);
+
+    return self;
+}
+
+static VALUE
+enc_finish(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    enc_update(mrb, self, getencoder(mrb, self), NULL, 0, BROTLI_OPERATION_FINISH);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  reset(outport = nil) -> self
+ *
+ * Discards the current stream and starts a new stream with the same
+ * parameters. If ``outport`` is given, the output is written to it.
+ *
+ * With ``target_mbps`` or ``max_latency_ms``, the quality of the new stream
+ * is adjusted by the measurement of the previous streams.
+ */
+static VALUE
+enc_reset(MRB, VALUE self)
+{
+    VALUE outport = Qnil;
+    mrb_get_args(mrb, "|o", &outport);
+
+    struct encoder *p = getencoder(mrb, self);
+    BrotliEncoderState *brotli = encoder_create_state(mrb, p);
+
+    if (!brotli) {
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed allocation in BrotliEncoderCreateInstance()");
+    }
+
+    if (p->worker) {
+        /*
+         * waits until the worker finishes compressing the block in progress,
+         * and its output is dropped with the old stream without delivery
+         */
+        enc_async_stop(mrb, p);
+    }
+
+    BrotliEncoderDestroyInstance(p->brotli);
+    p->brotli = brotli;
+
+    encoder_params_apply(mrb, p->brotli, &p->params);
+    if (aux_adapt_enabled(&p->adapt)) {
+        aux_adapt_decide(&p->adapt, p->params.quality);
+        BrotliEncoderSetParameter(p->brotli, BROTLI_PARAM_QUALITY, p->adapt.quality);
+    }
+    p->inbuf.len = 0;
+    p->total_in = 0;
+    p->total_out = 0;
+    p->incompressible = -1;
+    p->failed = FALSE;
+
+    if (!NIL_P(outport)) {
+        encoder_set_outport(mrb, self, p, outport);
+    }
+
+    if (p->async) {
+        enc_async_start(mrb, p);
+    }
+
+    return self;
+}
+
+static VALUE
+enc_is_finished(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct encoder *p = getencoder(mrb, self);
+
+    if (p->worker) {
+        /* the state belongs to the worker until finished */
+        return Qfalse;
+    }
+
+    return (BrotliEncoderIsFinished(p->brotli) == BROTLI_FALSE ? Qfalse : Qtrue);
+}
+
+static VALUE
+enc_total_in(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct encoder *p = getencoder(mrb, self);
+
+    if (p->total_in > MRB_INT_MAX) {
+        return mrb_float_value(mrb, p->total_in);
+    } else {
+        return mrb_fixnum_value(p->total_in);
+    }
+}
+
+static VALUE
+enc_total_out(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct encoder *p = getencoder(mrb, self);
+
+    if (p->total_out > MRB_INT_MAX) {
+        return mrb_float_value(mrb, p->total_out);
+    } else {
+        return mrb_fixnum_value(p->total_out);
+    }
+}
+
+/*
+ * call-seq:
+ *  quality -> integer
+ *
+ * Returns the quality of the current stream.
+ * It is lower than the given ``quality`` when it is adjusted by
+ * ``target_mbps``, ``max_latency_ms`` or ``skip_incompressible``.
+ */
+static VALUE
+enc_quality(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct encoder *p = getencoder(mrb, self);
+
+    if (p->incompressible > 0) {
+        return mrb_fixnum_value(BROTLI_MIN_QUALITY);
+    } else if (aux_adapt_enabled(&p->adapt)) {
+        return mrb_fixnum_value(p->adapt.quality);
+    } else {
+        return mrb_fixnum_value(aux_clamp_quality(p->params.quality));
+    }
+}
+
+/*
+ * call-seq:
+ *  incompressible? -> true, false or nil
+ *
+ * Returns true if the stream is compressed at the lowest quality by
+ * ``skip_incompressible``, or nil if it is disabled or not decided yet.
+ */
+static VALUE
+enc_is_incompressible(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct encoder *p = getencoder(mrb, self);
+
+    if (p->params.skip_incompressible <= 0 || p->incompressible < 0) {
+        return Qnil;
+    }
+
+    return (p->incompressible ? Qtrue : Qfalse);
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * Returns the instrumentation counters of the encoder.
+ */
+static VALUE
+enc_stats(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return memcap_stats(mrb, &getencoder(mrb, self)->memory);
+}
+
+/*
+ * ``cache`` is NULL if the caller does not take the ``cache`` option.
+ */
+static void
+enc_s_encode_scan_opts(MRB, VALUE opts, struct encoder_params *params, int *threads, VALUE *cache)
+{
+    VALUE quality_v, lgwin_v, mode_v, large_window_v, lgblock_v, npostfix_v, ndirect_v, dlcm_v, stream_offset_v, skip_v, dict_v, threads_v, cache_v;
+
+    MRBX_SCANHASH(mrb, opts, Qnil,
+            MRBX_SCANHASH_ARGS("quality", &quality_v, Qnil),
+            MRBX_SCANHASH_ARGS("lgwin", &lgwin_v, Qnil),
+            MRBX_SCANHASH_ARGS("mode", &mode_v, Qnil),
+            MRBX_SCANHASH_ARGS("large_window", &large_window_v, Qfalse),
+            MRBX_SCANHASH_ARGS("lgblock", &lgblock_v, Qnil),
+            MRBX_SCANHASH_ARGS("npostfix", &npostfix_v, Qnil),
+            MRBX_SCANHASH_ARGS("ndirect", &ndirect_v, Qnil),
+            MRBX_SCANHASH_ARGS("disable_literal_context_modeling", &dlcm_v, Qfalse),
+            MRBX_SCANHASH_ARGS("stream_offset", &stream_offset_v, Qnil),
+            MRBX_SCANHASH_ARGS("skip_incompressible", &skip_v, Qfalse),
+            MRBX_SCANHASH_ARGS("dictionary", &dict_v, Qnil),
+            MRBX_SCANHASH_ARGS("threads", &threads_v, Qnil),
+            MRBX_SCANHASH_ARGS("cache", &cache_v, Qnil));
+
+    if (cache) {
+        getcache_or_nil(mrb, cache_v);
+        *cache = cache_v;
+    } else if (!NIL_P(cache_v)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "cache is only for one-shot compression of Brotli.encode");
+    }
+
+    encoder_params_scan(mrb, params, quality_v, lgwin_v, mode_v, large_window_v,
+                        lgblock_v, npostfix_v, ndirect_v, dlcm_v, stream_offset_v);
+    params->skip_incompressible = convert_to_skip_incompressible(mrb, skip_v);
+    params->dict = getdictionary_or_nil(mrb, dict_v);
+    *threads = convert_to_threads(mrb, threads_v);
+}
+
+static void
+enc_s_encode_args(MRB, VALUE self, const char **input, size_t *insize, struct RString **output, size_t *outsize, struct encoder_params *params, int *threads, VALUE *cache)
+{
+    VALUE *argv = NULL;
+    mrb_int argc = 0;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    encoder_params_init(params);
+    *threads = 1;
+    *cache = Qnil;
+
+    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+        enc_s_encode_scan_opts(mrb, argv[argc - 1], params, threads, cache);
+
+        argc --;
+    }
+
+    switch (argc) {
+    case 1:
+        *outsize = -1;
+        *output = NULL;
+        break;
+    case 2:
+        if (mrb_string_p(argv[1])) {
+            *outsize = -1;
+            *output = RString(argv[1]);
+        } else {
+            *outsize = convert_to_size_t(mrb, argv[1]);
+            *output = NULL;
+        }
+        break;
+    case 3:
+        *outsize = convert_to_size_t(mrb, argv[1]);
+        *output = RString(argv[2]);
+        break;
+    default:
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong number arguments (given %S, expect 1 .. 2 + keywords)",
+                   VALUE(argc));
+    }
+
+    aux_get_input(mrb, argv[0], input, insize);
+    params->size_hint = *insize;
+
+    if ((ssize_t)*outsize < 0) {
+        *outsize = BrotliEncoderMaxCompressedSize(*insize);
+    }
+}
+
+struct enc_s_encode_stream
+{
+    BrotliEncoderState *brotli;
+    struct bufpool *pool;
+    const struct encoder_params *params;
+    const char *input;
+    size_t insize;
+    char *output;
+    size_t outsize;
+    BROTLI_BOOL finished;
+};
+
+static VALUE
+enc_s_encode_stream_try(MRB, VALUE args)
+{
+    struct enc_s_encode_stream *argp = (struct enc_s_encode_stream *)mrb_cptr(args);
+
+    encoder_params_apply(mrb, argp->brotli, argp->params);
+
+    const char *next_in = argp->input;
+    size_t avail_in = argp->insize;
+    char *next_out = argp->output;
+    size_t avail_out = argp->outsize;
+
+    BROTLI_BOOL ok = BrotliEncoderCompressStream(argp->brotli, BROTLI_OPERATION_FINISH,
+                                                 &avail_in, (const uint8_t **)&next_in,
+                                                 &avail_out, (uint8_t **)&next_out, NULL);
+
+    argp->finished = ok && BrotliEncoderIsFinished(argp->brotli);
+    argp->outsize -= avail_out;
+
+    return Qnil;
+}
+
+static VALUE
+enc_s_encode_stream_cleanup(MRB, VALUE args)
+{
+    struct enc_s_encode_stream *argp = (struct enc_s_encode_stream *)mrb_cptr(args);
+
+    BrotliEncoderDestroyInstance(argp->brotli);
+    bufpool_unref(argp->pool);
+
+    return Qnil;
+}
+
+/*
+ * Compresses with an encoder state drawn from the memory pool.
+ * Returns BROTLI_FALSE if the output buffer is too small.
+ */
+static BROTLI_BOOL
+enc_s_encode_stream(MRB, const struct encoder_params *params, const char *input, size_t insize, char *output, size_t *outsize)
+{
+    struct bufpool *pool = bufpool_get(mrb);
+    struct enc_s_encode_stream args = {
+        aux_encoder_create_instance(mrb, pool),
+        bufpool_ref(pool),
+        params,
+        input,
+        insize,
+        output,
+        *outsize,
+        BROTLI_FALSE,
+    };
+
+    if (!args.brotli) {
+        bufpool_unref(pool);
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed BrotliEncoderCreateInstance (may be out of memory)");
+    }
+
+    mrb_ensure(mrb,
+               enc_s_encode_stream_try, mrb_cptr_value(mrb, &args),
+               enc_s_encode_stream_cleanup, mrb_cptr_value(mrb, &args));
+
+    *outsize = args.outsize;
+
+    return args.finished;
+}
+
+#ifdef HAVE_THREAD
+struct enc_s_encode_chunk
+{
+    const struct encoder_params *params;
+    const char *input;
+    size_t insize;
+    size_t offset;
+    BrotliEncoderOperation op;
+    pthread_t thread;
+    mrb_bool running;
+    char *output;
+    size_t outsize;
+    BROTLI_BOOL ok;
+};
+
+/*
+ * Runs on a native thread without mruby VM; the memory is given by malloc().
+ */
+static void *
+enc_s_encode_chunk(void *user)
+{
+    struct enc_s_encode_chunk *c = (struct enc_s_encode_chunk *)user;
+    BrotliEncoderState *brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+
+    c->ok = BROTLI_FALSE;
+    if (!brotli) { return NULL; }
+
+    size_t offset = c->params->stream_offset + c->offset;
+
+    if (!aux_encoder_set_params(brotli, c->params) ||
+            (offset > 0 &&
+             !BrotliEncoderSetParameter(brotli, AUX_BROTLI_PARAM_STREAM_OFFSET,
+                                        (uint32_t)MIN(offset, AUX_BROTLI_MAX_STREAM_OFFSET)))) {
+        BrotliEncoderDestroyInstance(brotli);
+        return NULL;
+    }
+
+    BrotliEncoderSetParameter(brotli, BROTLI_PARAM_SIZE_HINT, (uint32_t)MIN(c->insize, UINT32_MAX));
+    aux_encoder_check_incompressible(brotli, c->params, c->input, c->insize);
+
+    const uint8_t *next_in = (const uint8_t *)c->input;
+    size_t avail_in = c->insize;
+    size_t capa = 0;
+
+    for (;;) {
+        size_t avail_out = 0;
+        if (!BrotliEncoderCompressStream(brotli, c->op, &avail_in, &next_in, &avail_out, NULL, NULL)) {
+            break;
+        }
+
+        if (!BrotliEncoderHasMoreOutput(brotli)) {
+            if (avail_in > 0) { continue; }
+            c->ok = BROTLI_TRUE;
+            break;
+        }
+
+        size_t size = 0;
+        const uint8_t *out = BrotliEncoderTakeOutput(brotli, &size);
+
+        if (c->outsize + size > capa) {
+            size_t newcapa = (capa > 0 ? capa * 2 : MIN(c->insize, (size_t)EXT_DEFAULT_OUTBUF_SIZE) + size);
+            if (newcapa < c->outsize + size) { newcapa = c->outsize + size; }
+            char *p = (char *)realloc(c->output, newcapa);
+            if (!p) { break; }
+            c->output = p;
+            capa = newcapa;
+        }
+
+        memcpy(c->output + c->outsize, out, size);
+        c->outsize += size;
+    }
+
+    BrotliEncoderDestroyInstance(brotli);
+
+    return NULL;
+}
+
+static BROTLI_BOOL
+aux_encoder_support_stream_offset(void)
+{
+    BrotliEncoderState *brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (!brotli) { return BROTLI_FALSE; }
+    BROTLI_BOOL ok = BrotliEncoderSetParameter(brotli, AUX_BROTLI_PARAM_STREAM_OFFSET, 1);
+    BrotliEncoderDestroyInstance(brotli);
+
+    return ok;
+}
+
+/*
+ * Splits the input into chunks, compresses them on native threads and
+ * joins them into one brotli stream. Every chunk except the last is flushed,
+ * and the following chunk is compressed with BROTLI_PARAM_STREAM_OFFSET so
+ * that it continues the stream without the stream header.
+ *
+ * Returns BROTLI_FALSE if the input is too small to split, if libbrotli
+ * does not support the stream offset, or if something went wrong.
+ */
+static BROTLI_BOOL
+enc_s_encode_parallel(MRB, const struct encoder_params *params, int threads, const char *input, size_t insize, char *output, size_t *outsize)
+{
+    if (threads < 2 || params->dict) { return BROTLI_FALSE; }
+
+    size_t nchunk = MIN((size_t)threads, insize / EXT_PARALLEL_MIN_CHUNK);
+    if (nchunk < 2 || !aux_encoder_support_stream_offset()) { return BROTLI_FALSE; }
+
+    struct enc_s_encode_chunk *chunks = (struct enc_s_encode_chunk *)mrb_calloc(mrb, nchunk, sizeof(struct enc_s_encode_chunk));
+    size_t chunksize = insize / nchunk;
+    size_t i;
+
+    for (i = 0; i < nchunk; i ++) {
+        struct enc_s_encode_chunk *c = &chunks[i];
+        c->params = params;
+        c->offset = chunksize * i;
+        c->input = input + c->offset;
+        c->insize = (i + 1 < nchunk ? chunksize : insize - c->offset);
+        c->op = (i + 1 < nchunk ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_FINISH);
+    }
+
+    for (i = 1; i < nchunk; i ++) {
+        chunks[i].running = (pthread_create(&chunks[i].thread, NULL, enc_s_encode_chunk, &chunks[i]) == 0);
+    }
+
+    for (i = 0; i < nchunk; i ++) {
+        if (chunks[i].running) {
+            pthread_join(chunks[i].thread, NULL);
+        } else {
+            enc_s_encode_chunk(&chunks[i]);
+        }
+    }
+
+    BROTLI_BOOL ok = BROTLI_TRUE;
+    size_t total = 0;
+
+    for (i = 0; i < nchunk; i ++) {
+        if (!chunks[i].ok || chunks[i].outsize > *outsize - total) {
+            ok = BROTLI_FALSE;
+        } else {
+            memcpy(output + total, chunks[i].output, chunks[i].outsize);
+            total += chunks[i].outsize;
+        }
+
+        free(chunks[i].output);
+    }
+
+    mrb_free(mrb, chunks);
+
+    if (ok) {
+        *outsize = total;
+    }
+
+    return ok;
+}
+#else
+static BROTLI_BOOL
+enc_s_encode_parallel(MRB, const struct encoder_params *params, int threads, const char *input, size_t insize, char *output, size_t *outsize)
+{
+    return BROTLI_FALSE;
+}
+#endif
+
+/*
+ * call-seq:
+ *  encode(input, outsize = nil, output = nil, **opts) -> output
+ *  encode(input, output, **opts) -> output
+ *
+ * [input]
+ * [output = nil]
+ * [outsize = nil]
+ * [opts]
+ *  quality = nil::
+ *  lgwin = nil::
+ *  mode = nil::
+ *  large_window = false::
+ *  lgblock = nil::
+ *  npostfix = nil::
+ *  ndirect = nil::
+ *  disable_literal_context_modeling = false::
+ *  stream_offset = nil::
+ *  skip_incompressible = false::
+ *   If true (or a threshold in bits per byte), samples the input and
+ *   compresses it at the lowest quality when it looks incompressible.
+ *  dictionary = nil::
+ *  threads = nil::
+ *   Compresses the input by splitting into chunks on native threads.
+ *   The chunks are compressed independently, so the ratio drops a little.
+ *  cache = nil::
+ *   A Brotli::Cache. The stored output is returned for the same input and
+ *   options, without compression.
+ */
+static VALUE
+enc_s_encode(MRB, VALUE self)
+{
+    const char *input;
+    struct RString *output;
+    size_t insize, outsize;
+    struct encoder_params params;
+    int threads;
+    VALUE cache_v;
+    enc_s_encode_args(mrb, self, &input, &insize, &output, &outsize, &params, &threads, &cache_v);
+
+    /* the outputs with a dictionary depend on its content, so they are not cached */
+    struct cache *cache = (params.dict ? NULL : getcache_or_nil(mrb, cache_v));
+    struct cache_key key;
+    uint64_t hash = 0;
+
+    if (cache) {
+        memset(&key, 0, sizeof(key));
+        key.quality = params.quality;
+        key.lgwin = params.lgwin;
+        key.mode = params.mode;
+        key.lgblock = params.lgblock;
+        key.npostfix = params.npostfix;
+        key.ndirect = params.ndirect;
+        key.threads = threads;
+        key.large_window = params.large_window;
+        key.disable_literal_context_modeling = params.disable_literal_context_modeling;
+        key.stream_offset = params.stream_offset;
+        key.skip_incompressible = params.skip_incompressible;
+        hash = cache_hash(&key, input, insize);
+
+        const struct cache_entry *e = cache_lookup(cache, hash, &key, input, insize);
+        if (e) {
+            if (e->outsize <= outsize) {
+                output = mrbx_str_force_recycle(mrb, output, e->outsize);
+                memcpy(RSTR_PTR(output), e->data + e->insize, e->outsize);
+                mrbx_str_set_len(mrb, output, e->outsize);
+
+                return VALUE(output);
+            }
+
+            /* the stored output does not fit in outsize; it is kept as is */
+            cache = NULL;
+        }
+    }
+
+    output = mrbx_str_force_recycle(mrb, output, outsize);
+    mrbx_str_set_len(mrb, output, 0);
+
+    if (aux_is_incompressible(&params, input, insize)) {
+        params.quality = BROTLI_MIN_QUALITY;
+        bufpool_get(mrb)->stats.incompressible ++;
+    }
+    params.skip_incompressible = 0; /* decided for the whole input */
+
+    size_t size = outsize;
+    BROTLI_BOOL ok = enc_s_encode_parallel(mrb, &params, threads, input, insize, RSTR_PTR(output), &size);
+
+    if (!ok) {
+        size = outsize;
+        ok = enc_s_encode_stream(mrb, &params, input, insize, RSTR_PTR(output), &size);
+    }
+
+    if (!ok && !params.dict && params.stream_offset == 0) {
+        /*
+         * BrotliEncoderCompress() falls back to an uncompressed stream.
+         * It takes a large window when lgwin is over BROTLI_MAX_WINDOW_BITS.
+         * It always writes the stream header, so it is not used with stream_offset.
+         */
+        size = outsize;
+        ok = BrotliEncoderCompress(
+                params.quality, (params.large_window ? params.lgwin : MIN(params.lgwin, BROTLI_MAX_WINDOW_BITS)), params.mode,
+                insize, (const uint8_t *)input,
+                &size, (uint8_t *)RSTR_PTR(output));
+    }
+
+    if (!ok) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed BrotliEncoderCompress");
+    }
+
+    mrbx_str_set_len(mrb, output, size);
+
+    if (cache) {
+        cache_insert(mrb, cache, hash, &key, input, insize, RSTR_PTR(output), size);
+    }
+
+    return VALUE(output);
+}
+
+static VALUE
+enc_s_encode_batch_item(MRB, const struct encoder_params *params, struct RString *input)
+{
+    struct encoder_params p = *params;
+    size_t insize = RSTR_LEN(input);
+    size_t outsize = BrotliEncoderMaxCompressedSize(insize);
+    if (outsize == 0) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "input is too big");
+    }
+
+    VALUE output = mrb_str_new_capa(mrb, outsize);
+    p.size_hint = insize;
+
+    if (aux_is_incompressible(&p, RSTR_PTR(input), insize)) {
+        p.quality = BROTLI_MIN_QUALITY;
+        bufpool_get(mrb)->stats.incompressible ++;
+    }
+
+    if (!enc_s_encode_stream(mrb, &p, RSTR_PTR(input), insize, RSTRING_PTR(output), &outsize)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed BrotliEncoderCompress");
+    }
+
+    /* shrink the capacity, as the batch is for many small strings */
+    mrb_str_resize(mrb, output, (mrb_int)outsize);
+
+    return output;
+}
+
+#ifdef HAVE_THREAD
+static void
+enc_s_encode_batch_parallel(MRB, VALUE results, const struct encoder_params *params, int threads, VALUE inputs, mrb_int num)
+{
+    struct enc_s_encode_chunk *items = (struct enc_s_encode_chunk *)mrb_calloc(mrb, num, sizeof(struct enc_s_encode_chunk));
+    mrb_int i;
+
+    for (i = 0; i < num; i ++) {
+        struct RString *input = RSTRING(mrb_ary_ref(mrb, inputs, i));
+        items[i].params = params;
+        items[i].input = RSTR_PTR(input);
+        items[i].insize = RSTR_LEN(input);
+        items[i].op = BROTLI_OPERATION_FINISH;
+    }
+
+    aux_batch_run(enc_s_encode_chunk, items, sizeof(struct enc_s_encode_chunk), num, threads);
+
+    mrb_bool ok = TRUE;
+    int ai = mrb_gc_arena_save(mrb);
+    for (i = 0; i < num; i ++) {
+        if (ok && items[i].ok) {
+            mrb_ary_push(mrb, results, mrb_str_new(mrb, items[i].output, items[i].outsize));
+            mrb_gc_arena_restore(mrb, ai);
+        } else {
+            ok = FALSE;
+        }
+
+        free(items[i].output);
+    }
+
+    mrb_free(mrb, items);
+
+    if (!ok) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed BrotliEncoderCompress");
+    }
+}
+#endif
+
+/*
+ * call-seq:
+ *  encode_batch(inputs, **opts) -> array of outputs
+ *
+ * Compresses each string in ``inputs`` with the same options as
+ * Brotli.encode, parsing them only once.
+ * If ``threads`` is 2 or more, the strings are spread over native threads.
+ */
+static VALUE
+enc_s_encode_batch(MRB, VALUE self)
+{
+    VALUE inputs, opts = Qnil;
+    mrb_get_args(mrb, "A|H", &inputs, &opts);
+
+    struct encoder_params params;
+    int threads = 1;
+    encoder_params_init(&params);
+    if (!NIL_P(opts)) {
+        enc_s_encode_scan_opts(mrb, opts, &params, &threads, NULL);
+    }
+
+    mrb_int num = RARRAY_LEN(inputs);
+    mrb_int i;
+    for (i = 0; i < num; i ++) {
+        mrb_check_type(mrb, mrb_ary_ref(mrb, inputs, i), MRB_TT_STRING);
+    }
+
+    VALUE results = mrb_ary_new_capa(mrb, num);
+
+#ifdef HAVE_THREAD
+    if (threads > 1 && num > 1 && !params.dict) {
+        /* the inputs are not touched by the VM while the workers run */
+        enc_s_encode_batch_parallel(mrb, results, &params, threads, inputs, num);
+
+        return results;
+    }
+#endif
+
+    int ai = mrb_gc_arena_save(mrb);
+    for (i = 0; i < num; i ++) {
+        mrb_ary_push(mrb, results, enc_s_encode_batch_item(mrb, &params, RSTRING(mrb_ary_ref(mrb, inputs, i))));
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return results;
+}
+
+static void
+init_encoder(MRB, struct RClass *mBrotli)
+{
+    struct RClass *cEncoder = mrb_define_class_under(mrb, mBrotli, "Encoder", mrb_cObject);
+    mrb_define_class_method(mrb, cEncoder, "encode", enc_s_encode, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cEncoder, "encode_batch", enc_s_encode_batch, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cEncoder, "new", enc_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cEncoder, "initialize", enc_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cEncoder, "encode", enc_encode, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cEncoder, "flush", enc_flush, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "finish", enc_finish, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "reset", enc_reset, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cEncoder, "finished?", enc_is_finished, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "total_in", enc_total_in, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "total_out", enc_total_out, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "quality", enc_quality, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "incompressible?", enc_is_incompressible, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cEncoder, "stats", enc_stats, MRB_ARGS_NONE());
+    //mrb_define_method(mrb, cEncoder, "outport", enc_get_outport, MRB_ARGS_NONE());
+    //mrb_define_method(mrb, cEncoder, "outport=", enc_set_outport, MRB_ARGS_ARG(1));
+}
+
+/* class Brotli::Decoder */
+
+struct decoder_params
+{
+    mrb_bool large_window;
+    mrb_bool disable_ring_buffer_reallocation;
+    size_t max_memory;
+    struct dictionary *dict;
+};
+
+static void
+decoder_params_init(struct decoder_params *params)
+{
+    params->large_window = FALSE;
+    params->disable_ring_buffer_reallocation = FALSE;
+    params->max_memory = 0;
+    params->dict = NULL;
+}
+
+static BROTLI_BOOL
+aux_decoder_set_params(BrotliDecoderState *brotli, const struct decoder_params *params)
+{
+    if (params->large_window) {
+        BrotliDecoderSetParameter(brotli, BROTLI_DECODER_PARAM_LARGE_WINDOW, 1);
+    }
+
+    if (params->disable_ring_buffer_reallocation) {
+        BrotliDecoderSetParameter(brotli, BROTLI_DECODER_PARAM_DISABLE_RING_BUFFER_REALLOCATION, 1);
+    }
+
+    return aux_decoder_attach_dictionary(brotli, params->dict);
+}
+
+static void
+decoder_params_apply(MRB, BrotliDecoderState *brotli, const struct decoder_params *params)
+{
+    if (params->large_window) {
+        BrotliDecoderSetParameter(brotli, BROTLI_DECODER_PARAM_LARGE_WINDOW, 1);
+    }
+
+    if (params->disable_ring_buffer_reallocation) {
+        BrotliDecoderSetParameter(brotli, BROTLI_DECODER_PARAM_DISABLE_RING_BUFFER_REALLOCATION, 1);
+    }
+
+    decoder_attach_dictionary(mrb, brotli, params->dict);
+}
+
+/*
+ * Scans the decoder options, and keeps the dictionary object alive in ``self``
+ * if ``self`` is not nil.
+ */
+static void
+decoder_params_scan(MRB, VALUE self, VALUE large_window, VALUE disable_ring_buffer_reallocation, VALUE max_memory, VALUE dictionary, struct decoder_params *params)
+{
+    params->large_window = RTEST(large_window);
+    params->disable_ring_buffer_reallocation = RTEST(disable_ring_buffer_reallocation);
+    params->max_memory = (NIL_P(max_memory) ? 0 : convert_to_size_t(mrb, max_memory));
+    params->dict = getdictionary_or_nil(mrb, dictionary);
+
+    if (!NIL_P(self)) {
+        mrb_iv_set(mrb, self, SYMBOL("dictionary@mruby-brotli"), dictionary);
+    }
+}
+
+struct decoder
+{
+    BrotliDecoderState *brotli;
+    struct memcap memory;
+    struct decoder_params params;
+    VALUE inport;
+    const char *nextin;
+    size_t availin;
+    size_t total_fed;
+    size_t total_out;
+    BrotliDecoderResult status;
+    struct {
+        size_t size;        /* bytes to advise ahead of the file position, or 0 */
+        int fd;             /* -1 if the inport is not a seekable file */
+        uint64_t until;     /* advised up to this offset */
+    } readahead;
+};
+
+static void
+decoder_free(MRB, struct decoder *p)
+{
+    if (p->brotli) {
+        BrotliDecoderDestroyInstance(p->brotli);
+        p->brotli = NULL;
+    }
+
+    if (p->memory.pool) {
+        bufpool_unref(p->memory.pool);
+        p->memory.pool = NULL;
+    }
+
+    if (p) {
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type decoder_type = {
+    .struct_name = "decoder@mruby-brotli",
+    .dfree = (void (*)(mrb_state *, void *))decoder_free,
+};
+
+static struct decoder *
+getdecoder(MRB, VALUE self)
+{
+    return (struct decoder *)mrbx_getref(mrb, self, &decoder_type);
+}
+
+/*
+ * call-seq:
+ *  new(inport = nil, large_window: false, disable_ring_buffer_reallocation: false, max_memory: nil, allocator: nil,
+ *      readahead: false, dictionary: nil) -> decoder object
+ *
+ * If ``inport`` is nil, the decoder is push-style and takes its input
+ * through Decoder#feed.
+ */
+static VALUE
+dec_s_new(MRB, VALUE self)
+{
+    struct RData *rd = mrb_data_object_alloc(mrb, RClass(self), NULL, &decoder_type);
+    rd->data = mrb_calloc(mrb, sizeof(struct decoder), 1);
+    struct decoder *p = (struct decoder *)rd->data;
+    memcap_init(&p->memory, bufpool_ref(bufpool_get(mrb)), 0);
+    p->brotli = aux_decoder_create_instance(mrb, &p->memory);
+    if (!p->brotli) {
+        bufpool_unref(p->memory.pool);
+        mrb_free(mrb, rd->data);
+        rd->data = NULL;
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "allocation error in BrotliDecoderCreateInstance()");
+    }
+
+    p->inport = Qnil;
+    p->total_out = 0;
+    p->status = BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT;
+    p->readahead.fd = -1;
+
+    VALUE obj = VALUE(rd);
+
+    mrbx_funcall_passthrough(mrb, obj, id_initialize);
+
+    return obj;
+}
+
+/*
+ * Looks for the file descriptor of the inport for ``readahead``.
+ * Pipes, sockets and objects without ``fileno`` are not advised.
+ */
+static void
+dec_readahead_setup(MRB, struct decoder *p, VALUE inport)
+{
+    p->readahead.fd = -1;
+    p->readahead.until = 0;
+
+#if defined(POSIX_FADV_WILLNEED) && defined(HAVE_MMAP)
+    if (p->readahead.size == 0 || NIL_P(inport) ||
+            !mrb_respond_to(mrb, inport, mrb_intern_cstr(mrb, "fileno"))) {
+        return;
+    }
+
+    VALUE fd = mrb_funcall(mrb, inport, "fileno", 0);
+    if (!mrb_fixnum_p(fd) || mrb_fixnum(fd) < 0 || mrb_fixnum(fd) > INT_MAX ||
+            lseek((int)mrb_fixnum(fd), 0, SEEK_CUR) < 0) {
+        return;
+    }
+
+    p->readahead.fd = (int)mrb_fixnum(fd);
+    posix_fadvise(p->readahead.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/*
+ * Asks the kernel to read the next ``readahead.size`` bytes of the file in
+ * the background, so that the reads overlap with the decompression. The
+ * advice is renewed when half of the window is consumed.
+ */
+static void
+dec_readahead(struct decoder *p)
+{
+#if defined(POSIX_FADV_WILLNEED) && defined(HAVE_MMAP)
+    if (p->readahead.fd < 0) { return; }
+
+    off_t pos = lseek(p->readahead.fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        p->readahead.fd = -1;
+        return;
+    }
+
+    uint64_t end = (uint64_t)pos + p->readahead.size;
+    if (p->readahead.until >= (uint64_t)pos + p->readahead.size / 2) { return; }
+
+    uint64_t from = (p->readahead.until > (uint64_t)pos ? p->readahead.until : (uint64_t)pos);
+    posix_fadvise(p->readahead.fd, (off_t)from, (off_t)(end - from), POSIX_FADV_WILLNEED);
+    p->readahead.until = end;
+#endif
+}
+
+static void
+dec_read_inport(MRB, struct decoder *p)
+{
+    dec_readahead(p);
+    p->availin = (size_t)mrbx_fakedin_read(mrb, p->inport, &p->nextin, EXT_PARTIAL_READ_SIZE);
+    MEMCAP_STATS_ADD(&p->memory, port_calls, 1);
+    MEMCAP_STATS_ADD(&p->memory, port_bytes, ((ssize_t)p->availin > 0 ? p->availin : 0));
+}
+
+static VALUE
+dec_initialize(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    VALUE inport = Qnil, opts = Qnil;
+    mrb_int argc = mrb_get_args(mrb, "|oH", &inport, &opts);
+
+    if (argc == 1 && mrb_hash_p(inport)) {
+        opts = inport;
+        inport = Qnil;
+    }
+
+    if (!NIL_P(opts)) {
+        VALUE large_window, disable_rbr, max_memory, allocator, readahead, dictionary;
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("large_window", &large_window, Qfalse),
+                MRBX_SCANHASH_ARGS("disable_ring_buffer_reallocation", &disable_rbr, Qfalse),
+                MRBX_SCANHASH_ARGS("max_memory", &max_memory, Qnil),
+                MRBX_SCANHASH_ARGS("allocator", &allocator, Qnil),
+                MRBX_SCANHASH_ARGS("readahead", &readahead, Qfalse),
+                MRBX_SCANHASH_ARGS("dictionary", &dictionary, Qnil));
+
+        p->readahead.size = convert_to_readahead(mrb, readahead) * EXT_PARTIAL_READ_SIZE;
+
+        decoder_params_scan(mrb, self, large_window, disable_rbr, max_memory, dictionary, &p->params);
+        p->memory.allocator = convert_to_allocator(mrb, allocator);
+        decoder_params_apply(mrb, p->brotli, &p->params);
+
+        /* the state itself is counted since it is created by .new */
+        p->memory.limit = (p->params.max_memory > 0 ? p->params.max_memory : SIZE_MAX);
+    }
+
+    p->inport = (NIL_P(inport) ? Qnil : mrbx_fakedin_new(mrb, inport));
+    p->status = BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT;
+    dec_readahead_setup(mrb, p, inport);
+
+    return self;
+}
+
+static void
+dec_decode_args(MRB, VALUE self, ssize_t *size, struct RString **dest)
+{
+    VALUE argv[] = { Qnil, Qnil };
+    mrb_int argc = mrb_get_args(mrb, "|oS!", &argv[0], &argv[1]);
+
+    (void)argc;
+
+    if (NIL_P(argv[0])) {
+        *size = -1;
+    } else {
+        mrb_int n = mrb_int(mrb, argv[0]);
+        if (n < 0 || n > SSIZE_MAX) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "``size'' is too big or too small - %S",
+                       argv[0]);
+        }
+        *size = n;
+    }
+
+    const char *ptr0 = (NIL_P(argv[1]) ? NULL : RSTRING_PTR(argv[1]));
+    *dest = mrbx_str_force_recycle(mrb, argv[1], (*size < 0 ? EXT_PARTIAL_READ_SIZE : *size));
+    mrbx_str_set_len(mrb, *dest, 0);
+
+    if (NIL_P(argv[1]) || RSTRING(argv[1]) != *dest || RSTR_PTR(*dest) != ptr0) {
+        MEMCAP_STATS_ADD(&getdecoder(mrb, self)->memory, buffer_allocs, 1);
+    }
+}
+
+static ssize_t
+dec_decode_partial(MRB, VALUE self, struct decoder *p, char *dest, ssize_t size)
+{
+    intptr_t dest0 = (intptr_t)dest;
+    intptr_t destend = (intptr_t)dest + size;
+
+    if (p->status <= BROTLI_DECODER_RESULT_SUCCESS) { return 0; }
+
+    while ((intptr_t)dest < destend) {
+        if (p->status == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
+            dec_read_inport(mrb, p);
+        }
+
+        if ((ssize_t)p->availin < 0) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "unexpected end of stream");
+        }
+
+        p->status = memcap_decompress_stream(&p->memory, p->brotli, &p->availin, (const uint8_t **)&p->nextin, (size_t *)&size, (uint8_t **)&dest, &p->total_out);
+
+        if (p->status == BROTLI_DECODER_RESULT_SUCCESS) {
+            break;
+        } else if (p->status < BROTLI_DECODER_RESULT_SUCCESS) {
+            memcap_check(mrb, &p->memory);
+            aux_brotli_decoder_error(mrb, p->status, BrotliDecoderGetErrorCode(p->brotli), p->params.large_window);
+        }
+    }
+
+    return (intptr_t)dest - dest0;
+}
+
+struct dec_decode_full_growup
+{
+    VALUE self;
+    struct decoder *decoder;
+    mrb_bool called;
+};
+
+static ssize_t
+dec_decode_full_growup(MRB, char *ptr, size_t *size, void *user)
+{
+    struct dec_decode_full_growup *argp = user;
+
+    /* the buffer is expanded before each call except the first */
+    if (argp->called) {
+        MEMCAP_STATS_ADD(&argp->decoder->memory, buffer_allocs, 1);
+    }
+    argp->called = TRUE;
+
+    *size = dec_decode_partial(mrb, argp->self, argp->decoder, ptr, *size);
+
+    if (*size == 0) {
+        return MRBX_STOP;
+    } else {
+        return MRBX_NEXT;
+    }
+}
+
+static ssize_t
+dec_decode_full(MRB, VALUE self, struct decoder *p, struct RString *dest)
+{
+    struct dec_decode_full_growup args = { self, p, FALSE };
+
+    mrbx_str_buf_growup(mrb, dest, -1, NULL, dec_decode_full_growup, &args);
+
+    return RSTR_LEN(dest);
+}
+
+static VALUE
+dec_decode(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    ssize_t size;
+    struct RString *dest;
+    dec_decode_args(mrb, self, &size, &dest);
+
+    if (size == 0) {
+        return VALUE(dest);
+    }
+
+    if (p->status <= BROTLI_DECODER_RESULT_SUCCESS) {
+        return Qnil;
+    }
+
+    if (NIL_P(p->inport)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "decoder has no inport (use Decoder#feed)");
+    }
+
+    if (size < 0) {
+        size = dec_decode_full(mrb, self, p, dest);
+    } else {
+        size = dec_decode_partial(mrb, self, p, RSTR_PTR(dest), size);
+        mrbx_str_set_len(mrb, dest, size);
+    }
+
+    if (size > 0) {
+        return VALUE(dest);
+    } else {
+        return Qnil;
+    }
+}
+
+static void
+dec_push_input(MRB, VALUE self, struct decoder *p, VALUE input)
+{
+    if (NIL_P(input) || RSTRING_LEN(input) < 1) {
+        return;
+    }
+
+    p->total_fed += RSTRING_LEN(input);
+
+    if (p->availin > 0) {
+        /* the rest of the previous input is kept in pending@mruby-brotli */
+        VALUE pending = mrb_str_new(mrb, p->nextin, p->availin);
+        mrb_str_cat(mrb, pending, RSTRING_PTR(input), RSTRING_LEN(input));
+        mrb_iv_set(mrb, self, SYMBOL("pending@mruby-brotli"), pending);
+        input = pending;
+    }
+
+    p->nextin = RSTRING_PTR(input);
+    p->availin = RSTRING_LEN(input);
+}
+
+/*
+ * Copies the unconsumed input into pending@mruby-brotli, since the caller's
+ * string may be modified after return.
+ */
+static void
+dec_retain_input(MRB, VALUE self, struct decoder *p)
+{
+    if (p->availin == 0) {
+        mrb_iv_set(mrb, self, SYMBOL("pending@mruby-brotli"), Qnil);
+    } else {
+        VALUE pending = mrb_str_new(mrb, p->nextin, p->availin);
+        mrb_iv_set(mrb, self, SYMBOL("pending@mruby-brotli"), pending);
+        p->nextin = RSTRING_PTR(pending);
+    }
+}
+
+static void
+dec_feed_args(MRB, VALUE self, struct decoder *p, size_t *size, struct RString **dest)
+{
+    VALUE input = Qnil, vsize = Qnil, vdest = Qnil;
+    mrb_get_args(mrb, "|S!oS!", &input, &vsize, &vdest);
+
+    if (NIL_P(vsize)) {
+        *size = SIZE_MAX;
+    } else {
+        mrb_int n = mrb_int(mrb, vsize);
+        if (n < 0 || n > SSIZE_MAX) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "``size'' is too big or too small - %S",
+                       vsize);
+        }
+        *size = n;
+    }
+
+    const char *ptr0 = (NIL_P(vdest) ? NULL : RSTRING_PTR(vdest));
+    /* starts small, since many push decoders may hold their outputs */
+    *dest = mrbx_str_force_recycle(mrb, vdest, (*size < EXT_FEED_INITIAL_SIZE ? *size : EXT_FEED_INITIAL_SIZE));
+    mrbx_str_set_len(mrb, *dest, 0);
+
+    if (NIL_P(vdest) || RSTRING(vdest) != *dest || RSTR_PTR(*dest) != ptr0) {
+        MEMCAP_STATS_ADD(&p->memory, buffer_allocs, 1);
+    }
+
+    dec_push_input(mrb, self, p, input);
+}
+
+/*
+ * call-seq:
+ *  feed(input = nil, size = nil, output = nil) -> output or nil
+ *
+ * Decompresses ``input`` and returns the decompressed data without reading
+ * from the inport. The call never waits for more data: it stops when
+ * ``input`` is consumed (Decoder#needs_input?) or when ``size`` bytes are
+ * produced (Decoder#has_output?). In the latter case, the rest of
+ * ``input`` is kept in the decoder, and the following call with nil
+ * continues from there.
+ *
+ * Returns nil if the stream is already finished.
+ */
+static VALUE
+dec_feed(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (!NIL_P(p->inport)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "decoder has an inport (use Decoder#decode)");
+    }
+
+    size_t size;
+    struct RString *dest;
+    /* a remaining input is always owned by pending@mruby-brotli */
+    mrb_bool owned = (p->availin > 0);
+    dec_feed_args(mrb, self, p, &size, &dest);
+
+    if (p->status <= BROTLI_DECODER_RESULT_SUCCESS) {
+        return Qnil;
+    }
+
+    while (RSTR_LEN(dest) < size) {
+        if (p->status == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT && p->availin == 0) {
+            break;
+        }
+
+        size_t len = RSTR_LEN(dest);
+        if (len >= RSTR_CAPA(dest)) {
+            size_t capa = (len < EXT_FEED_INITIAL_SIZE ? EXT_FEED_INITIAL_SIZE : len * 2);
+            if (capa > size) { capa = size; }
+            mrb_str_resize(mrb, VALUE(dest), capa);
+            mrbx_str_set_len(mrb, dest, len);
+            MEMCAP_STATS_ADD(&p->memory, buffer_allocs, 1);
+        }
+
+        size_t availout = RSTR_CAPA(dest) - len;
+        uint8_t *nextout = (uint8_t *)RSTR_PTR(dest) + len;
+        if (availout > size - len) { availout = size - len; }
+
+        p->status = memcap_decompress_stream(&p->memory, p->brotli, &p->availin, (const uint8_t **)&p->nextin, &availout, &nextout, &p->total_out);
+        mrbx_str_set_len(mrb, dest, (char *)nextout - RSTR_PTR(dest));
+
+        if (p->status == BROTLI_DECODER_RESULT_SUCCESS) {
+            break;
+        } else if (p->status < BROTLI_DECODER_RESULT_SUCCESS) {
+            memcap_check(mrb, &p->memory);
+            aux_brotli_decoder_error(mrb, p->status, BrotliDecoderGetErrorCode(p->brotli), p->params.large_window);
+        }
+    }
+
+    if (p->availin == 0 || !owned) {
+        dec_retain_input(mrb, self, p);
+    }
+
+    return VALUE(dest);
+}
+
+struct dec_each_chunk_yield
+{
+    VALUE block;
+    struct RString *view;
+};
+
+static VALUE
+dec_each_chunk_yield_try(MRB, VALUE args)
+{
+    struct dec_each_chunk_yield *argp = (struct dec_each_chunk_yield *)mrb_cptr(args);
+
+    return mrb_yield(mrb, argp->block, VALUE(argp->view));
+}
+
+static VALUE
+dec_each_chunk_yield_cleanup(MRB, VALUE args)
+{
+    struct dec_each_chunk_yield *argp = (struct dec_each_chunk_yield *)mrb_cptr(args);
+
+    aux_str_unbind_view(mrb, argp->view);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  each_chunk(input = nil) { |chunk| ... } -> self
+ *
+ * Yields the decompressed data as taken by BrotliDecoderTakeOutput(),
+ * without copying it into a destination string. ``chunk'' is a frozen
+ * Brotli::BufferView of the internal buffer of the decoder, and it is
+ * emptied when the block returns. It must not escape the block; use
+ * ``"" + chunk'' in the block to keep the data.
+ *
+ * With an inport, reads it to the end of the stream. Without an inport,
+ * decompresses ``input'' (as Decoder#feed) and returns when the decoder
+ * needs more input.
+ */
+static VALUE
+dec_each_chunk(MRB, VALUE self)
+{
+    struct decoder *p = getdecoder(mrb, self);
+
+    VALUE input = Qnil, block = Qnil;
+    mrb_get_args(mrb, "|S!&", &input, &block);
+
+    if (NIL_P(block)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "need block");
+    }
+
+    if (!NIL_P(p->inport)) {
+        if (!NIL_P(input)) {
+            mrb_raise(mrb, E_ARGUMENT_ERROR,
+                      "decoder has an inport (``input'' must be nil)");
+        }
+    } else {
+        dec_push_input(mrb, self, p, input);
+        /* the block may modify the input or raise an exception */
+        dec_retain_input(mrb, self, p);
+    }
+
+    while (p->status > BROTLI_DECODER_RESULT_SUCCESS) {
+        if (p->status == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT && p->availin == 0) {
+            if (NIL_P(p->inport)) {
+                break;
+            }
+
+            dec_read_inport(mrb, p);
+
+            if ((ssize_t)p->availin < 0) {
+                mrb_raise(mrb, E_RUNTIME_ERROR, "unexpected end of stream");
+            }
+        }
+
+        size_t availout = 0;
+        p->status = memcap_decompress_stream(&p->memory, p->brotli, &p->availin, (const uint8_t **)&p->nextin, &availout, NULL, &p->total_out);
+
+        if (p->status < BROTLI_DECODER_RESULT_SUCCESS) {
+            memcap_check(mrb, &p->memory);
+            aux_brotli_decoder_error(mrb, p->status, BrotliDecoderGetErrorCode(p->brotli), p->params.large_window);
+        }
+
+        while (BrotliDecoderHasMoreOutput(p->brotli)) {
+            size_t size = 0;
+            const uint8_t *out = BrotliDecoderTakeOutput(p->brotli, &size);
+
+            if (size > 0) {
+                int ai = mrb_gc_arena_save(mrb);
+                struct dec_each_chunk_yield args = { block, aux_str_new_view(mrb, out, size) };
+                p->total_out += size;
+                MEMCAP_STATS_ADD(&p->memory, port_calls, 1);
+                MEMCAP_STATS_ADD(&p->memory, port_bytes, size);
+                mrb_ensure(mrb,
+                           dec_each_chunk_yield_try, mrb_cptr_value(mrb, &args),
+                           dec_each_chunk_yield_cleanup, mrb_cptr_value(mrb, &args));
+                mrb_gc_arena_restore(mrb, ai);
+            }
+        }
+    }
+
+    if (NIL_P(p->inport) && p->availin == 0) {
+        mrb_iv_set(mrb, self, SYMBOL("pending@mruby-brotli"), Qnil);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  needs_input? -> true or false
+ *
+ * Returns true if all the given input is consumed and the decoder is
+ * waiting for the next data.
+ */
+static VALUE
+dec_needs_input(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct decoder *p = getdecoder(mrb, self);
+
+    return (p->status == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT && p->availin == 0 ? Qtrue : Qfalse);
+}
+
+/*
+ * call-seq:
+ *  has_output? -> true or false
+ *
+ * Returns true if more data can be decompressed without further input.
+ */
+static VALUE
+dec_has_output(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (p->status == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT ||
+        (p->status == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT && p->availin > 0) ||
+        (p->status > BROTLI_DECODER_RESULT_SUCCESS && BrotliDecoderHasMoreOutput(p->brotli))) {
+        return Qtrue;
+    } else {
+        return Qfalse;
+    }
+}
+
+/*
+ * call-seq:
+ *  result -> :needs_more_input, :needs_more_output, :success or :error
+ *
+ * Returns the last BrotliDecoderResult as a symbol.
+ */
+static VALUE
+dec_result(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    switch (getdecoder(mrb, self)->status) {
+    case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+        return mrb_symbol_value(SYMBOL("needs_more_input"));
+    case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+        return mrb_symbol_value(SYMBOL("needs_more_output"));
+    case BROTLI_DECODER_RESULT_SUCCESS:
+        return mrb_symbol_value(SYMBOL("success"));
+    default:
+        return mrb_symbol_value(SYMBOL("error"));
+    }
+}
+
+static VALUE
+dec_finish(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    getdecoder(mrb, self)->status = BROTLI_DECODER_RESULT_SUCCESS;
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  reset(inport = nil) -> self
+ *
+ * Discards the current stream and starts a new stream with the same
+ * parameters. If ``inport`` is not given, the next stream is read from the
+ * current inport, following the data that is already read.
+ */
+static VALUE
+dec_reset(MRB, VALUE self)
+{
+    VALUE inport = Qnil;
+    mrb_get_args(mrb, "|o", &inport);
+
+    struct decoder *p = getdecoder(mrb, self);
+
+    /* the old state is about to be freed, so it is not counted against max_memory */
+    size_t used0 = p->memory.used;
+    p->memory.used = 0;
+    BrotliDecoderState *brotli = aux_decoder_create_instance(mrb, &p->memory);
+    size_t used1 = p->memory.used;
+    p->memory.used = used0;
+
+    if (!brotli) {
+        memcap_check(mrb, &p->memory);
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "allocation error in BrotliDecoderCreateInstance()");
+    }
+
+    BrotliDecoderDestroyInstance(p->brotli);
+    p->memory.used += used1;
+    p->brotli = brotli;
+    p->memory.exceeded = FALSE;
+    p->total_out = 0;
+    decoder_params_apply(mrb, p->brotli, &p->params);
+
+    if (!NIL_P(inport)) {
+        p->inport = mrbx_fakedin_new(mrb, inport);
+        p->availin = 0;
+        dec_readahead_setup(mrb, p, inport);
+    }
+
+    if (p->availin > 0) {
+        /* decompress the rest of the input before reading from inport */
+        p->status = BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
+    } else {
+        p->status = BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT;
+    }
+
+    return self;
+}
+
+static VALUE
+dec_is_finished(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return (getdecoder(mrb, self)->status <= BROTLI_DECODER_RESULT_SUCCESS ? Qtrue : Qfalse);
+}
+
+static VALUE
+dec_total_in(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (NIL_P(p->inport)) {
+        return aux_uint64_value(mrb, p->total_fed);
+    }
+
+    return mrb_fixnum_value(mrbx_fakedin_total_in(mrb, p->inport));
+}
+
+static VALUE
+dec_total_out(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return mrb_fixnum_value(getdecoder(mrb, self)->total_out);
+}
+
+static VALUE
+dec_get_inport(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct decoder *p = getdecoder(mrb, self);
+
+    if (NIL_P(p->inport)) {
+        return Qnil;
+    }
+
+    return mrbx_fakedin_stream(mrb, p->inport);
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * Returns the instrumentation counters of the decoder.
+ */
+static VALUE
+dec_stats(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return memcap_stats(mrb, &getdecoder(mrb, self)->memory);
+}
+
+static void
+dec_s_decode_args(MRB, VALUE self, const char **input, size_t *insize, struct RString **output, size_t *outsize, mrb_bool *partial, size_t *expected_size, struct decoder_params *params)
+{
+    mrb_int argc;
+    VALUE *argv;
+    mrb_get_args(mrb, "*", &argv, &argc);
+
+    decoder_params_init(params);
+    *expected_size = (size_t)-1;
+
+    VALUE is_partial;
+    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
+        VALUE large_window_v, disable_rbr_v, max_memory_v, expected_size_v, dict_v;
+        MRBX_SCANHASH(mrb, argv[argc - 1], Qfalse,
+                MRBX_SCANHASH_ARG("partial", &is_partial, Qnil),
+                MRBX_SCANHASH_ARG("large_window", &large_window_v, Qfalse),
+                MRBX_SCANHASH_ARG("disable_ring_buffer_reallocation", &disable_rbr_v, Qfalse),
+                MRBX_SCANHASH_ARG("max_memory", &max_memory_v, Qnil),
+                MRBX_SCANHASH_ARG("expected_size", &expected_size_v, Qnil),
+                MRBX_SCANHASH_ARG("dictionary", &dict_v, Qnil));
+
+        decoder_params_scan(mrb, Qnil, large_window_v, disable_rbr_v, max_memory_v, dict_v, params);
+        *expected_size = convert_to_size_t(mrb, expected_size_v);
+
+        argc --;
+    } else {
+        is_partial = Qnil;
+    }
+
+    switch (argc) {
+    case 1:
+        *outsize = (size_t)-1;
+        *output = NULL;
+        break;
+    case 2:
+        if (mrb_string_p(argv[1])) {
+            *outsize = (size_t)-1;
+            *output = RString(argv[1]);
+        } else {
+            *outsize = convert_to_size_t(mrb, argv[1]);
+            *output = NULL;
+        }
+        break;
+    case 3:
+        *outsize = convert_to_size_t(mrb, argv[1]);
+        *output = RString(argv[2]);
+        break;
+    default:
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong number arguments (given %S, expect 1 .. 3)",
+                   VALUE(argc));
+    }
+
+    aux_get_input(mrb, argv[0], input, insize);
+
+    if ((ssize_t)*outsize < 0) {
+        *output = mrbx_str_force_recycle(mrb, *output, EXT_PARTIAL_READ_SIZE);
+        *partial = RTEST(is_partial);
+    } else {
+        *output = mrbx_str_force_recycle(mrb, *output, *outsize);
+        *partial = NIL_P(is_partial) || RTEST(is_partial);
+    }
+
+    mrbx_str_set_len(mrb, *output, 0);
+}
+
+/*
+ * Returns a decoder state drawn from the memory pool.
+ * It must be released by dec_s_destroy_instance().
+ */
+static BrotliDecoderState *
+dec_s_create_instance(MRB, struct memcap *cap, const struct decoder_params *params)
+{
+    memcap_init(cap, bufpool_get(mrb), params->max_memory);
+
+    BrotliDecoderState *brotli;
+    brotli = aux_decoder_create_instance(mrb, cap);
+    if (!brotli)
+    {
+        memcap_check(mrb, cap);
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed BrotliDecoderCreateInstance (may be out of memory)");
+    }
+
+    if (!aux_decoder_set_params(brotli, params)) {
+        BrotliDecoderDestroyInstance(brotli);
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed BrotliDecoderAttachDictionary()");
+    }
+
+    bufpool_ref(cap->pool);
+
+    return brotli;
+}
+
+static void
+dec_s_destroy_instance(MRB, struct memcap *cap, BrotliDecoderState *brotli)
+{
+    BrotliDecoderDestroyInstance(brotli);
+    bufpool_unref(cap->pool);
+}
+
+static void
+dec_s_decode_partial(MRB, const char *input, size_t insize, struct RString *output, size_t outsize, mrb_bool partial, const struct decoder_params *params)
+{
+    struct memcap cap;
+    BrotliDecoderState *brotli = dec_s_create_instance(mrb, &cap, params);
+
+    char *outp = RSTR_PTR(output);
+    size_t availout = outsize;
+    BrotliDecoderResult ok = BrotliDecoderDecompressStream(brotli, &insize, (const uint8_t **)&input, &availout, (uint8_t **)&outp, NULL);
+    BrotliDecoderErrorCode err = BrotliDecoderGetErrorCode(brotli);
+    dec_s_destroy_instance(mrb, &cap, brotli);
+
+    if (ok != BROTLI_DECODER_RESULT_SUCCESS &&
+            !(partial && ok == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT)) {
+        memcap_check(mrb, &cap);
+        aux_brotli_decoder_error(mrb, ok, err, params->large_window);
+    }
+
+    mrbx_str_set_len(mrb, output, outsize - availout);
+}
+
+/*
+ * Reads the bits of the stream in LSB first order, for the stream pre-scan.
+ */
+struct aux_bitreader
+{
+    const uint8_t *ptr;
+    const uint8_t *end;
+    int bitpos;
+};
+
+static mrb_bool
+aux_bitreader_read(struct aux_bitreader *br, int nbits, uint32_t *value)
+{
+    uint32_t v = 0;
+    int i;
+
+    for (i = 0; i < nbits; i ++) {
+        if (br->ptr >= br->end) { return FALSE; }
+        v |= (uint32_t)((*br->ptr >> br->bitpos) & 1) << i;
+        if (++ br->bitpos >= 8) {
+            br->bitpos = 0;
+            br->ptr ++;
+        }
+    }
+
+    *value = v;
+
+    return TRUE;
+}
+
+static mrb_bool
+aux_bitreader_skip_bytes(struct aux_bitreader *br, size_t size)
+{
+    if (br->bitpos > 0) {
+        br->bitpos = 0;
+        br->ptr ++;
+    }
+
+    if (br->ptr > br->end || size > (size_t)(br->end - br->ptr)) { return FALSE; }
+    br->ptr += size;
+
+    return TRUE;
+}
+
+/*
+ * Determines the decompressed size from the meta-block headers without decoding.
+ *
+ * Metadata and uncompressed meta-blocks are skipped over. The size is only known
+ * when the stream ends with a single compressed meta-block, as the length of a
+ * compressed meta-block's body is not recorded anywhere.
+ *
+ * Returns -1 if the size is unknown.
+ */
+static ssize_t
+aux_brotli_prescan(const char *input, size_t insize)
+{
+    struct aux_bitreader br = { (const uint8_t *)input, (const uint8_t *)input + insize, 0 };
+    uint32_t v, n;
+    size_t total = 0;
+
+    /* WBITS */
+    if (!aux_bitreader_read(&br, 1, &v)) { return -1; }
+    if (v) {
+        if (!aux_bitreader_read(&br, 3, &v)) { return -1; }
+        if (v == 0) {
+            if (!aux_bitreader_read(&br, 3, &v)) { return -1; }
+            if (v == 1 && !aux_bitreader_read(&br, 7, &v)) { return -1; } /* large window */
+        }
+    }
+
+    for (;;) {
+        uint32_t islast, nibbles, mlen = 0;
+
+        if (!aux_bitreader_read(&br, 1, &islast)) { return -1; }
+        if (islast) {
+            if (!aux_bitreader_read(&br, 1, &v)) { return -1; }
+            if (v) { return (total > SSIZE_MAX ? -1 : (ssize_t)total); } /* ISLASTEMPTY */
+        }
+
+        if (!aux_bitreader_read(&br, 2, &nibbles)) { return -1; }
+
+        if (nibbles == 3) {
+            /* metadata meta-block */
+            if (islast) { return -1; }
+            if (!aux_bitreader_read(&br, 1, &v) || v != 0) { return -1; }
+            if (!aux_bitreader_read(&br, 2, &n)) { return -1; }
+            if (n > 0 && !aux_bitreader_read(&br, n * 8, &mlen)) { return -1; }
+            if (n > 0) { mlen ++; }
+            if (!aux_bitreader_skip_bytes(&br, mlen)) { return -1; }
+            continue;
+        }
+
+        if (!aux_bitreader_read(&br, (nibbles + 4) * 4, &mlen)) { return -1; }
+        mlen ++;
+
+        if (islast) {
+            total += mlen;
+            return (total > SSIZE_MAX ? -1 : (ssize_t)total);
+        }
+
+        if (!aux_bitreader_read(&br, 1, &v)) { return -1; }
+        if (!v) { return -1; } /* compressed and not the last */
+
+        /* uncompressed meta-block */
+        if (!aux_bitreader_skip_bytes(&br, mlen)) { return -1; }
+        total += mlen;
+    }
+}
+
+struct dec_s_decode_full_growup
+{
+    const struct decoder_params *params;
+    struct memcap cap;
+    BrotliDecoderState *brotli;
+    const char *input;
+    size_t insize;
+    struct RString *output;
+    mrb_bool partial;
+    size_t expected_size;
+};
+
+/*
+ * Decompresses straight into the output allocated once with the expected size.
+ * Returns FALSE if the output is too small; the rest is left to mrbx_str_buf_growup().
+ */
+static mrb_bool
+dec_s_decode_exact(MRB, struct dec_s_decode_full_growup *argp)
+{
+    mrb_str_resize(mrb, VALUE(argp->output), (mrb_int)argp->expected_size);
+
+    char *outp = RSTR_PTR(argp->output);
+    size_t availout = argp->expected_size;
+    BrotliDecoderResult ok = BrotliDecoderDecompressStream(argp->brotli, &argp->insize, (const uint8_t **)&argp->input, &availout, (uint8_t **)&outp, NULL);
+    mrbx_str_set_len(mrb, argp->output, argp->expected_size - availout);
+
+    switch (ok) {
+    case BROTLI_DECODER_RESULT_SUCCESS:
+        return TRUE;
+    case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+        return FALSE;
+    default:
+        memcap_check(mrb, &argp->cap);
+        aux_brotli_decoder_error(mrb, ok, BrotliDecoderGetErrorCode(argp->brotli), argp->params->large_window);
+        return TRUE;
+    }
+}
+
+static ssize_t
+dec_s_decode_full_growup(MRB, char *buf, size_t *size, void *user)
+{
+    struct dec_s_decode_full_growup *argp = user;
+    size_t outsize = *size;
+
+    BrotliDecoderResult ok;
+    ok = BrotliDecoderDecompressStream(argp->brotli, &argp->insize, (const uint8_t **)&argp->input, &outsize, (uint8_t **)&buf, NULL);
+    *size = *size - outsize;
+
+    if (ok == BROTLI_DECODER_RESULT_SUCCESS) {
+        return MRBX_STOP;
+    }
+
+    if (ok != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+        memcap_check(mrb, &argp->cap);
+        aux_brotli_decoder_error(mrb, ok, BrotliDecoderGetErrorCode(argp->brotli), argp->params->large_window);
+    }
+
+    return MRBX_NEXT;
+}
+
+static VALUE
+dec_s_decode_full_try(MRB, VALUE args)
+{
+    struct dec_s_decode_full_growup *argp = mrb_cptr(args);
+
+    if ((ssize_t)argp->expected_size > 0 && dec_s_decode_exact(mrb, argp)) {
+        return Qnil;
+    }
+
+    /* continues after the expected size, if any */
+    mrbx_str_buf_growup(mrb, argp->output, -1, &argp->partial, dec_s_decode_full_growup, argp);
+
+    return Qnil;
+}
+
+static VALUE
+dec_s_decode_full_cleanup(MRB, VALUE args)
+{
+    struct dec_s_decode_full_growup *argp = mrb_cptr(args);
+
+    dec_s_destroy_instance(mrb, &argp->cap, argp->brotli);
+
+    return Qnil;
+}
+
+static void
+dec_s_decode_full(MRB, const char *input, size_t insize, struct RString *output, mrb_bool partial, size_t expected_size, const struct decoder_params *params)
+{
+    struct dec_s_decode_full_growup args;
+    args.params = params;
+    args.brotli = dec_s_create_instance(mrb, &args.cap, params);
+    args.input = input;
+    args.insize = insize;
+    args.output = output;
+    args.partial = partial;
+
+    if ((ssize_t)expected_size < 0) {
+        expected_size = (size_t)aux_brotli_prescan(input, insize);
+        if ((ssize_t)expected_size > 0 && expected_size / AUX_PRESCAN_MAX_RATIO > insize) {
+            expected_size = insize * AUX_PRESCAN_MAX_RATIO;
+        }
+    }
+
+    /* nothing larger than these is allocated ahead */
+    if ((ssize_t)expected_size > 0 && params->max_memory > 0 && expected_size > params->max_memory) {
+        expected_size = params->max_memory;
+    }
+    if ((ssize_t)expected_size > 0 && expected_size > (size_t)MRB_INT_MAX) {
+        expected_size = 0;
+    }
+
+    args.expected_size = expected_size;
+
+    mrb_ensure(mrb,
+               dec_s_decode_full_try, mrb_cptr_value(mrb, &args),
+               dec_s_decode_full_cleanup, mrb_cptr_value(mrb, &args));
+}
+
+/*
+ * call-seq:
+ *  decode(input, outsize = nil, output = nil, partial: nil, large_window: false,
+ *         disable_ring_buffer_reallocation: false, max_memory: nil, expected_size: nil, dictionary: nil) -> output
+ *  decode(input, output, partial: nil, large_window: false,
+ *         disable_ring_buffer_reallocation: false, max_memory: nil, expected_size: nil, dictionary: nil) -> output
+ *
+ * Without outsize, the output is allocated once by expected_size, or by the
+ * size found from the meta-block headers, and grows only if it is not enough.
+ * The headers tell the size only when the stream ends with a single
+ * compressed meta-block (roughly up to 64 KiB of compressible data), so
+ * larger streams without expected_size take the growing path. The size from
+ * the headers is limited to 1024 times the input, and both are limited to
+ * max_memory.
+ */
+static VALUE
+dec_s_decode(MRB, VALUE self)
+{
+    const char *input;
+    struct RString *output;
+    size_t insize, outsize, expected_size;
+    mrb_bool partial;
+    struct decoder_params params;
+    dec_s_decode_args(mrb, self, &input, &insize, &output, &outsize, &partial, &expected_size, &params);
+
+    if ((ssize_t)outsize < 0) {
+        dec_s_decode_full(mrb, input, insize, output, partial, expected_size, &params);
+    } else {
+        dec_s_decode_partial(mrb, input, insize, output, outsize, partial, &params);
+    }
+
+    return VALUE(output);
+}
+
+struct dec_s_decode_item
+{
+    const struct decoder_params *params;
+    const char *input;
+    size_t insize;
+    char *output;
+    size_t outsize;
+    BrotliDecoderResult result;
+    BrotliDecoderErrorCode err;
+};
+
+#ifdef HAVE_THREAD
+/*
+ * Runs on a native thread without mruby VM; the memory is given by malloc().
+ */
+static void *
+dec_s_decode_item(void *user)
+{
+    struct dec_s_decode_item *item = (struct dec_s_decode_item *)user;
+    BrotliDecoderState *brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+
+    item->result = BROTLI_DECODER_RESULT_ERROR;
+    item->err = BROTLI_DECODER_ERROR_ALLOC_RING_BUFFER_1;
+    if (!brotli) { return NULL; }
+
+    if (!aux_decoder_set_params(brotli, item->params)) {
+        item->err = BROTLI_DECODER_ERROR_DICTIONARY_NOT_SET;
+        BrotliDecoderDestroyInstance(brotli);
+        return NULL;
+    }
+
+    ssize_t expect = aux_brotli_prescan(item->input, item->insize);
+    size_t capa = 0;
+    const uint8_t *next_in = (const uint8_t *)item->input;
+    size_t avail_in = item->insize;
+
+    for (;;) {
+        size_t avail_out = 0;
+        BrotliDecoderResult ok = BrotliDecoderDecompressStream(brotli, &avail_in, &next_in, &avail_out, NULL, NULL);
+
+        size_t size = 0;
+        const uint8_t *out = BrotliDecoderTakeOutput(brotli, &size);
+
+        if (item->outsize + size > capa) {
+            size_t newcapa = (capa > 0 ? capa * 2 : (expect > 0 ? (size_t)expect : size));
+            if (newcapa < item->outsize + size) { newcapa = item->outsize + size; }
+            char *p = (char *)realloc(item->output, newcapa);
+            if (!p) {
+                item->err = BROTLI_DECODER_ERROR_ALLOC_RING_BUFFER_1;
+                break;
+            }
+            item->output = p;
+            capa = newcapa;
+        }
+
+        if (size > 0) {
+            memcpy(item->output + item->outsize, out, size);
+            item->outsize += size;
+        }
+
+        if (ok != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+            item->result = ok;
+            item->err = BrotliDecoderGetErrorCode(brotli);
+            break;
+        }
+    }
+
+    BrotliDecoderDestroyInstance(brotli);
+
+    return NULL;
+}
+
+static void
+dec_s_decode_batch_parallel(MRB, VALUE results, const struct decoder_params *params, int threads, VALUE inputs, mrb_int num)
+{
+    struct dec_s_decode_item *items = (struct dec_s_decode_item *)mrb_calloc(mrb, num, sizeof(struct dec_s_decode_item));
+    mrb_int i;
+
+    for (i = 0; i < num; i ++) {
+        struct RString *input = RSTRING(mrb_ary_ref(mrb, inputs, i));
+        items[i].params = params;
+        items[i].input = RSTR_PTR(input);
+        items[i].insize = RSTR_LEN(input);
+    }
+
+    aux_batch_run(dec_s_decode_item, items, sizeof(struct dec_s_decode_item), num, threads);
+
+    struct dec_s_decode_item *failed = NULL;
+    int ai = mrb_gc_arena_save(mrb);
+    for (i = 0; i < num; i ++) {
+        if (!failed && items[i].result == BROTLI_DECODER_RESULT_SUCCESS) {
+            mrb_ary_push(mrb, results, mrb_str_new(mrb, items[i].output, items[i].outsize));
+            mrb_gc_arena_restore(mrb, ai);
+        } else if (!failed) {
+            failed = &items[i];
+        }
+
+        free(items[i].output);
+    }
+
+    if (failed) {
+        BrotliDecoderResult ok = failed->result;
+        BrotliDecoderErrorCode err = failed->err;
+        mrb_free(mrb, items);
+        aux_brotli_decoder_error(mrb, ok, err, params->large_window);
+    }
+
+    mrb_free(mrb, items);
+}
+#endif
+
+/*
+ * call-seq:
+ *  decode_batch(inputs, large_window: false, disable_ring_buffer_reallocation: false,
+ *               max_memory: nil, dictionary: nil, threads: nil) -> array of outputs
+ *
+ * Decompresses each string in ``inputs`` entirely, parsing the options only once.
+ * If ``threads`` is 2 or more, the strings are spread over native threads,
+ * except when ``max_memory`` is given.
+ */
+static VALUE
+dec_s_decode_batch(MRB, VALUE self)
+{
+    VALUE inputs, opts = Qnil;
+    mrb_get_args(mrb, "A|H", &inputs, &opts);
+
+    struct decoder_params params;
+    int threads = 1;
+    decoder_params_init(&params);
+    if (!NIL_P(opts)) {
+        VALUE large_window, disable_rbr, max_memory, dictionary, threads_v;
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("large_window", &large_window, Qfalse),
+                MRBX_SCANHASH_ARGS("disable_ring_buffer_reallocation", &disable_rbr, Qfalse),
+                MRBX_SCANHASH_ARGS("max_memory", &max_memory, Qnil),
+                MRBX_SCANHASH_ARGS("dictionary", &dictionary, Qnil),
+                MRBX_SCANHASH_ARGS("threads", &threads_v, Qnil));
+
+        decoder_params_scan(mrb, Qnil, large_window, disable_rbr, max_memory, dictionary, &params);
+        threads = convert_to_threads(mrb, threads_v);
+    }
+
+    mrb_int num = RARRAY_LEN(inputs);
+    mrb_int i;
+    for (i = 0; i < num; i ++) {
+        mrb_check_type(mrb, mrb_ary_ref(mrb, inputs, i), MRB_TT_STRING);
+    }
+
+    VALUE results = mrb_ary_new_capa(mrb, num);
+
+#ifdef HAVE_THREAD
+    if (threads > 1 && num > 1 && params.max_memory == 0) {
+        dec_s_decode_batch_parallel(mrb, results, &params, threads, inputs, num);
+
+        return results;
+    }
+#else
+    (void)threads;
+#endif
+
+    int ai = mrb_gc_arena_save(mrb);
+    for (i = 0; i < num; i ++) {
+        struct RString *input = RSTRING(mrb_ary_ref(mrb, inputs, i));
+        struct RString *output = RSTRING(mrb_str_new(mrb, NULL, 0));
+        dec_s_decode_full(mrb, RSTR_PTR(input), RSTR_LEN(input), output, FALSE, (size_t)-1, &params);
+        mrb_ary_push(mrb, results, VALUE(output));
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return results;
+}
+
+static void
+init_decoder(MRB, struct RClass *mBrotli)
+{
+    struct RClass *cDecoder = mrb_define_class_under(mrb, mBrotli, "Decoder", mrb_cObject);
+    mrb_define_class_under(mrb, mBrotli, "MemoryLimitError", E_RUNTIME_ERROR);
+    mrb_define_class_under(mrb, mBrotli, "BufferView", mrb->string_class);
+    mrb_define_class_method(mrb, cDecoder, "decode", dec_s_decode, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cDecoder, "decode_batch", dec_s_decode_batch, MRB_ARGS_ANY());
+    mrb_define_class_method(mrb, cDecoder, "new", dec_s_new, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDecoder, "initialize", dec_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDecoder, "decode", dec_decode, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cDecoder, "feed", dec_feed, MRB_ARGS_OPT(3));
+    mrb_define_method(mrb, cDecoder, "each_chunk", dec_each_chunk, MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cDecoder, "needs_input?", dec_needs_input, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "has_output?", dec_has_output, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "result", dec_result, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "finish", dec_finish, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "reset", dec_reset, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cDecoder, "finished?", dec_is_finished, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "total_in", dec_total_in, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "total_out", dec_total_out, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "inport", dec_get_inport, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cDecoder, "stats", dec_stats, MRB_ARGS_NONE());
+    //mrb_define_method(mrb, cDecoder, "inport=", dec_set_inport, MRB_ARGS_ARG(1));
+}
+
+/* Brotli.compress_file / Brotli.decompress_file */
+
+/*
+ * Works on the file descriptors directly. No mruby object is made per chunk;
+ * the output of libbrotli is written out as is by BrotliXXXTakeOutput().
+ *
+ * The output is written into a new ``dstpath.XXXXXX.tmp`` and renamed to
+ * ``dstpath`` on success, so an existing destination is kept when the
+ * processing fails.
+ */
+struct file_stream
+{
+    const char *srcpath;
+    const char *dstpath;
+    char *tmppath;
+    int src;
+    int dst;
+    char *inbuf;
+    const uint8_t *next_in;
+    size_t avail_in;
+    mrb_bool eof;
+    mrb_bool done;
+    uint64_t total_in;
+    uint64_t total_out;
+};
+
+static int
+aux_rename(const char *from, const char *to)
+{
+#ifdef _WIN32
+    return (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1);
+#else
+    return rename(from, to);
+#endif
+}
+
+#define AUX_TMPFILE_SUFFIX_SIZE 12   /* ".XXXXXX.tmp" with NUL */
+
+/*
+ * Creates a new file for writing, whose name is ``path`` followed by
+ * ``.XXXXXX.tmp``. The suffix is written at ``path[len]``, so ``path`` needs
+ * AUX_TMPFILE_SUFFIX_SIZE more bytes.
+ *
+ * An existing file is never opened (O_EXCL), so the files of other processes
+ * and of the user are not clobbered. The name is mixed from the pid, the time
+ * and the buffer address to be distinct between threads without shared state.
+ */
+static int
+aux_create_tmpfile(char *path, size_t len)
+{
+#ifdef _WIN32
+    unsigned long seed = (unsigned long)GetCurrentProcessId();
+#else
+    unsigned long seed = (unsigned long)getpid();
+#endif
+    seed = seed * 2654435761UL ^ (unsigned long)time(NULL) ^ (unsigned long)(uintptr_t)path ^ (unsigned long)clock();
+
+    for (int i = 0; i < 100; i++) {
+        seed = seed * 1103515245UL + 12345UL;
+        snprintf(path + len, AUX_TMPFILE_SUFFIX_SIZE, ".%06lx.tmp", (seed >> 8) & 0xffffffUL);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+static void
+file_stream_open(MRB, struct file_stream *f, const char *srcpath, const char *dstpath)
+{
+    memset(f, 0, sizeof(*f));
+    f->srcpath = srcpath;
+    f->dstpath = dstpath;
+    f->dst = -1;
+
+    f->src = open(srcpath, O_RDONLY | O_BINARY);
+    if (f->src < 0) { mrb_sys_fail(mrb, srcpath); }
+
+    struct stat srcst, dstst;
+    if (fstat(f->src, &srcst) == 0 && stat(dstpath, &dstst) == 0 &&
+            srcst.st_dev == dstst.st_dev && srcst.st_ino == dstst.st_ino) {
+        close(f->src);
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "source and destination are the same file - %S",
+                   mrb_str_new_cstr(mrb, dstpath));
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(f->src, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    size_t len = strlen(dstpath);
+    f->tmppath = (char *)mrb_malloc_simple(mrb, len + AUX_TMPFILE_SUFFIX_SIZE);
+    f->inbuf = (char *)mrb_malloc_simple(mrb, EXT_FILE_BUFFER_SIZE);
+    if (!f->tmppath || !f->inbuf) {
+        close(f->src);
+        mrb_free(mrb, f->tmppath);
+        mrb_free(mrb, f->inbuf);
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed allocation for file buffer");
+    }
+    memcpy(f->tmppath, dstpath, len);
+
+    f->dst = aux_create_tmpfile(f->tmppath, len);
+    if (f->dst < 0) {
+        int err = errno;
+        close(f->src);
+        mrb_free(mrb, f->inbuf);
+        VALUE path = mrb_str_new_cstr(mrb, f->tmppath);
+        mrb_free(mrb, f->tmppath);
+        errno = err;
+        mrb_sys_fail(mrb, RSTRING_PTR(path));
+    }
+}
+
+/*
+ * Replaces the destination with the written file.
+ */
+static void
+file_stream_commit(MRB, struct file_stream *f)
+{
+    int dst = f->dst;
+    f->dst = -1;
+
+    if (close(dst) != 0 || aux_rename(f->tmppath, f->dstpath) != 0) {
+        mrb_sys_fail(mrb, f->dstpath);
+    }
+
+    f->done = TRUE;
+}
+
+static void
+file_stream_close(MRB, struct file_stream *f)
+{
+    close(f->src);
+    if (f->dst >= 0) { close(f->dst); }
+
+    /* the output of failed compression or decompression is not left */
+    if (!f->done) { unlink(f->tmppath); }
+
+    mrb_free(mrb, f->tmppath);
+    mrb_free(mrb, f->inbuf);
+}
+
+static uint64_t
+file_stream_size(struct file_stream *f)
+{
+    struct stat st;
+
+    if (fstat(f->src, &st) != 0 || st.st_size < 0) { return 0; }
+
+    return (uint64_t)st.st_size;
+}
+
+/*
+ * Fills the input buffer if it is empty.
+ */
+static void
+file_stream_read(MRB, struct file_stream *f)
+{
+    if (f->avail_in > 0 || f->eof) { return; }
+
+    for (;;) {
+        ssize_t n = read(f->src, f->inbuf, EXT_FILE_BUFFER_SIZE);
+
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            mrb_sys_fail(mrb, f->srcpath);
+        }
+
+        f->next_in = (const uint8_t *)f->inbuf;
+        f->avail_in = (size_t)n;
+        f->total_in += (size_t)n;
+        if (n == 0) { f->eof = TRUE; }
+
+        return;
+    }
+}
+
+static void
+file_stream_write(MRB, struct file_stream *f, const uint8_t *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(f->dst, buf, MIN(size, (size_t)SSIZE_MAX));
+
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            mrb_sys_fail(mrb, f->dstpath);
+        }
+
+        buf += n;
+        size -= (size_t)n;
+        f->total_out += (size_t)n;
+    }
+}
+
+struct file_encoder
+{
+    struct file_stream file;
+    struct encoder_params *params;
+    struct bufpool *pool;
+    BrotliEncoderState *brotli;
+};
+
+static VALUE
+file_compress_try(MRB, VALUE args)
+{
+    struct file_encoder *argp = (struct file_encoder *)mrb_cptr(args);
+    struct file_stream *f = &argp->file;
+
+    argp->pool = bufpool_ref(bufpool_get(mrb));
+    argp->brotli = aux_encoder_create_instance(mrb, argp->pool);
+    if (!argp->brotli) {
+        mrb_raise(mrb, E_RUNTIME_ERROR,
+                  "failed BrotliEncoderCreateInstance (may be out of memory)");
+    }
+
+    argp->params->size_hint = (mrb_int)MIN(file_stream_size(f), (uint64_t)UINT32_MAX);
+    encoder_params_apply(mrb, argp->brotli, argp->params);
+
+    mrb_bool first = TRUE;
+    for (;;) {
+        file_stream_read(mrb, f);
+
+        if (first) {
+            if (aux_encoder_check_incompressible(argp->brotli, argp->params, (const char *)f->next_in, f->avail_in)) {
+                argp->pool->stats.incompressible ++;
+            }
+            first = FALSE;
+        }
+
+        size_t avail_out = 0;
+        if (!BrotliEncoderCompressStream(argp->brotli,
+                                         (f->eof ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS),
+                                         &f->avail_in, &f->next_in, &avail_out, NULL, NULL)) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "failed BrotliEncoderCompressStream()");
+        }
+
+        while (BrotliEncoderHasMoreOutput(argp->brotli)) {
+            size_t size = 0;
+            const uint8_t *out = BrotliEncoderTakeOutput(argp->brotli, &size);
+            file_stream_write(mrb, f, out, size);
+        }
+
+        if (f->eof && BrotliEncoderIsFinished(argp->brotli)) { break; }
+    }
+
+    file_stream_commit(mrb, f);
+
+    return Qnil;
+}
+
+static VALUE
+file_compress_cleanup(MRB, VALUE args)
+{
+    struct file_encoder *argp = (struct file_encoder *)mrb_cptr(args);
+
+    if (argp->brotli) { BrotliEncoderDestroyInstance(argp->brotli); }
+    if (argp->pool) { bufpool_unref(argp->pool); }
+    file_stream_close(mrb, &argp->file);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  compress_file(srcpath, dstpath, **opts) -> compressed size
+ *
+ * [opts]
+ *  Same as Brotli.encode, except ``threads`` (must be nil or 1).
+ */
+static VALUE
+file_s_compress(MRB, VALUE self)
+{
+    const char *srcpath, *dstpath;
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "zz|H", &srcpath, &dstpath, &opts);
+
+    struct encoder_params params;
+    int threads = 1;
+    encoder_params_init(&params);
+    if (!NIL_P(opts)) {
+        enc_s_encode_scan_opts(mrb, opts, &params, &threads, NULL);
+    }
+
+    if (threads != 1) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "threads is not supported by Brotli.compress_file");
+    }
+
+    struct file_encoder args = { { 0 }, &params, NULL, NULL };
+    file_stream_open(mrb, &args.file, srcpath, dstpath);
+
+    mrb_ensure(mrb,
+               file_compress_try, mrb_cptr_value(mrb, &args),
+               file_compress_cleanup, mrb_cptr_value(mrb, &args));
+
+    return aux_uint64_value(mrb, args.file.total_out);
+}
+
+struct file_decoder
+{
+    struct file_stream file;
+    const struct decoder_params *params;
+    struct memcap cap;
+    BrotliDecoderState *brotli;
+};
+
+static VALUE
+file_decompress_try(MRB, VALUE args)
+{
+    struct file_decoder *argp = (struct file_decoder *)mrb_cptr(args);
+    struct file_stream *f = &argp->file;
+
+    argp->brotli = dec_s_create_instance(mrb, &argp->cap, argp->params);
+
+    for (;;) {
+        file_stream_read(mrb, f);
+
+        size_t avail_out = 0;
+        BrotliDecoderResult ok = BrotliDecoderDecompressStream(argp->brotli, &f->avail_in, &f->next_in, &avail_out, NULL, NULL);
+
+        while (BrotliDecoderHasMoreOutput(argp->brotli)) {
+            size_t size = 0;
+            const uint8_t *out = BrotliDecoderTakeOutput(argp->brotli, &size);
+            file_stream_write(mrb, f, out, size);
+        }
+
+        switch (ok) {
+        case BROTLI_DECODER_RESULT_SUCCESS:
+            file_stream_read(mrb, f);
+            if (f->avail_in > 0) {
+                mrb_raise(mrb, E_RUNTIME_ERROR, "unexpected data after the end of stream");
+            }
+            file_stream_commit(mrb, f);
+            return Qnil;
+        case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+            break;
+        case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+            if (f->eof) {
+                mrb_raise(mrb, E_RUNTIME_ERROR, "unexpected end of stream");
+            }
+            break;
+        default:
+            memcap_check(mrb, &argp->cap);
+            aux_brotli_decoder_error(mrb, ok, BrotliDecoderGetErrorCode(argp->brotli), argp->params->large_window);
+        }
+    }
+}
+
+static VALUE
+file_decompress_cleanup(MRB, VALUE args)
+{
+    struct file_decoder *argp = (struct file_decoder *)mrb_cptr(args);
+
+    if (argp->brotli) { dec_s_destroy_instance(mrb, &argp->cap, argp->brotli); }
+    file_stream_close(mrb, &argp->file);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  decompress_file(srcpath, dstpath, large_window: false, disable_ring_buffer_reallocation: false,
+ *                  max_memory: nil, dictionary: nil) -> decompressed size
+ */
+static VALUE
+file_s_decompress(MRB, VALUE self)
+{
+    const char *srcpath, *dstpath;
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "zz|H", &srcpath, &dstpath, &opts);
+
+    struct decoder_params params;
+    decoder_params_init(&params);
+    if (!NIL_P(opts)) {
+        VALUE large_window, disable_rbr, max_memory, dictionary;
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("large_window", &large_window, Qfalse),
+                MRBX_SCANHASH_ARGS("disable_ring_buffer_reallocation", &disable_rbr, Qfalse),
+                MRBX_SCANHASH_ARGS("max_memory", &max_memory, Qnil),
+                MRBX_SCANHASH_ARGS("dictionary", &dictionary, Qnil));
+
+        decoder_params_scan(mrb, Qnil, large_window, disable_rbr, max_memory, dictionary, &params);
+    }
+
+    struct file_decoder args;
+    args.params = &params;
+    args.brotli = NULL;
+    file_stream_open(mrb, &args.file, srcpath, dstpath);
+
+    mrb_ensure(mrb,
+               file_decompress_try, mrb_cptr_value(mrb, &args),
+               file_decompress_cleanup, mrb_cptr_value(mrb, &args));
+
+    return aux_uint64_value(mrb, args.file.total_out);
+}
+
+static void
+init_file(MRB, struct RClass *mBrotli)
+{
+    mrb_define_class_method(mrb, mBrotli, "compress_file", file_s_compress, MRB_ARGS_ARG(2, 1));
+    mrb_define_class_method(mrb, mBrotli, "decompress_file", file_s_decompress, MRB_ARGS_ARG(2, 1));
+}
+
+/* module Brotli */
+
+/* class Brotli::Pool */
+
+#ifdef HAVE_THREAD
+enum pool_job_state
+{
+    POOL_JOB_QUEUED,
+    POOL_JOB_RUNNING,
+    POOL_JOB_DONE,
+    POOL_JOB_CANCELLED,
+};
+
+/*
+ * A job is shared by the pool and the future, and it is freed by whichever
+ * releases it last. It is allocated by malloc(), since a worker may free it.
+ */
+struct pool_job
+{
+    struct pool_job *next;
+    int refs;                   /* the pool while queued or running, and the future */
+    enum pool_job_state state;
+    mrb_bool decode;
+    char *input;                /* copied input */
+    struct encoder_params eparams;
+    struct decoder_params dparams;
+    union {
+        struct enc_s_encode_chunk enc;
+        struct dec_s_decode_item dec;
+    } u;
+};
+
+struct pool_core
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;      /* signaled when a job is queued, or at shutdown */
+    pthread_cond_t done;        /* broadcasted when a job is done */
+    struct pool_job *head;
+    struct pool_job *tail;
+    size_t pending;             /* queued and running jobs */
+    int refs;                   /* the pool object and the futures */
+    mrb_bool shutdown;
+    int nthreads;
+    pthread_t threads[AUX_BATCH_MAX_THREADS];
+};
+
+/* must be called with the lock of the core */
+static void
+pool_job_unref(struct pool_job *job)
+{
+    if (-- job->refs > 0) { return; }
+
+    free(job->decode ? job->u.dec.output : job->u.enc.output);
+    free(job->input);
+    free(job);
+}
+
+static void *
+pool_worker(void *user)
+{
+    struct pool_core *core = (struct pool_core *)user;
+
+    pthread_mutex_lock(&core->mutex);
+
+    for (;;) {
+        while (!core->head && !core->shutdown) {
+            pthread_cond_wait(&core->queued, &core->mutex);
+        }
+
+        if (core->shutdown) { break; }
+
+        struct pool_job *job = core->head;
+        core->head = job->next;
+        if (!core->head) { core->tail = NULL; }
+        job->state = POOL_JOB_RUNNING;
+
+        pthread_mutex_unlock(&core->mutex);
+
+        if (job->decode) {
+            dec_s_decode_item(&job->u.dec);
+        } else {
+            enc_s_encode_chunk(&job->u.enc);
+        }
+
+        pthread_mutex_lock(&core->mutex);
+        job->state = POOL_JOB_DONE;
+        core->pending --;
+        pool_job_unref(job);
+        pthread_cond_broadcast(&core->done);
+    }
+
+    pthread_mutex_unlock(&core->mutex);
+
+    return NULL;
+}
+
+/*
+ * Cancels the queued jobs, and waits for the running jobs.
+ */
+static void
+pool_core_shutdown(struct pool_core *core)
+{
+    pthread_mutex_lock(&core->mutex);
+
+    core->shutdown = TRUE;
+
+    while (core->head) {
+        struct pool_job *job = core->head;
+        core->head = job->next;
+        job->state = POOL_JOB_CANCELLED;
+        core->pending --;
+        pool_job_unref(job);
+    }
+    core->tail = NULL;
+
+    pthread_cond_broadcast(&core->queued);
+    pthread_cond_broadcast(&core->done);
+    pthread_mutex_unlock(&core->mutex);
+
+    int i;
+    for (i = 0; i < core->nthreads; i ++) {
+        pthread_join(core->threads[i], NULL);
+    }
+    core->nthreads = 0;
+}
+
+static void
+pool_core_unref(MRB, struct pool_core *core)
+{
+    pthread_mutex_lock(&core->mutex);
+    int refs = -- core->refs;
+    pthread_mutex_unlock(&core->mutex);
+
+    if (refs > 0) { return; }
+
+    pthread_cond_destroy(&core->done);
+    pthread_cond_destroy(&core->queued);
+    pthread_mutex_destroy(&core->mutex);
+    mrb_free(mrb, core);
+}
+
+static void
+pool_free(MRB, struct pool_core *core)
+{
+    if (core) {
+        pool_core_shutdown(core);
+        pool_core_unref(mrb, core);
+    }
+}
+
+static const mrb_data_type pool_type = {
+    .struct_name = "pool@mruby-brotli",
+    .dfree = (void (*)(mrb_state *, void *))pool_free,
+};
+
+static struct pool_core *
+getpool(MRB, VALUE self)
+{
+    return (struct pool_core *)mrbx_getref(mrb, self, &pool_type);
+}
+
+struct future
+{
+    struct pool_core *core;
+    struct pool_job *job;
+};
+
+static void
+future_free(MRB, struct future *p)
+{
+    if (p) {
+        if (p->job) {
+            pthread_mutex_lock(&p->core->mutex);
+            pool_job_unref(p->job);
+            pthread_mutex_unlock(&p->core->mutex);
+        }
+
+        if (p->core) {
+            pool_core_unref(mrb, p->core);
+        }
+
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type future_type = {
+    .struct_name = "future@mruby-brotli",
+    .dfree = (void (*)(mrb_state *, void *))future_free,
+};
+
+static struct future *
+getfuture(MRB, VALUE self)
+{
+    return (struct future *)mrbx_getref(mrb, self, &future_type);
+}
+
+static int
+aux_online_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > 0) {
+        return (int)MIN(n, (long)AUX_BATCH_MAX_THREADS);
+    }
+#endif
+
+    return 1;
+}
+
+static VALUE
+pool_s_new(MRB, VALUE self)
+{
+    struct RData *rd = mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &pool_type);
+    VALUE obj = VALUE(rd);
+
+    mrbx_funcall_passthrough(mrb, obj, id_initialize);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  new(threads: nil) -> pool
+ *
+ * Starts ``threads`` native workers, or as many as the online CPUs if nil.
+ */
+static VALUE
+pool_initialize(MRB, VALUE self)
+{
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "|H", &opts);
+
+    if (DATA_PTR(self)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "already initialized - %S", self);
+    }
+
+    int threads = aux_online_cpus();
+    if (!NIL_P(opts)) {
+        VALUE threads_v;
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("threads", &threads_v, Qnil));
+
+        if (!NIL_P(threads_v)) {
+            threads = convert_to_threads(mrb, threads_v);
+        }
+    }
+
+    struct pool_core *core = (struct pool_core *)mrb_calloc(mrb, 1, sizeof(struct pool_core));
+    pthread_mutex_init(&core->mutex, NULL);
+    pthread_cond_init(&core->queued, NULL);
+    pthread_cond_init(&core->done, NULL);
+    core->refs = 1;
+    DATA_PTR(self) = core;
+
+    for (; core->nthreads < threads; core->nthreads ++) {
+        if (pthread_create(&core->threads[core->nthreads], NULL, pool_worker, core) != 0) {
+            break;
+        }
+    }
+
+    if (core->nthreads == 0) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed pthread_create()");
+    }
+
+    return self;
+}
+
+/*
+ * Queues the job and returns a future. The input is always copied, since the
+ * job may outlive the future and the string.
+ */
+static VALUE
+pool_submit(MRB, VALUE self, struct pool_core *core, struct pool_job *job, VALUE input)
+{
+    struct RClass *cFuture = mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Future");
+    struct RData *rd;
+    struct future *f;
+    Data_Make_Struct(mrb, cFuture, struct future, &future_type, f, rd);
+    VALUE future = VALUE(rd);
+    const char *ptr = RSTRING_PTR(input);
+    size_t len = RSTRING_LEN(input);
+
+    job->input = (char *)malloc(len > 0 ? len : 1);
+    if (!job->input) {
+        free(job);
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed allocation for the input");
+    }
+    memcpy(job->input, ptr, len);
+    ptr = job->input;
+
+    if (job->decode) {
+        job->u.dec.params = &job->dparams;
+        job->u.dec.input = ptr;
+        job->u.dec.insize = len;
+    } else {
+        job->u.enc.params = &job->eparams;
+        job->u.enc.input = ptr;
+        job->u.enc.insize = len;
+        job->u.enc.op = BROTLI_OPERATION_FINISH;
+    }
+
+    pthread_mutex_lock(&core->mutex);
+
+    if (core->shutdown) {
+        pthread_mutex_unlock(&core->mutex);
+        free(job->input);
+        free(job);
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "pool is already shut down - %S", self);
+    }
+
+    job->refs = 2;
+    job->state = POOL_JOB_QUEUED;
+    if (core->tail) {
+        core->tail->next = job;
+    } else {
+        core->head = job;
+    }
+    core->tail = job;
+    core->pending ++;
+    core->refs ++;
+    f->core = core;
+    f->job = job;
+
+    pthread_cond_signal(&core->queued);
+    pthread_mutex_unlock(&core->mutex);
+
+    return future;
+}
+
+/*
+ * call-seq:
+ *  submit_encode(input, **opts) -> future
+ *
+ * Compresses the string on a worker with the options of Brotli.encode,
+ * except ``threads`` and ``dictionary``.
+ */
+static VALUE
+pool_submit_encode(MRB, VALUE self)
+{
+    VALUE input, opts = Qnil;
+    mrb_get_args(mrb, "S|H", &input, &opts);
+
+    struct pool_core *core = getpool(mrb, self);
+    struct encoder_params params;
+    int threads = 1;
+    encoder_params_init(&params);
+    if (!NIL_P(opts)) {
+        enc_s_encode_scan_opts(mrb, opts, &params, &threads, NULL);
+    }
+
+    if (params.dict) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "dictionary is not supported by Brotli::Pool");
+    }
+
+    struct pool_job *job = (struct pool_job *)calloc(1, sizeof(struct pool_job));
+    if (!job) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed allocation for the job");
+    }
+    job->eparams = params;
+
+    return pool_submit(mrb, self, core, job, input);
+}
+
+/*
+ * call-seq:
+ *  submit_decode(input, large_window: false, disable_ring_buffer_reallocation: false) -> future
+ */
+static VALUE
+pool_submit_decode(MRB, VALUE self)
+{
+    VALUE input, opts = Qnil;
+    mrb_get_args(mrb, "S|H", &input, &opts);
+
+    struct pool_core *core = getpool(mrb, self);
+    struct decoder_params params;
+    decoder_params_init(&params);
+    if (!NIL_P(opts)) {
+        VALUE large_window, disable_rbr;
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("large_window", &large_window, Qfalse),
+                MRBX_SCANHASH_ARGS("disable_ring_buffer_reallocation", &disable_rbr, Qfalse));
+
+        decoder_params_scan(mrb, Qnil, large_window, disable_rbr, Qnil, Qnil, &params);
+    }
+
+    struct pool_job *job = (struct pool_job *)calloc(1, sizeof(struct pool_job));
+    if (!job) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed allocation for the job");
+    }
+    job->decode = TRUE;
+    job->dparams = params;
+
+    return pool_submit(mrb, self, core, job, input);
+}
+
+static VALUE
+pool_threads(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return mrb_fixnum_value(getpool(mrb, self)->nthreads);
+}
+
+/*
+ * call-seq:
+ *  pending -> integer
+ *
+ * Returns the number of the queued and running jobs.
+ */
+static VALUE
+pool_pending(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct pool_core *core = getpool(mrb, self);
+    pthread_mutex_lock(&core->mutex);
+    size_t n = core->pending;
+    pthread_mutex_unlock(&core->mutex);
+
+    return aux_uint64_value(mrb, n);
+}
+
+/*
+ * call-seq:
+ *  shutdown -> nil
+ *
+ * Cancels the queued jobs, and waits for the running jobs and the workers.
+ */
+static VALUE
+pool_shutdown(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    pool_core_shutdown(getpool(mrb, self));
+
+    return Qnil;
+}
+
+static VALUE
+pool_is_shutdown(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    return (getpool(mrb, self)->shutdown ? Qtrue : Qfalse);
+}
+
+static void
+future_wait(struct future *p)
+{
+    pthread_mutex_lock(&p->core->mutex);
+    while (p->job->state == POOL_JOB_QUEUED || p->job->state == POOL_JOB_RUNNING) {
+        pthread_cond_wait(&p->core->done, &p->core->mutex);
+    }
+    pthread_mutex_unlock(&p->core->mutex);
+}
+
+static VALUE
+future_is_ready(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct future *p = getfuture(mrb, self);
+    pthread_mutex_lock(&p->core->mutex);
+    mrb_bool ready = (p->job->state == POOL_JOB_DONE || p->job->state == POOL_JOB_CANCELLED);
+    pthread_mutex_unlock(&p->core->mutex);
+
+    return (ready ? Qtrue : Qfalse);
+}
+
+/*
+ * call-seq:
+ *  wait -> self
+ */
+static VALUE
+future_wait_m(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    future_wait(getfuture(mrb, self));
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  value -> string
+ *
+ * Waits for the job, and returns the result or raises the error of the job.
+ * The output of the worker is moved into a string object at the first call.
+ */
+static VALUE
+future_value(MRB, VALUE self)
+{
+    mrb_get_args(mrb, "");
+
+    struct future *p = getfuture(mrb, self);
+    struct pool_job *job = p->job;
+
+    future_wait(p);
+
+    VALUE value = mrb_iv_get(mrb, self, SYMBOL("value@mruby-brotli"));
+    if (!NIL_P(value)) {
+        return value;
+    }
+
+    /* the job is no longer touched by the workers */
+    if (job->state == POOL_JOB_CANCELLED) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "job is cancelled by Brotli::Pool#shutdown");
+    }
+
+    if (job->decode) {
+        if (job->u.dec.result != BROTLI_DECODER_RESULT_SUCCESS) {
+            aux_brotli_decoder_error(mrb, job->u.dec.result, job->u.dec.err, job->dparams.large_window);
+        }
+
+        value = mrb_str_new(mrb, job->u.dec.output, job->u.dec.outsize);
+        free(job->u.dec.output);
+        job->u.dec.output = NULL;
+    } else {
+        if (!job->u.enc.ok) {
+            mrb_raise(mrb, E_RUNTIME_ERROR, "failed BrotliEncoderCompress");
+        }
+
+        value = mrb_str_new(mrb, job->u.enc.output, job->u.enc.outsize);
+        free(job->u.enc.output);
+        job->u.enc.output = NULL;
+    }
+
+    mrb_iv_set(mrb, self, SYMBOL("value@mruby-brotli"), value);
+
+    return value;
+}
+#else
+static VALUE
+pool_s_new(MRB, VALUE self)
+{
+    mrb_raise(mrb, E_NOTIMP_ERROR, "Brotli::Pool is not available without threads (MRUBY_BROTLI_WITHOUT_THREAD)");
+}
+#endif
+
+static void
+init_pool(MRB, struct RClass *mBrotli)
+{
+    struct RClass *cPool = mrb_define_class_under(mrb, mBrotli, "Pool", mrb_cObject);
+    mrb_define_class_method(mrb, cPool, "new", pool_s_new, MRB_ARGS_ANY());
+
+#ifdef HAVE_THREAD
+    mrb_define_method(mrb, cPool, "initialize", pool_initialize, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cPool, "submit_encode", pool_submit_encode, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cPool, "submit_decode", pool_submit_decode, MRB_ARGS_ANY());
+    mrb_define_method(mrb, cPool, "threads", pool_threads, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cPool, "pending", pool_pending, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cPool, "shutdown", pool_shutdown, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cPool, "shutdown?", pool_is_shutdown, MRB_ARGS_NONE());
+
+    struct RClass *cFuture = mrb_define_class_under(mrb, cPool, "Future", mrb_cObject);
+    mrb_define_method(mrb, cFuture, "ready?", future_is_ready, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFuture, "wait", future_wait_m, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cFuture, "value", future_value, MRB_ARGS_NONE());
+#endif
 }
 
-struct dec_decode_full_growup
+/* Brotli.precompress_tree */
+
+enum precompress_status
 {
-    VALUE self;
-    struct decoder *decoder;
+    PRECOMPRESS_COMPRESSED,
+    PRECOMPRESS_FRESH,          /* the .br is newer than the file */
+    PRECOMPRESS_UNCHANGED,      /* the .br has the same content, and it is touched */
+    PRECOMPRESS_SMALL,          /* smaller than ``min_size`` */
+    PRECOMPRESS_NO_GAIN,        /* the output does not beat ``min_gain`` */
+    PRECOMPRESS_ERROR,
 };
 
-static ssize_t
-dec_decode_full_growup(MRB, char *ptr, size_t *size, void *user)
-{
-    struct dec_decode_full_growup *argp = user;
+struct precompress;
 
-    *size = dec_decode_partial(mrb, argp->self, argp->decoder, ptr, *size);
+struct precompress_item
+{
+    const struct precompress *config;
+    char *path;
+    enum precompress_status status;
+    int err;                    /* errno of PRECOMPRESS_ERROR */
+    uint64_t insize;
+    uint64_t outsize;
+};
 
-    if (*size == 0) {
-        return MRBX_STOP;
-    } else {
-        return MRBX_NEXT;
-    }
-}
+struct precompress
+{
+    const char *dir;
+    struct precompress_item *items;
+    size_t nitems;
+    size_t capa;
+    int quality;
+    int lgwin;
+    int mode;
+    int threads;
+    uint64_t min_size;
+    double min_gain;
+};
 
-static ssize_t
-dec_decode_full(MRB, VALUE self, struct decoder *p, struct RString *dest)
+#ifdef HAVE_DIRENT
+static char *
+aux_path_join(const char *a, const char *b)
 {
-    struct dec_decode_full_growup args = { self, p };
+    size_t alen = strlen(a), blen = strlen(b);
+    char *path = (char *)malloc(alen + blen + 2);
 
-    mrbx_str_buf_growup(mrb, dest, -1, NULL, dec_decode_full_growup, &args);
+    if (path) {
+        memcpy(path, a, alen);
+        path[alen] = '/';
+        memcpy(path + alen + 1, b, blen + 1);
+    }
 
-    return RSTR_LEN(dest);
+    return path;
 }
 
-static VALUE
-dec_decode(MRB, VALUE self)
+static mrb_bool
+aux_has_suffix(const char *str, const char *suffix)
 {
-    struct decoder *p = getdecoder(mrb, self);
+    size_t len = strlen(str), slen = strlen(suffix);
 
-    ssize_t size;
-    struct RString *dest;
-    dec_decode_args(mrb, self, &size, &dest);
+    return (len >= slen && strcmp(str + len - slen, suffix) == 0);
+}
 
-    if (size == 0) {
-        return VALUE(dest);
-    }
+/*
+ * Tells whether the name is of a temporary file of precompress_item(), i.e.
+ * ``*.br.XXXXXX.tmp`` with six hexadecimal digits.
+ */
+static mrb_bool
+aux_is_br_tmpfile(const char *name)
+{
+    size_t len = strlen(name);
 
-    if (p->status <= BROTLI_DECODER_RESULT_SUCCESS) {
-        return Qnil;
+    if (len < 15 || strcmp(name + len - 4, ".tmp") != 0 ||
+            strncmp(name + len - 14, ".br.", 4) != 0) {
+        return FALSE;
     }
 
-    if (size < 0) {
-        size = dec_decode_full(mrb, self, p, dest);
-    } else {
-        size = dec_decode_partial(mrb, self, p, RSTR_PTR(dest), size);
-        mrbx_str_set_len(mrb, dest, size);
+    for (size_t i = len - 10; i < len - 4; i++) {
+        if (!strchr("0123456789abcdef", name[i])) { return FALSE; }
     }
 
-    if (size > 0) {
-        return VALUE(dest);
-    } else {
-        return Qnil;
-    }
+    return TRUE;
 }
 
-static VALUE
-dec_finish(MRB, VALUE self)
+/*
+ * Reads the whole file into a buffer of malloc(). It can be called without
+ * mruby VM. Returns NULL and sets errno on failure.
+ */
+static char *
+aux_read_file(const char *path, size_t size)
 {
-    mrb_get_args(mrb, "");
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) { return NULL; }
 
-    getdecoder(mrb, self)->status = BROTLI_DECODER_RESULT_SUCCESS;
+    char *buf = (char *)malloc(size > 0 ? size : 1);
+    size_t off = 0;
 
-    return Qnil;
-}
+    while (buf && off < size) {
+        ssize_t n = read(fd, buf + off, size - off);
 
-static VALUE
-dec_is_finished(MRB, VALUE self)
-{
-    mrb_get_args(mrb, "");
+        if (n < 0 && errno == EINTR) { continue; }
 
-    return (getdecoder(mrb, self)->status <= BROTLI_DECODER_RESULT_SUCCESS ? Qtrue : Qfalse);
-}
+        if (n <= 0) {
+            int err = (n < 0 ? errno : EIO); /* the file is truncated */
+            free(buf);
+            buf = NULL;
+            errno = err;
+            break;
+        }
 
-static VALUE
-dec_total_in(MRB, VALUE self)
-{
-    mrb_get_args(mrb, "");
+        off += (size_t)n;
+    }
 
-    return mrb_fixnum_value(mrbx_fakedin_total_in(mrb, getdecoder(mrb, self)->inport));
+    int err = errno;
+    close(fd);
+    errno = err;
+
+    return buf;
 }
 
-static VALUE
-dec_total_out(MRB, VALUE self)
+/*
+ * Writes the buffer into a new temporary file named by aux_create_tmpfile().
+ * The file is removed on failure.
+ */
+static int
+aux_write_tmpfile(char *path, size_t len, const char *buf, size_t size)
 {
-    mrb_get_args(mrb, "");
+    int fd = aux_create_tmpfile(path, len);
+    if (fd < 0) { return -1; }
+
+    size_t off = 0;
+    while (off < size) {
+        ssize_t n = write(fd, buf + off, size - off);
+
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            int err = errno;
+            close(fd);
+            unlink(path);
+            errno = err;
+            return -1;
+        }
 
-    return mrb_fixnum_value(getdecoder(mrb, self)->total_out);
-}
+        off += (size_t)n;
+    }
 
-static VALUE
-dec_get_inport(MRB, VALUE self)
-{
-    mrb_get_args(mrb, "");
+    if (close(fd) != 0) {
+        int err = errno;
+        unlink(path);
+        errno = err;
+        return -1;
+    }
 
-    return mrbx_fakedin_stream(mrb, getdecoder(mrb, self)->inport);
+    return 0;
 }
 
-static void
-dec_s_decode_args(MRB, VALUE self, struct RString **input, struct RString **output, size_t *outsize, mrb_bool *partial)
+/*
+ * Runs on a native thread without mruby VM; the memory is given by malloc().
+ */
+static void *
+precompress_item(void *user)
 {
-    mrb_int argc;
-    VALUE *argv;
-    mrb_get_args(mrb, "*", &argv, &argc);
+    struct precompress_item *item = (struct precompress_item *)user;
+    const struct precompress *pc = item->config;
+    char *brpath = NULL, *tmppath = NULL, *input = NULL, *output = NULL;
+    struct stat st, brst;
 
-    VALUE is_partial;
-    if (argc > 0 && mrb_hash_p(argv[argc - 1])) {
-        MRBX_SCANHASH(mrb, argv[argc - 1], Qfalse,
-                MRBX_SCANHASH_ARG("partial", &is_partial, Qnil));
+    if (item->status == PRECOMPRESS_ERROR) { return NULL; }
 
-        argc --;
-    } else {
-        is_partial = Qnil;
+    item->status = PRECOMPRESS_ERROR;
+    brpath = (char *)malloc(strlen(item->path) + 8);
+    if (!brpath) { item->err = ENOMEM; goto done; }
+    strcpy(brpath, item->path);
+    strcat(brpath, ".br");
+
+    if (stat(item->path, &st) != 0) { item->err = errno; goto done; }
+    item->insize = (uint64_t)st.st_size;
+
+    mrb_bool has_br = (stat(brpath, &brst) == 0);
+
+    if (item->insize < pc->min_size) {
+        item->status = PRECOMPRESS_SMALL;
+        goto drop;
     }
 
-    switch (argc) {
-    case 1:
-        *outsize = (size_t)-1;
-        *output = NULL;
-        break;
-    case 2:
-        if (mrb_string_p(argv[1])) {
-            *outsize = (size_t)-1;
-            *output = RString(argv[1]);
-        } else {
-            *outsize = convert_to_size_t(mrb, argv[1]);
-            *output = NULL;
+    if (has_br && brst.st_mtime > st.st_mtime) {
+        item->status = PRECOMPRESS_FRESH;
+        item->outsize = (uint64_t)brst.st_size;
+        goto done;
+    }
+
+    if (item->insize > SIZE_MAX / 2) { item->err = EFBIG; goto done; }
+    input = aux_read_file(item->path, (size_t)item->insize);
+    if (!input) { item->err = errno; goto done; }
+
+    if (has_br && (uint64_t)brst.st_size <= SIZE_MAX / 2) {
+        /* decompression is much cheaper than compression at high quality */
+        char *old = aux_read_file(brpath, (size_t)brst.st_size);
+        size_t decsize = (size_t)item->insize + 1;
+        char *dec = (old ? (char *)malloc(decsize) : NULL);
+
+        if (dec &&
+                BrotliDecoderDecompress((size_t)brst.st_size, (const uint8_t *)old, &decsize, (uint8_t *)dec) == BROTLI_DECODER_RESULT_SUCCESS &&
+                decsize == item->insize && memcmp(dec, input, decsize) == 0 &&
+                utime(brpath, NULL) == 0) {
+            item->status = PRECOMPRESS_UNCHANGED;
+            item->outsize = (uint64_t)brst.st_size;
         }
-        break;
-    case 3:
-        *outsize = convert_to_size_t(mrb, argv[1]);
-        *output = RString(argv[2]);
-        break;
-    default:
-        mrb_raisef(mrb, E_ARGUMENT_ERROR,
-                   "wrong number arguments (given %S, expect 1 .. 3)",
-                   VALUE(argc));
+
+        free(dec);
+        free(old);
+
+        if (item->status == PRECOMPRESS_UNCHANGED) { goto done; }
     }
 
-    mrb_check_type(mrb, argv[0], MRB_TT_STRING);
-    *input = RSTRING(argv[0]);
+    size_t outsize = BrotliEncoderMaxCompressedSize((size_t)item->insize);
+    output = (outsize > 0 ? (char *)malloc(outsize) : NULL);
+    if (!output) { item->err = (outsize > 0 ? ENOMEM : EFBIG); goto done; }
 
-    if ((ssize_t)*outsize < 0) {
-        *output = mrbx_str_force_recycle(mrb, *output, EXT_PARTIAL_READ_SIZE);
-        *partial = RTEST(is_partial);
-    } else {
-        *output = mrbx_str_force_recycle(mrb, *output, *outsize);
-        *partial = NIL_P(is_partial) || RTEST(is_partial);
+    if (!BrotliEncoderCompress(pc->quality, pc->lgwin, (BrotliEncoderMode)pc->mode,
+                               (size_t)item->insize, (const uint8_t *)input,
+                               &outsize, (uint8_t *)output)) {
+        item->err = EINVAL;
+        goto done;
     }
 
-    mrbx_str_set_len(mrb, *output, 0);
-}
+    item->outsize = outsize;
 
-static void
-dec_s_decode_partial(MRB, const char *input, size_t insize, struct RString *output, size_t outsize, mrb_bool partial)
-{
-    BrotliDecoderState *brotli;
-    brotli = BrotliDecoderCreateInstance((brotli_alloc_func)mrb_malloc_simple, (brotli_free_func)mrb_free, mrb);
-    if (!brotli)
-    {
-        mrb_raise(mrb, E_RUNTIME_ERROR,
-                  "failed BrotliDecoderCreateInstance (may be out of memory)");
+    if (outsize >= item->insize || outsize > item->insize * (1.0 - pc->min_gain)) {
+        item->status = PRECOMPRESS_NO_GAIN;
+        goto drop;
     }
 
-    char *outp = RSTR_PTR(output);
-    size_t availout = outsize;
-    BrotliDecoderResult ok = BrotliDecoderDecompressStream(brotli, &insize, (const uint8_t **)&input, &availout, (uint8_t **)&outp, NULL);
-    BrotliDecoderDestroyInstance(brotli);
+    /* replaces the .br atomically */
+    size_t brlen = strlen(brpath);
+    tmppath = (char *)malloc(brlen + AUX_TMPFILE_SUFFIX_SIZE);
+    if (!tmppath) { item->err = ENOMEM; goto done; }
+    memcpy(tmppath, brpath, brlen);
+
+    if (aux_write_tmpfile(tmppath, brlen, output, outsize) != 0) { item->err = errno; goto done; }
+    if (rename(tmppath, brpath) != 0) {
+        item->err = errno;
+        unlink(tmppath);
+        goto done;
+    }
 
-    if (ok != BROTLI_DECODER_RESULT_SUCCESS &&
-            !(partial && ok == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT)) {
-        aux_brotli_decoder_error(mrb, ok);
+    item->status = PRECOMPRESS_COMPRESSED;
+    goto done;
+
+drop:
+    /* a stale .br must not be served for the new content */
+    if (has_br && unlink(brpath) != 0) {
+        item->status = PRECOMPRESS_ERROR;
+        item->err = errno;
     }
 
-    mrbx_str_set_len(mrb, output, outsize - availout);
+done:
+    free(output);
+    free(input);
+    free(tmppath);
+    free(brpath);
+
+    return NULL;
 }
 
-struct dec_s_decode_full_growup
+/*
+ * The memory is given by malloc() to be free from exceptions while the
+ * directories are opened.
+ */
+static struct precompress_item *
+precompress_push(struct precompress *pc, char *path)
 {
-    BrotliDecoderState *brotli;
-    const char *input;
-    size_t insize;
-    struct RString *output;
-    mrb_bool partial;
-};
+    if (pc->nitems >= pc->capa) {
+        size_t capa = (pc->capa > 0 ? pc->capa * 2 : 256);
+        struct precompress_item *items = (struct precompress_item *)realloc(pc->items, capa * sizeof(struct precompress_item));
+        if (!items) { return NULL; }
+        pc->items = items;
+        pc->capa = capa;
+    }
 
-static ssize_t
-dec_s_decode_full_growup(MRB, char *buf, size_t *size, void *user)
-{
-    struct dec_s_decode_full_growup *argp = user;
-    size_t outsize = *size;
+    struct precompress_item *item = &pc->items[pc->nitems ++];
+    memset(item, 0, sizeof(*item));
+    item->config = pc;
+    item->path = path;
 
-    BrotliDecoderResult ok;
-    ok = BrotliDecoderDecompressStream(argp->brotli, &argp->insize, (const uint8_t **)&argp->input, &outsize, (uint8_t **)&buf, NULL);
-    *size = *size - outsize;
+    return item;
+}
 
-    if (ok == BROTLI_DECODER_RESULT_SUCCESS) {
-        return MRBX_STOP;
+/*
+ * Collects the regular files under the directory, except *.br and the
+ * temporary files of precompress_item() running in other processes.
+ * Symbolic links to directories are not followed.
+ *
+ * Returns FALSE on memory exhaustion.
+ */
+static mrb_bool
+precompress_walk(struct precompress *pc, const char *dirpath)
+{
+    DIR *dir = opendir(dirpath);
+
+    if (!dir) {
+        int err = errno;
+        char *path = strdup(dirpath);
+        struct precompress_item *item = (path ? precompress_push(pc, path) : NULL);
+        if (!item) { free(path); return FALSE; }
+        item->status = PRECOMPRESS_ERROR;
+        item->err = err;
+        return TRUE;
     }
 
-    if (ok != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
-        aux_brotli_decoder_error(mrb, ok);
+    mrb_bool ok = TRUE;
+
+    for (;;) {
+        struct dirent *e = readdir(dir);
+        if (!e) { break; }
+
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 ||
+                aux_has_suffix(e->d_name, ".br") || aux_is_br_tmpfile(e->d_name)) {
+            continue;
+        }
+
+        char *path = aux_path_join(dirpath, e->d_name);
+        struct stat st;
+
+        if (!path) { ok = FALSE; break; }
+
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            ok = precompress_walk(pc, path);
+            free(path);
+            if (!ok) { break; }
+        } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (!precompress_push(pc, path)) { free(path); ok = FALSE; break; }
+        } else {
+            free(path);
+        }
     }
 
-    return MRBX_NEXT;
+    closedir(dir);
+
+    return ok;
 }
+#endif
 
 static VALUE
-dec_s_decode_full_try(MRB, VALUE args)
+precompress_try(MRB, VALUE args)
 {
-    struct dec_s_decode_full_growup *argp = mrb_cptr(args);
+#ifdef HAVE_DIRENT
+    struct precompress *pc = (struct precompress *)mrb_cptr(args);
 
-    mrbx_str_buf_growup(mrb, argp->output, -1, &argp->partial, dec_s_decode_full_growup, argp);
+    if (!precompress_walk(pc, pc->dir)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "failed allocation for the file list");
+    }
 
-    return Qnil;
+# ifdef HAVE_THREAD
+    if (pc->threads > 1 && pc->nitems > 1) {
+        aux_batch_run(precompress_item, pc->items, sizeof(struct precompress_item), pc->nitems, pc->threads);
+    } else
+# endif
+    {
+        size_t i;
+        for (i = 0; i < pc->nitems; i ++) {
+            precompress_item(&pc->items[i]);
+        }
+    }
+
+    static const char *const statuses[] = {
+        "compressed", "fresh", "unchanged", "small", "no_gain", "error",
+    };
+
+    VALUE report = mrb_ary_new_capa(mrb, (mrb_int)MIN(pc->nitems, (size_t)MRB_INT_MAX));
+    int ai = mrb_gc_arena_save(mrb);
+    size_t i;
+    for (i = 0; i < pc->nitems; i ++) {
+        struct precompress_item *item = &pc->items[i];
+        VALUE entry = mrb_hash_new(mrb);
+        mrb_hash_set(mrb, entry, mrb_symbol_value(SYMBOL("path")), mrb_str_new_cstr(mrb, item->path));
+        mrb_hash_set(mrb, entry, mrb_symbol_value(SYMBOL("status")), mrb_symbol_value(SYMBOL(statuses[item->status])));
+        mrb_hash_set(mrb, entry, mrb_symbol_value(SYMBOL("size")), aux_uint64_value(mrb, item->insize));
+        mrb_hash_set(mrb, entry, mrb_symbol_value(SYMBOL("compressed_size")), aux_uint64_value(mrb, item->outsize));
+        if (item->status == PRECOMPRESS_ERROR) {
+            mrb_hash_set(mrb, entry, mrb_symbol_value(SYMBOL("error")), mrb_str_new_cstr(mrb, strerror(item->err)));
+        }
+        mrb_ary_push(mrb, report, entry);
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return report;
+#else
+    mrb_raise(mrb, E_NOTIMP_ERROR, "Brotli.precompress_tree is not available on this platform");
+#endif
 }
 
 static VALUE
-dec_s_decode_full_cleanup(MRB, VALUE args)
+precompress_cleanup(MRB, VALUE args)
 {
-    struct dec_s_decode_full_growup *argp = mrb_cptr(args);
+    struct precompress *pc = (struct precompress *)mrb_cptr(args);
+    size_t i;
+
+    for (i = 0; i < pc->nitems; i ++) {
+        free(pc->items[i].path);
+    }
 
-    BrotliDecoderDestroyInstance(argp->brotli);
+    free(pc->items);
 
     return Qnil;
 }
 
-static void
-dec_s_decode_full(MRB, const char *input, size_t insize, struct RString *output, mrb_bool partial)
+static uint64_t
+convert_to_uint64(MRB, VALUE n)
 {
-    struct dec_s_decode_full_growup args = {
-        BrotliDecoderCreateInstance((brotli_alloc_func)mrb_malloc_simple, (brotli_free_func)mrb_free, mrb),
-        input,
-        insize,
-        output,
-        partial,
-    };
+    if (NIL_P(n)) { return 0; }
 
-    if (!args.brotli) {
-        mrb_raise(mrb, E_RUNTIME_ERROR,
-                  "failed BrotliDecoderCreateInstance (may be out of memory)");
+    mrb_float f = mrb_to_flo(mrb, n);
+
+    if (!(f >= 0)) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong negative value - %S", n);
     }
 
-    mrb_ensure(mrb,
-               dec_s_decode_full_try, mrb_cptr_value(mrb, &args),
-               dec_s_decode_full_cleanup, mrb_cptr_value(mrb, &args));
+    return (f > (mrb_float)UINT64_MAX ? UINT64_MAX : (uint64_t)f);
 }
 
 /*
  * call-seq:
- *  decode(input, outsize = nil, output = nil, partial: nil) -> output
- *  decode(input, output, partial: nil) -> output
+ *  precompress_tree(dir, quality: 11, lgwin: nil, mode: nil, threads: nil, min_size: 0, min_gain: 0) -> report
+ *
+ * Writes ``path.br`` next to each regular file under ``dir``. The files
+ * whose ``.br`` is newer are skipped, and the ``.br`` whose content is the
+ * same is only touched. The outputs that are not smaller than
+ * ``size * (1 - min_gain)`` are dropped.
+ *
+ * Returns an array of hashes that have ``path``, ``status`` (:compressed,
+ * :fresh, :unchanged, :small, :no_gain or :error), ``size``,
+ * ``compressed_size`` and ``error`` (only for :error).
  */
 static VALUE
-dec_s_decode(MRB, VALUE self)
+precompress_s_tree(MRB, VALUE self)
 {
-    struct RString *input, *output;
-    size_t outsize;
-    mrb_bool partial;
-    dec_s_decode_args(mrb, self, &input, &output, &outsize, &partial);
+    const char *dir;
+    VALUE opts = Qnil;
+    mrb_get_args(mrb, "z|H", &dir, &opts);
+
+    struct precompress pc;
+    memset(&pc, 0, sizeof(pc));
+    pc.quality = BROTLI_MAX_QUALITY;
+    pc.lgwin = BROTLI_DEFAULT_WINDOW;
+    pc.mode = BROTLI_DEFAULT_MODE;
+    pc.threads = 1;
+#ifdef HAVE_THREAD
+    pc.threads = aux_online_cpus();
+#endif
 
-    if ((ssize_t)outsize < 0) {
-        dec_s_decode_full(mrb, RSTR_PTR(input), RSTR_LEN(input), output, partial);
-    } else {
-        dec_s_decode_partial(mrb, RSTR_PTR(input), RSTR_LEN(input), output, outsize, partial);
+    if (!NIL_P(opts)) {
+        VALUE quality, lgwin, mode, threads, min_size, min_gain;
+        MRBX_SCANHASH(mrb, opts, Qnil,
+                MRBX_SCANHASH_ARGS("quality", &quality, Qnil),
+                MRBX_SCANHASH_ARGS("lgwin", &lgwin, Qnil),
+                MRBX_SCANHASH_ARGS("mode", &mode, Qnil),
+                MRBX_SCANHASH_ARGS("threads", &threads, Qnil),
+                MRBX_SCANHASH_ARGS("min_size", &min_size, Qnil),
+                MRBX_SCANHASH_ARGS("min_gain", &min_gain, Qnil));
+
+        if (!NIL_P(quality)) { pc.quality = convert_to_quality(mrb, quality); }
+        pc.lgwin = convert_to_lgwin(mrb, lgwin, FALSE);
+        pc.mode = convert_to_mode(mrb, mode);
+        if (!NIL_P(threads)) { pc.threads = convert_to_threads(mrb, threads); }
+        pc.min_size = convert_to_uint64(mrb, min_size);
+
+        if (!NIL_P(min_gain)) {
+            pc.min_gain = mrb_to_flo(mrb, min_gain);
+            if (!(pc.min_gain >= 0 && pc.min_gain < 1)) {
+                mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                           "wrong min_gain value - %S (expect 0 <= n < 1)", min_gain);
+            }
+        }
     }
 
-    return VALUE(output);
+    pc.dir = dir;
+
+    return mrb_ensure(mrb,
+                      precompress_try, mrb_cptr_value(mrb, &pc),
+                      precompress_cleanup, mrb_cptr_value(mrb, &pc));
 }
 
 static void
-init_decoder(MRB, struct RClass *mBrotli)
+init_precompress(MRB, struct RClass *mBrotli)
 {
-    struct RClass *cDecoder = mrb_define_class_under(mrb, mBrotli, "Decoder", mrb_cObject);
-    mrb_define_class_method(mrb, cDecoder, "decode", dec_s_decode, MRB_ARGS_ANY());
-    mrb_define_class_method(mrb, cDecoder, "new", dec_s_new, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cDecoder, "initialize", dec_initialize, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cDecoder, "decode", dec_decode, MRB_ARGS_ANY());
-    mrb_define_method(mrb, cDecoder, "finish", dec_finish, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cDecoder, "finished?", dec_is_finished, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cDecoder, "total_in", dec_total_in, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cDecoder, "total_out", dec_total_out, MRB_ARGS_NONE());
-    mrb_define_method(mrb, cDecoder, "inport", dec_get_inport, MRB_ARGS_NONE());
-    //mrb_define_method(mrb, cDecoder, "inport=", dec_set_inport, MRB_ARGS_ARG(1));
+    mrb_define_class_method(mrb, mBrotli, "precompress_tree", precompress_s_tree, MRB_ARGS_ARG(1, 1));
 }
 
-/* module Brotli */
-
 void
 mrb_mruby_brotli_gem_init(MRB)
 {
     struct RClass *mBrotli = mrb_define_module(mrb, "Brotli");
 
+    init_bufpool(mrb, mBrotli);
     init_constants(mrb, mBrotli);
+    init_dictionary(mrb, mBrotli);
+    init_mapped_file(mrb, mBrotli);
+    init_cache(mrb, mBrotli);
     init_encoder(mrb, mBrotli);
     init_decoder(mrb, mBrotli);
+    init_file(mrb, mBrotli);
+    init_pool(mrb, mBrotli);
+    init_precompress(mrb, mBrotli);
 }
 
 void
 mrb_mruby_brotli_gem_final(MRB)
 {
+    final_bufpool(mrb);
 }
@@ -207,6 +207,105 @@ assert("streaming Brotli::Encoder (huge)") do
   assert_equal s.hash, Brotli.decode(d, s.bytesize).hash
 end
 
+assert("streaming Brotli::Encoder (coalescing small inputs)") do
+  port = Object.new
+  port.instance_variable_set(:@buf, "")
+  port.instance_variable_set(:@calls, 0)
+  def port.<<(str)
+    @calls += 1
+    @buf << str
+    self
+  end
+
+  s = "abc" * 100
+  Brotli::Encoder.wrap(port, quality: 1) do |brotli|
+    s.bytesize.times { |i| brotli << s.byteslice(i, 1) }
+    assert_equal s.bytesize, brotli.pos
+  end
+
+  assert_true port.instance_variable_get(:@calls) <= 2
+  assert_equal s, Brotli.decode(port.instance_variable_get(:@buf))
+
+  d = ""
+  Brotli::Encoder.wrap(d, quality: 1, size_hint: 16) do |brotli|
+    s.bytesize.times { |i| brotli << s.byteslice(i, 1) }
+    brotli.flush
+    brotli << s
+  end
+
+  assert_equal s + s, Brotli.decode(d)
+end
+
+assert("streaming Brotli::Encoder (outport raises once)") do
+  port = Object.new
+  port.instance_variable_set(:@buf, "")
+  port.instance_variable_set(:@fail, true)
+  def port.<<(str)
+    if @fail
+      @fail = false
+      raise IOError, "temporary failure"
+    end
+    @buf << str
+    self
+  end
+
+  s = "abc" * 100
+  e = Brotli::Encoder.new(port, quality: 1)
+  e << s
+  assert_raise(IOError) { e.finish }
+
+  # the consumed input is never given twice
+  assert_raise(RuntimeError) { e.finish }
+  assert_raise(RuntimeError) { e << s }
+
+  e.reset(port)
+  e << s
+  e.finish
+  assert_equal s, Brotli.decode(port.instance_variable_get(:@buf))
+
+  port.instance_variable_set(:@buf, "")
+  port.instance_variable_set(:@fail, true)
+  assert_raise(IOError) do
+    Brotli::Encoder.wrap(port, quality: 1) { |brotli| brotli << s }
+  end
+end
+
+assert("streaming Brotli::Encoder (zerocopy)") do
+  s = "123456789" * 1111 + "ABCDEFG"
+  d = ""
+  Brotli::Encoder.wrap(d, quality: 1, zerocopy: true) do |brotli|
+    brotli << s
+    brotli.flush
+    brotli << s
+  end
+
+  assert_equal s + s, Brotli.decode(d)
+
+  chunks = []
+  Brotli::Encoder.wrap(chunks, zerocopy: true) do |brotli|
+    brotli << s
+  end
+
+  assert_false chunks.empty?
+  chunks.each do |chunk|
+    assert_true chunk.frozen?
+    assert_equal "", chunk
+  end
+
+  port = Object.new
+  def port.<<(chunk)
+    (@chunks ||= []) << chunk
+    raise "port error"
+  end
+  def port.chunks
+    @chunks
+  end
+  enc = Brotli::Encoder.new(port, zerocopy: true)
+  enc << s
+  assert_raise(RuntimeError) { enc.finish }
+  assert_equal [""], port.chunks
+end
+
 assert("streaming Brotli::Decoder") do
   s = "123456789" * 1111 + "ABCDEFG"
   d = Brotli.encode(s, quality: 0)
@@ -279,3 +378,749 @@ assert("streaming Brotli::Decoder (huge#2)") do
     assert_equal nil.hash, brotli.read(slicesize).hash
   end
 end
+
+assert("Brotli::Dictionary") do
+  dictsrc = '{"id":0,"name":"","tags":[],"created_at":"2000-01-01T00:00:00Z"}' * 4
+  begin
+    dict = Brotli::Dictionary.new(dictsrc)
+  rescue NotImplementedError
+    skip "[brotli is older than 1.1.0]"
+  end
+
+  assert_equal dictsrc.bytesize, dict.bytesize
+  assert_raise(TypeError) { Brotli::Dictionary.new(1) }
+  assert_raise(RuntimeError) { dict.__send__(:initialize, "x") }
+
+  src = '{"id":12,"name":"abc","tags":["x"],"created_at":"2020-02-02T02:02:02Z"}'
+  d1 = Brotli.encode(src, quality: 9, dictionary: dict)
+  d2 = Brotli.encode(src, quality: 9)
+  assert_true d1.bytesize < d2.bytesize
+  assert_equal src, Brotli.decode(d1, dictionary: dict)
+  assert_equal src.byteslice(0, 10), Brotli.decode(d1, 10, dictionary: dict)
+
+  d3 = ""
+  Brotli::Encoder.wrap(d3, dictionary: dict) { |brotli| brotli << src }
+  Brotli::Decoder.wrap(d3, dictionary: dict) { |brotli| assert_equal src, brotli.read }
+  assert_raise(TypeError) { Brotli.encode(src, dictionary: "") }
+end
+
+assert("Brotli::Encoder#reset and Brotli::Decoder#reset") do
+  s = "123456789" * 1111
+  d1 = ""
+  d2 = ""
+  e = Brotli::Encoder.new(d1, quality: 3)
+  e << s
+  e.finish
+  assert_equal e, e.reset(d2)
+  assert_false e.finished?
+  assert_equal 0, e.total_in
+  e << s
+  e.finish
+  assert_equal d1, d2
+
+  dec = Brotli::Decoder.new(d1)
+  assert_equal s, dec.read
+  assert_equal dec, dec.reset(d2)
+  assert_equal 0, dec.total_out
+  assert_equal s, dec.read
+
+  dec = Brotli::Decoder.new(d1 + d2)
+  assert_equal s, dec.read
+  dec.reset
+  assert_equal s, dec.read
+  assert_nil dec.read
+
+  100.times do |i|
+    assert_equal s, Brotli.decode(Brotli.encode(s, quality: i % 12))
+  end
+end
+
+assert("one-shot Brotli::Encoder.encode with threads") do
+  assert_raise(ArgumentError) { Brotli.encode("", threads: 0) }
+  assert_equal "\x06", Brotli.encode("", threads: 4)
+
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789abcdefghijklmnopqrstuvwxyz" * 400000
+  [0, 1, 5].each do |q|
+    d = Brotli.encode(s, quality: q, threads: 4)
+    assert_equal s.hash, Brotli.decode(d).hash
+  end
+end
+
+assert("large window brotli") do
+  assert_equal 30, Brotli::LARGE_MAX_WINDOW_BITS
+
+  s = "123456789abcdefghijklmnopqrstuvwxyz" * 100
+  d = Brotli.encode(s, lgwin: 26, large_window: true)
+  assert_raise(RuntimeError) { Brotli.decode(d) }
+  assert_equal s, Brotli.decode(d, large_window: true)
+  assert_equal s, Brotli::Decoder.new(d, large_window: true).read
+
+  d = ""
+  Brotli::Encoder.new(d, lgwin: :max, large_window: true).tap { |e| e << s }.finish
+  assert_raise(RuntimeError) { Brotli::Decoder.new(d).read }
+  assert_equal s, Brotli.decode(d, large_window: true)
+end
+
+assert("encoder tuning parameters") do
+  assert_raise(ArgumentError) { Brotli.encode("", lgblock: 15) }
+  assert_raise(ArgumentError) { Brotli.encode("", lgblock: :huge) }
+  assert_raise(ArgumentError) { Brotli.encode("", npostfix: Brotli::MAX_NPOSTFIX + 1) }
+  assert_raise(ArgumentError) { Brotli.encode("", npostfix: 1, ndirect: 3) }
+  assert_raise(ArgumentError) { Brotli.encode("", ndirect: Brotli::MAX_NDIRECT) }
+  assert_raise(ArgumentError) { Brotli.encode("", stream_offset: -1) }
+
+  # kept under 32 KiB for MRB_INT16
+  s = "123456789abcdefghijklmnopqrstuvwxyz" * 900
+  [0, 5, 11].each do |q|
+    d = Brotli.encode(s, quality: q, lgblock: :min, npostfix: 2, ndirect: 12,
+                      disable_literal_context_modeling: true)
+    assert_equal s, Brotli.decode(d)
+
+    d = ""
+    Brotli::Encoder.new(d, quality: q, lgblock: 24, npostfix: 1, ndirect: 30,
+                        disable_literal_context_modeling: true).tap { |e| e << s }.finish
+    assert_equal s, Brotli.decode(d)
+  end
+
+  a = "abcdefghijklmnopqrstuvwxyz" * 100
+  b = "ABCDEFGHIJKLMNOPQRSTUVWXYZ" * 100
+  d = ""
+  Brotli::Encoder.new(d, quality: 5).tap { |e| e << a }.flush
+  begin
+    d << Brotli.encode(b, quality: 5, stream_offset: a.bytesize)
+  rescue NotImplementedError
+    skip "[brotli-1.0.7 or before]"
+  end
+  assert_equal a + b, Brotli.decode(d)
+end
+
+assert("Brotli::Decoder with max_memory and disable_ring_buffer_reallocation") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789abcdefghijklmnopqrstuvwxyz" * 30000
+  d = Brotli.encode(s, lgwin: 22)
+
+  assert_kind_of Class, Brotli::MemoryLimitError
+  assert_raise(Brotli::MemoryLimitError) { Brotli.decode(d, max_memory: 64 << 10) }
+  assert_raise(Brotli::MemoryLimitError) { Brotli::Decoder.new(d, max_memory: 64 << 10).read }
+  assert_equal s, Brotli.decode(d, max_memory: 16 << 20)
+  assert_equal s, Brotli.decode(d, disable_ring_buffer_reallocation: true)
+  assert_equal s, Brotli.decode(d, s.bytesize, max_memory: 16 << 20, disable_ring_buffer_reallocation: true)
+
+  dec = Brotli::Decoder.new(d, max_memory: 16 << 20, disable_ring_buffer_reallocation: true)
+  assert_equal s, dec.read
+  dec.reset(d)
+  assert_equal s, dec.read
+end
+
+assert("one-shot Brotli.decode with expected_size") do
+  s = "123456789abcdefghijklmnopqrstuvwxyz" * 300
+  d = Brotli.encode(s)
+
+  assert_equal s, Brotli.decode(d, expected_size: s.bytesize)
+  assert_equal s, Brotli.decode(d, expected_size: s.bytesize * 2)
+  assert_equal s, Brotli.decode(d, expected_size: 7)
+  assert_equal s, Brotli.decode(d, "", expected_size: s.bytesize)
+  assert_equal "", Brotli.decode(Brotli.encode(""), expected_size: 100)
+  assert_raise(RuntimeError) { Brotli.decode(d[0, d.bytesize / 2], expected_size: s.bytesize) }
+
+  unless is_mrb16
+    assert_equal s, Brotli.decode(d, expected_size: s.bytesize, max_memory: 1 << 20)
+
+    # the size from the headers is limited by the input size
+    z = "\0" * 65000
+    assert_equal z, Brotli.decode(Brotli.encode(z))
+
+    # uncompressed meta-blocks are skipped over by the pre-scan
+    s = (0 ... 5000).map { |i| ((i * 7919 + i / 3) & 0xff).chr }.join
+    assert_equal s, Brotli.decode(Brotli.encode(s, quality: 0))
+  end
+end
+
+assert("Brotli::Encoder.encode_batch and Brotli::Decoder.decode_batch") do
+  src = (0 ... 50).map { |i| "#{i} 123456789abcdefghijklmnopqrstuvwxyz" * (i * 3) }
+
+  d = Brotli::Encoder.encode_batch(src, quality: 5)
+  assert_equal src.size, d.size
+  d.each_with_index { |e, i| assert_equal src[i], Brotli.decode(e) }
+  assert_equal src, Brotli::Decoder.decode_batch(d)
+
+  [1, 4].each do |t|
+    d = Brotli::Encoder.encode_batch(src, quality: 1, threads: t)
+    assert_equal src, Brotli::Decoder.decode_batch(d, threads: t)
+  end
+
+  assert_equal [], Brotli::Encoder.encode_batch([])
+  assert_equal [], Brotli::Decoder.decode_batch([], threads: 4)
+  assert_raise(TypeError) { Brotli::Encoder.encode_batch(["a", 1]) }
+  assert_raise(RuntimeError) { Brotli::Decoder.decode_batch([d[0], d[9][0, 5]], threads: 2) }
+end
+
+assert("Brotli.compress_file and Brotli.decompress_file") do
+  src = __FILE__
+  br = "/tmp/mruby-brotli-test.br"
+  out = "/tmp/mruby-brotli-test.out"
+
+  assert_raise(StandardError) { Brotli.compress_file("/nonexistent/mruby-brotli", br) }
+
+  begin
+    size = Brotli.compress_file(src, br, quality: 5)
+  rescue StandardError
+    skip "[#{src} or /tmp is not available]"
+  end
+
+  assert_kind_of Integer, size
+  n = Brotli.decompress_file(br, out)
+  assert_true n > size
+  assert_equal size, Brotli.compress_file(out, br, quality: 5)
+  assert_equal n, Brotli.decompress_file(br, out, max_memory: 16 << 20)
+  assert_raise(RuntimeError) { Brotli.decompress_file(out, br) }
+
+  # the failed output does not replace the destination
+  assert_equal n, Brotli.decompress_file(br, out)
+  assert_raise(ArgumentError) { Brotli.compress_file(out, out) }
+  assert_raise(ArgumentError) { Brotli.decompress_file(br, br) }
+  assert_raise(ArgumentError) { Brotli.compress_file(out, br, threads: 2) }
+  assert_equal n, Brotli.decompress_file(br, out)
+
+  # a file that has the name of the destination and ".tmp" is not touched
+  keep = "#{br}.tmp"
+  Brotli.compress_file(src, keep, quality: 1)
+  assert_equal size, Brotli.compress_file(out, br, quality: 5)
+  assert_raise(RuntimeError) { Brotli.decompress_file(out, br) }
+  assert_equal n, Brotli.decompress_file(keep, out)
+end
+
+assert("Brotli::MappedFile") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  begin
+    m = Brotli::MappedFile.new(__FILE__)
+  rescue NotImplementedError, StandardError
+    skip "[#{__FILE__} is not mappable]"
+  end
+
+  src = Brotli.decode(Brotli.encode(m, quality: 1))
+  assert_equal m.bytesize, src.bytesize
+  assert_equal src, Brotli.decode(Brotli.encode(m, quality: 5))
+  assert_false m.closed?
+  assert_nil m.close
+  assert_true m.closed?
+  assert_raise(RuntimeError) { Brotli.encode(m) }
+  assert_raise(TypeError) { Brotli::Encoder.encode(1) }
+
+  Brotli.compress_file(__FILE__, "/tmp/mruby-brotli-test.br") rescue skip
+  assert_equal src, Brotli::MappedFile.open("/tmp/mruby-brotli-test.br") { |f| Brotli.decode(f) }
+end
+
+assert("Brotli::Decoder#feed") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789" * 11111 + "abcdefghijklmnopqrstuvwxyz" * 1111
+  d = Brotli.encode(s)
+
+  dec = Brotli::Decoder.new
+  assert_nil dec.inport
+  assert_true dec.needs_input?
+  assert_false dec.has_output?
+  assert_equal "", dec.feed
+  out = ""
+  0.step(d.bytesize - 1, 7) { |i| out << dec.feed(d.byteslice(i, 7)) }
+  assert_true dec.finished?
+  assert_equal :success, dec.result
+  assert_equal s, out
+  assert_equal d.bytesize, dec.total_in
+  assert_equal s.bytesize, dec.total_out
+  assert_nil dec.feed("a")
+
+  dec = Brotli::Decoder.new(large_window: false)
+  out = dec.feed(d, 1000)
+  assert_equal 1000, out.bytesize
+  assert_true dec.has_output?
+  assert_false dec.needs_input?
+  assert_equal :needs_more_output, dec.result
+  buf = ""
+  out << dec.feed(nil, 1000, buf) while dec.has_output?
+  assert_equal s, out
+
+  dec = Brotli::Decoder.new(nil)
+  assert_equal s[0, 100], dec.feed(d[0, d.bytesize / 2], 100)
+  assert_equal s[100 .. -1], dec.feed(d[d.bytesize / 2 .. -1])
+  assert_true dec.finished?
+
+  dec = Brotli::Decoder.new
+  assert_raise(RuntimeError) { dec.decode }
+  assert_raise(RuntimeError) { dec.feed("\xff" * 10) }
+  assert_raise(RuntimeError) { Brotli::Decoder.new(d).feed(d) }
+end
+
+assert("Brotli::Decoder#each_chunk") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789" * 111111 + "abcdefghijklmnopqrstuvwxyz" * 11111
+  d = Brotli.encode(s)
+
+  out = ""
+  views = []
+  dec = Brotli::Decoder.new(d)
+  assert_equal dec, dec.each_chunk { |chunk| views << chunk; out << chunk }
+  assert_equal s, out
+  assert_true views.size > 1
+  assert_true views.all? { |v| v.empty? }
+  assert_true dec.finished?
+  assert_equal s.bytesize, dec.total_out
+
+  # the copies do not share the internal buffer
+  kept = []
+  slices = []
+  Brotli::Decoder.new(d).each_chunk do |chunk|
+    assert_kind_of Brotli::BufferView, chunk
+    kept << chunk.dup
+    slices << chunk.byteslice(0, 100)
+  end
+  assert_true kept.size > 1
+  assert_equal s, kept.join
+  assert_equal kept.map { |e| e.byteslice(0, 100) }, slices
+
+  # String.new(chunk) may share the buffer, so it is used only in the block
+  kept = []
+  Brotli::Decoder.new(d).each_chunk do |chunk|
+    str = String.new(chunk)
+    assert_equal chunk, str
+    kept << "" + str
+  end
+  assert_equal s, kept.join
+
+  out = ""
+  dec = Brotli::Decoder.new
+  0.step(d.bytesize - 1, 1000) do |i|
+    dec.each_chunk(d.byteslice(i, 1000)) { |chunk| out << chunk }
+  end
+  assert_true dec.finished?
+  assert_equal s, out
+
+  dec = Brotli::Decoder.new
+  assert_raise(RuntimeError) { dec.each_chunk(d) { |chunk| raise "stop" } }
+  out = dec.feed
+  dec.each_chunk { |chunk| out << chunk }
+  assert_true dec.finished?
+  assert_equal s.byteslice(s.bytesize - out.bytesize, out.bytesize), out
+  assert_raise(ArgumentError) { Brotli::Decoder.new.each_chunk }
+  assert_raise(ArgumentError) { Brotli::Decoder.new(d).each_chunk(d) { } }
+end
+
+assert("Brotli::Encoder#stats, Brotli::Decoder#stats and Brotli.stats") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  keys = [:stream_calls, :stream_nsec, :port_calls, :port_bytes, :buffer_allocs, :native_allocs, :native_frees, :native_bytes]
+  s = "123456789abcdefghijklmnopqrstuvwxyz" * 3333
+  total = Brotli.stats
+
+  out = ""
+  enc = Brotli::Encoder.new(out, quality: 1)
+  st = enc.stats
+  keys.each { |k| assert_kind_of Integer, st[k] }
+  assert_true st[:native_allocs] > 0
+  assert_equal 0, st[:stream_calls]
+  enc.encode(s)
+  enc.finish
+  st = enc.stats
+  assert_true st[:stream_calls] > 0
+  assert_true st[:port_calls] > 0
+  assert_equal out.bytesize, st[:port_bytes]
+  assert_true st[:native_in_use] > 0
+
+  dec = Brotli::Decoder.new(out)
+  assert_equal s, dec.read
+  st = dec.stats
+  assert_true st[:stream_calls] > 0
+  assert_true st[:port_calls] > 0
+  assert_equal out.bytesize, st[:port_bytes]
+  assert_true st[:buffer_allocs] > 0
+
+  dec = Brotli::Decoder.new
+  dec.each_chunk(out) { }
+  assert_equal s.bytesize, dec.stats[:port_bytes]
+
+  now = Brotli.stats
+  assert_kind_of Integer, now[:native_cached]
+  assert_true now[:stream_calls] > total[:stream_calls]
+  assert_true now[:native_allocs] > total[:native_allocs]
+end
+
+assert("Brotli.allocator and allocator option") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789abcdefghijklmnopqrstuvwxyz" * 3333
+  assert_equal :pool, Brotli.allocator
+
+  [:pool, :mruby, :system].each do |a|
+    out = ""
+    enc = Brotli::Encoder.new(out, allocator: a)
+    enc.encode(s)
+    enc.finish
+    assert_equal s, Brotli::Decoder.new(out, allocator: a).read
+  end
+
+  begin
+    Brotli.allocator = :system
+    assert_equal :system, Brotli.allocator
+    d = Brotli.encode(s)
+    assert_equal s, Brotli.decode(d)
+    Brotli.allocator = nil
+    assert_equal :pool, Brotli.allocator
+    assert_equal s, Brotli.decode(d)
+  ensure
+    Brotli.allocator = :pool
+  end
+
+  assert_raise(ArgumentError) { Brotli.allocator = :unknown }
+  assert_raise(ArgumentError) { Brotli::Encoder.new("", allocator: 1) }
+
+  limit = Brotli.pool_limit
+  begin
+    Brotli.pool_limit = 0
+    assert_equal 0, Brotli.pool_limit
+    assert_equal s, Brotli.decode(Brotli.encode(s))
+    assert_equal 0, Brotli.stats[:native_cached]
+  ensure
+    Brotli.pool_limit = limit
+  end
+  assert_raise(ArgumentError) { Brotli.pool_limit = -1 }
+end
+
+assert("skip_incompressible") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  x = 12345
+  noise = ""
+  100000.times { noise << ((x = (x * 1103515245 + 12345) & 0x7fffffff) >> 16 & 0xff).chr }
+  text = "123456789abcdefghijklmnopqrstuvwxyz\n" * 3000
+
+  n0 = Brotli.stats[:incompressible]
+  d = Brotli.encode(noise, quality: 11, skip_incompressible: true)
+  assert_equal noise, Brotli.decode(d)
+  assert_true d.bytesize <= noise.bytesize + 64
+  assert_equal n0 + 1, Brotli.stats[:incompressible]
+  assert_equal Brotli.encode(text, quality: 11), Brotli.encode(text, quality: 11, skip_incompressible: true)
+  assert_equal n0 + 1, Brotli.stats[:incompressible]
+  assert_equal [noise, text], Brotli::Decoder.decode_batch(Brotli::Encoder.encode_batch([noise, text], skip_incompressible: 7.5))
+
+  out = ""
+  enc = Brotli::Encoder.new(out, quality: 11, skip_incompressible: true)
+  assert_nil enc.incompressible?
+  enc.encode(noise)
+  enc.finish
+  assert_true enc.incompressible?
+  assert_equal 1, enc.stats[:incompressible]
+  assert_equal noise, Brotli.decode(out)
+
+  out = ""
+  enc = Brotli::Encoder.new(out, quality: 11, skip_incompressible: true)
+  enc.encode(text)
+  enc.finish
+  assert_false enc.incompressible?
+  assert_equal text, Brotli.decode(out)
+  assert_nil Brotli::Encoder.new("").encode(noise).incompressible?
+
+  assert_raise(ArgumentError) { Brotli.encode(text, skip_incompressible: 9) }
+  assert_raise(ArgumentError) { Brotli.encode(text, skip_incompressible: 0) }
+end
+
+assert("adaptive quality") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789abcdefghijklmnopqrstuvwxyz\n" * 3000
+
+  out = ""
+  enc = Brotli::Encoder.new(out, quality: 11, max_latency_ms: 0.000001)
+  assert_equal 11, enc.quality
+  enc.encode(s)
+  enc.finish
+  assert_equal s, Brotli.decode(out)
+  out = ""
+  enc.reset(out)
+  assert_equal 9, enc.quality
+  enc.encode(s)
+  enc.finish
+  assert_equal s, Brotli.decode(out)
+
+  enc = Brotli::Encoder.new("", quality: 11, target_mbps: 1.0e12)
+  enc.encode(s)
+  enc.finish
+  enc.reset("")
+  assert_equal 9, enc.quality
+
+  enc = Brotli::Encoder.new("", quality: 5, target_mbps: 1.0e-12, max_latency_ms: 1.0e12)
+  enc.encode(s)
+  enc.finish
+  enc.reset("")
+  assert_equal 5, enc.quality
+  assert_equal 4, Brotli::Encoder.new("", quality: 4).quality
+
+  assert_raise(ArgumentError) { Brotli::Encoder.new("", target_mbps: 0) }
+  assert_raise(ArgumentError) { Brotli::Encoder.new("", max_latency_ms: -1) }
+end
+
+assert("seekable container") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = ""
+  1000.times { |i| s << "record #{i}: " << ("abcdefghij" * (i % 7)) << "\n" }
+
+  out = ""
+  w = Brotli::SeekableWriter.new(out, frame_size: 4096, quality: 5)
+  w << s.byteslice(0, 10000)
+  w << s.byteslice(10000, s.bytesize)
+  w.finish
+  assert_true w.finished?
+  assert_equal s.bytesize, w.total_in
+  assert_equal out.bytesize, w.total_out
+
+  r = Brotli::SeekableReader.new(out)
+  assert_equal s.bytesize, r.bytesize
+  assert_equal (s.bytesize + 4095) / 4096, r.frame_count
+  assert_equal s, r.read
+  [[0, 10], [4090, 20], [12345, 9000], [s.bytesize - 5, 100], [-8, 8]].each do |off, len|
+    assert_equal s.byteslice(off, len), r.read_at(off, len)
+  end
+  assert_equal "", r.read_at(s.bytesize, 10)
+  assert_nil r.read_at(s.bytesize + 1, 10)
+
+  out2 = ""
+  Brotli::SeekableWriter.wrap(out2, frame_size: 4096, quality: 5, threads: 4) { |e| e << s }
+  assert_equal out, out2
+  assert_equal s.byteslice(1000, 20000), Brotli::SeekableReader.new(out2, threads: 4).read_at(1000, 20000)
+
+  out = ""
+  w = Brotli::SeekableWriter.new(out, frame_size: 4096)
+  w << "abc"
+  w.flush
+  w << "defg"
+  w.finish
+  r = Brotli::SeekableReader.new(out)
+  assert_equal 2, r.frame_count
+  assert_equal "cde", r.read_at(2, 3)
+
+  assert_raise(RuntimeError) { Brotli::SeekableReader.new("not a container" * 4) }
+  assert_raise(ArgumentError) { Brotli::SeekableWriter.new("", frame_size: 0) }
+end
+
+assert("Brotli::MappedFile#byteslice") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  begin
+    m = Brotli::MappedFile.new(__FILE__)
+  rescue NotImplementedError, StandardError
+    skip "[#{__FILE__} is not mappable]"
+  end
+
+  src = Brotli.decode(Brotli.encode(m, quality: 1))
+  assert_equal src.byteslice(100, 50), m.byteslice(100, 50)
+  assert_equal src.byteslice(-10, 50), m.byteslice(-10, 50)
+  assert_nil m.byteslice(src.bytesize + 1, 1)
+  m.close
+  assert_raise(RuntimeError) { m.byteslice(0, 1) }
+end
+
+assert("Brotli::Pool") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  begin
+    pool = Brotli::Pool.new(threads: 4)
+  rescue NotImplementedError
+    skip "[Brotli::Pool is not available]"
+  end
+
+  assert_equal 4, pool.threads
+  s = "123456789abcdefghijklmnopqrstuvwxyz\n" * 3000
+  frozen = ("abcdefghijklmnopqrstuvwxyz" * 1000).freeze
+
+  futures = (0 ... 10).map { |i| pool.submit_encode(s, quality: i) }
+  f2 = pool.submit_encode(frozen, quality: 5)
+  futures.each_with_index do |f, i|
+    assert_equal s, Brotli.decode(f.value)
+    assert_true f.ready?
+  end
+  assert_same f2.value, f2.value
+  assert_equal frozen, Brotli.decode(f2.wait.value)
+
+  assert_equal s, pool.submit_decode(Brotli.encode(s)).value
+  f = pool.submit_decode("\xff" * 10)
+  assert_raise(RuntimeError) { f.value }
+  assert_raise(ArgumentError) { pool.submit_encode(s, quality: 1, unknown: 1) }
+
+  # the futures and the inputs can be dropped while the jobs run
+  4.times { pool.submit_encode(("0123456789" * 10000).freeze, quality: 9) }
+  GC.start
+
+  f = pool.submit_encode(s, quality: 11)
+  pool.shutdown
+  assert_true pool.shutdown?
+  assert_equal 0, pool.pending
+  assert_true f.ready?
+  assert_raise(RuntimeError) { pool.submit_encode(s) }
+end
+
+assert("Brotli::Encoder async") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = ""
+  3000.times { |i| s << "line #{i} #{i * i} " << ("abcdefghij" * (i % 13)) << "\n" }
+
+  out = ""
+  enc = Brotli::Encoder.new(out, quality: 9, async: true)
+  off = 0
+  step = 777
+  while off < s.bytesize
+    enc.encode(s.byteslice(off, step))
+    off += step
+    step = step * 3 % 100003
+    enc.flush if off > s.bytesize / 2 && out.empty?
+  end
+  assert_false enc.finished?
+  enc.finish
+  assert_true enc.finished?
+  assert_equal s.bytesize, enc.total_in
+  assert_equal out.bytesize, enc.total_out
+  assert_equal s, Brotli.decode(out)
+
+  out2 = ""
+  enc.reset(out2)
+  enc << s
+  enc.flush
+  assert_true out2.bytesize > 0
+  enc.finish
+  assert_equal s, Brotli.decode(out2)
+  assert_true enc.stats[:stream_calls] > 0
+
+  out3 = ""
+  Brotli::Encoder.wrap(out3, async: true) { |e| e << s }
+  assert_equal s, Brotli.decode(out3)
+
+  port = Object.new
+  port.instance_variable_set(:@buf, "")
+  port.instance_variable_set(:@fail, true)
+  def port.<<(str)
+    if @fail
+      @fail = false
+      raise IOError, "temporary failure"
+    end
+    @buf << str
+    self
+  end
+
+  enc = Brotli::Encoder.new(port, async: true)
+  assert_raise(IOError) { enc << s; enc.finish }
+  assert_raise(RuntimeError) { enc << s }
+  assert_raise(RuntimeError) { enc.finish }
+  enc.reset
+  enc << s
+  enc.finish
+  assert_equal s, Brotli.decode(port.instance_variable_get(:@buf))
+
+  begin
+    Brotli::Pool.new(threads: 1).shutdown
+  rescue NotImplementedError
+    skip "[async: true is ignored without threads]"
+  end
+  assert_raise(ArgumentError) { Brotli::Encoder.new("", async: true, zerocopy: true) }
+  assert_raise(ArgumentError) { Brotli::Encoder.new("", async: true, allocator: :system) }
+end
+
+assert("Brotli::Decoder readahead") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789abcdefghijklmnopqrstuvwxyz\n" * 30000
+  d = Brotli.encode(s)
+  assert_equal s, Brotli::Decoder.new(d, readahead: true).read
+  assert_equal s, Brotli::Decoder.new(d, readahead: 0).read
+  assert_raise(ArgumentError) { Brotli::Decoder.new(d, readahead: -1) }
+
+  skip "[File is not available]" unless Object.const_defined?(:File) && File.respond_to?(:open)
+  br = "/tmp/mruby-brotli-test-readahead.br"
+  File.open(br, "wb") { |f| f.write d }
+  File.open(br, "rb") do |f|
+    dec = Brotli::Decoder.new(f, readahead: 2)
+    buf = ""
+    out = ""
+    out << buf while dec.read(4096, buf)
+    assert_equal s, out
+  end
+end
+
+assert("Brotli.precompress_tree") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  report = Brotli.precompress_tree("/nonexistent/mruby-brotli")
+  assert_equal 1, report.size
+  assert_equal :error, report[0][:status]
+  assert_raise(ArgumentError) { Brotli.precompress_tree("/tmp", min_gain: 1) }
+  assert_raise(ArgumentError) { Brotli.precompress_tree("/tmp", min_size: -1) }
+
+  skip "[File or Dir is not available]" unless Object.const_defined?(:File) && Object.const_defined?(:Dir)
+  top = "/tmp/mruby-brotli-test-tree"
+  Dir.mkdir(top) rescue nil
+  Dir.mkdir("#{top}/sub") rescue nil
+  s = "123456789abcdefghijklmnopqrstuvwxyz\n" * 1000
+  File.open("#{top}/a.txt", "wb") { |f| f.write s }
+  File.open("#{top}/sub/b.txt", "wb") { |f| f.write s * 2 }
+  File.open("#{top}/small.txt", "wb") { |f| f.write "abc" }
+  File.open("#{top}/a.txt.br.tmp", "wb") { |f| f.write "keep" }
+  ["#{top}/a.txt.br", "#{top}/sub/b.txt.br", "#{top}/small.txt.br"].each { |e| File.delete(e) rescue nil }
+
+  report = Brotli.precompress_tree(top, quality: 5, threads: 2, min_size: 16, min_gain: 0.1)
+  status = {}
+  report.each { |e| status[e[:path]] = e[:status] }
+  assert_equal :compressed, status["#{top}/a.txt"]
+  assert_equal :compressed, status["#{top}/sub/b.txt"]
+  assert_equal :small, status["#{top}/small.txt"]
+  assert_false File.exist?("#{top}/small.txt.br")
+
+  # the temporary file is not a fixed name that clobbers the user's file
+  assert_equal :small, status["#{top}/a.txt.br.tmp"]
+  assert_equal "keep", File.open("#{top}/a.txt.br.tmp", "rb") { |f| f.read }
+  assert_equal s, File.open("#{top}/a.txt.br", "rb") { |f| Brotli.decode(f.read) }
+
+  report = Brotli.precompress_tree(top, quality: 5, min_size: 16)
+  report.each do |e|
+    next if e[:status] == :small
+    assert_include [:fresh, :unchanged], e[:status]
+  end
+end
+
+assert("Brotli::Cache") do
+  skip "[mruby is build with MRB_INT16]" if is_mrb16
+
+  s = "123456789abcdefghijklmnopqrstuvwxyz\n" * 1000
+  c = Brotli::Cache.new(max_bytes: 1 << 20)
+  d = Brotli.encode(s, quality: 5, cache: c)
+  assert_equal [0, 1, 1], [c.hits, c.misses, c.size]
+  assert_equal d, Brotli.encode(s, quality: 5, cache: c)
+  assert_equal d, Brotli::Encoder.encode(s.dup, quality: 5, cache: c)
+  assert_equal [2, 1], [c.hits, c.misses]
+  assert_equal s, Brotli.decode(Brotli.encode(s, quality: 6, cache: c))
+  assert_equal [2, 2, 2], [c.hits, c.misses, c.size]
+  assert_equal "", Brotli.decode(Brotli.encode("", cache: c))
+
+  out = ""
+  assert_same out, Brotli.encode(s, out, quality: 5, cache: c)
+  assert_equal d, out
+  assert_raise(RuntimeError) { Brotli.encode(s, 10, quality: 5, cache: c) }
+  assert_equal 3, c.size
+
+  small = Brotli::Cache.new(max_bytes: s.bytesize + d.bytesize + 256)
+  Brotli.encode(s, quality: 5, cache: small)
+  Brotli.encode(s + "!", quality: 5, cache: small)
+  assert_equal 1, small.size
+  assert_equal 1, small.stats[:evictions]
+  assert_true small.bytesize <= small.max_bytes
+  assert_equal small, small.clear
+  assert_equal [0, 0], [small.size, small.bytesize]
+
+  assert_raise(TypeError) { Brotli.encode(s, cache: "x") }
+  assert_raise(ArgumentError) { Brotli::Encoder.new("", cache: c) }
+  assert_raise(ArgumentError) { Brotli::Encoder.encode_batch([s], cache: c) }
+end